@@ -0,0 +1,75 @@
+#ifndef __APIC_H_
+#define __APIC_H_
+
+#include "lib.h"
+
+#define IA32_APIC_BASE 0x1b
+#define APIC_BASE_BSP (1UL << 8)      /* 当前处理器是 BSP */
+#define APIC_BASE_X2APIC (1UL << 10)  /* 开启 x2APIC 模式 */
+#define APIC_BASE_ENABLE (1UL << 11)  /* 硬件使能 local APIC */
+
+/* x2APIC 模式下寄存器通过 MSR 访问，MSR 地址为 0x800 + (xAPIC 寄存器偏移 >> 4) */
+#define X2APIC_MSR_BASE 0x800
+
+/* local APIC 寄存器，xAPIC 模式下通过 MMIO 访问，这里是相对寄存器页的偏移 */
+#define APIC_ID 0x20
+#define APIC_VERSION 0x30
+#define APIC_TPR 0x80
+#define APIC_EOI 0xb0
+#define APIC_SVR 0xf0
+#define APIC_ICR_LOW 0x300
+#define APIC_ICR_HIGH 0x310
+#define APIC_LVT_TIMER 0x320
+#define APIC_LVT_LINT0 0x350
+#define APIC_LVT_LINT1 0x360
+
+#define APIC_SVR_ENABLE (1 << 8)      /* 软件使能 local APIC */
+#define APIC_LVT_MASKED (1 << 16)
+#define APIC_TIMER_TSC_DEADLINE (2 << 17)   /* LVT 定时器模式：到达 IA32_TSC_DEADLINE 时产生中断 */
+#define SPURIOUS_VECTOR 0xff
+
+/* ICR 命令字 */
+#define APIC_DM_FIXED (0 << 8)
+#define APIC_DM_INIT (5 << 8)
+#define APIC_DM_STARTUP (6 << 8)
+#define APIC_ICR_BUSY (1 << 12)       /* 中断还没有被目标处理器接收，x2APIC 模式下没有这一位 */
+#define APIC_INT_ASSERT (1 << 14)
+#define APIC_DEST_SELF (1 << 18)
+#define APIC_DEST_ALLINC (2 << 18)    /* 包括自己在内的所有处理器 */
+#define APIC_DEST_ALLBUT (3 << 18)    /* 除自己以外的所有处理器 */
+
+/* local APIC 寄存器页的线性地址，所有处理器访问的都是自己的 local APIC，x2APIC 模式下不使用 */
+extern unsigned long apic_base;
+/* 所有处理器都工作在 x2APIC 模式，由 BSP 根据 CPUID.01H:ECX[21] 决定 */
+extern int x2apic_enabled;
+
+static inline unsigned int apic_read(unsigned int reg) {
+  if(x2apic_enabled)
+    return rdmsr(X2APIC_MSR_BASE + (reg >> 4));
+  return *(volatile unsigned int *)(apic_base + reg);
+}
+
+static inline void apic_write(unsigned int reg, unsigned int value) {
+  if(x2apic_enabled)
+    wrmsr(X2APIC_MSR_BASE + (reg >> 4), value);
+  else
+    *(volatile unsigned int *)(apic_base + reg) = value;
+}
+
+/* x2APIC 模式下 APIC ID 占满 32 位，xAPIC 模式下位于 ID 寄存器的高 8 位 */
+static inline unsigned int apic_id() {
+  if(x2apic_enabled)
+    return apic_read(APIC_ID);
+  return apic_read(APIC_ID) >> 24;
+}
+
+/* 中断处理结束，通知 local APIC 复位 ISR 中优先级最高的位，x2APIC 模式下只需要一次 wrmsr */
+static inline void apic_eoi() {
+  apic_write(APIC_EOI, 0);
+}
+
+int apic_init();
+void local_apic_init();
+void apic_send_ipi(unsigned int dest, unsigned int icr);
+
+#endif
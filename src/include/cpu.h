@@ -3,4 +3,31 @@
 
 #define NR_CPUS 8
 
+/**
+ * @brief 执行 CPUID 指令
+ * @param Mop 主功能号，放入 EAX
+ * @param Sop 子功能号，放入 ECX
+ */
+static inline void get_cpuid(unsigned int Mop, unsigned int Sop, unsigned int *a, unsigned int *b,
+                             unsigned int *c, unsigned int *d) {
+  __asm__ __volatile__("cpuid	\n\t"
+                       : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d)
+                       : "0"(Mop), "2"(Sop));
+}
+
+/**
+ * 发生无法恢复的错误时让当前 CPU 停机
+ * 关闭中断后只有 NMI、SMI 等能唤醒 hlt，唤醒后继续停机，不再占用宿主机的处理器时间
+ * 停机之前先显示日志缓冲区中的消息，错误信息不会留在缓冲区中
+ */
+void console_flush();
+
+static inline void cpu_halt() {
+  console_flush();
+  while(1)
+    __asm__ __volatile__("cli \n\t"
+                         "hlt \n\t"
+                         : : : "memory");
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,56 @@
+#ifndef __FPU_H_
+#define __FPU_H_
+
+#define CR0_MP (1UL << 1)
+#define CR0_EM (1UL << 2)
+#define CR0_TS (1UL << 3)   /* 置位时执行 x87/SSE/AVX 指令会触发 #NM */
+#define CR0_NE (1UL << 5)
+
+#define CR4_OSFXSR (1UL << 9)
+#define CR4_OSXMMEXCPT (1UL << 10)
+#define CR4_OSXSAVE (1UL << 18)
+
+/* XCR0 中开启的状态组件：x87、SSE、AVX 以及 AVX-512 的 opmask、ZMM_Hi256、Hi16_ZMM */
+#define XFEATURE_MASK 0xe7UL
+
+/* 保存区中 x87 控制字和 MXCSR 的偏移，以及它们的初始值 */
+#define FXSAVE_FCW 0
+#define FXSAVE_MXCSR 24
+#define FCW_DEFAULT 0x37f
+#define MXCSR_DEFAULT 0x1f80
+
+struct task_struct;
+
+/**
+ * FPU/SSE/AVX 状态的大小和保存方式在 BSP 初始化时根据 CPUID 确定
+ * 1. 支持 XSAVE 时保存区大小取 CPUID.(0DH,0):EBX，否则使用 512B 的 FXSAVE 格式
+ * 2. 支持 XSAVEOPT 时使用 eager 模式，每次进程切换保存和恢复使用过 FPU 的进程的状态；
+ *    否则使用 lazy 模式，切换时只设置 CR0.TS，在 #NM 中保存上一个使用者的状态并恢复当前进程的状态
+ */
+extern unsigned long xstate_size;
+extern int fpu_eager;
+
+static inline void clts() {
+  __asm__ __volatile__("clts \n\t" ::: "memory");
+}
+
+static inline void stts() {
+  unsigned long cr0;
+  __asm__ __volatile__("movq %%cr0, %0 \n\t"
+                       "orq %1, %0 \n\t"
+                       "movq %0, %%cr0 \n\t"
+                       : "=&r"(cr0)
+                       : "i"(CR0_TS)
+                       : "memory");
+}
+
+void fpu_init();
+void fpu_cpu_init();
+int fpu_fork(struct task_struct *tsk);
+void fpu_release(struct task_struct *tsk);
+void switch_fpu(struct task_struct *prev, struct task_struct *next);
+void fpu_state_restore();
+void kernel_fpu_begin();
+void kernel_fpu_end();
+
+#endif
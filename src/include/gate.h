@@ -78,6 +78,19 @@ Content: | segment selector   | offset 15:00      |
     __asm__ __volatile__("ltr	%%ax" : : "a"(n << 3) : "memory");             \
   } while (0)
 
+/**
+ * @brief 在 GDT 的第 n 项写入 64 位 TSS 段描述符，描述符占用 n 和 n + 1 两项
+ * 格式与 head.S 中 set_TSS64 构造的描述符相同：P = 1，DPL = 0，TYPE = 9，段长度 103
+ */
+static inline void set_tss_descriptor(unsigned int n, void *addr) {
+  unsigned long base = (unsigned long)addr;
+  unsigned long limit = 103;
+
+  *(unsigned long *)(GDT_Table + n) = (limit & 0xffff) | ((base & 0xffffff) << 16) | (0x89UL << 40) |
+                                      (((limit >> 16) & 0xf) << 48) | (((base >> 24) & 0xff) << 56);
+  *(unsigned long *)(GDT_Table + n + 1) = base >> 32;
+}
+
 /* 配置 TSS 段内的 RSP 和 IST 项 */
 void set_tss64(unsigned long rsp0, unsigned long rsp1, unsigned long rsp2,
                unsigned long ist1, unsigned long ist2, unsigned long ist3,
@@ -117,4 +130,9 @@ static inline void set_system_gate(unsigned int n, unsigned char ist, void *addr
   _set_gate(IDT_Table + n, 0xEF, ist, addr); /* P, DPL = 3，TYPE = F */
 }
 
+/* 应用层可以通过 INT 指令触发的中断门描述符设置 */
+static inline void set_system_intr_gate(unsigned int n, unsigned char ist, void *addr) {
+  _set_gate(IDT_Table + n, 0xEE, ist, addr); /* P, DPL = 3，TYPE = E */
+}
+
 #endif
\ No newline at end of file
@@ -2,8 +2,117 @@
 #define __INTERRUPT_H_
 
 #include "linkage.h"
+#include "ptrace.h"
+#include "spinlock.h"
+
+/* IRQ n 使用的中断向量为 IRQ_VECTOR_BASE + n，8259A 和 I/O APIC 相同 */
+#define IRQ_VECTOR_BASE 0x20
+#define NR_IRQS 24
+
+/* 保存中断的上下文，过程和异常上下文保存大致一样 */
+#define SAVE_ALL                                                               \
+  "cld;               \n\t"                                                    \
+  "pushq  %rax;       \n\t"                                                    \
+  "pushq  %rax;       \n\t"                                                    \
+  "movq   %es,  %rax; \n\t"                                                    \
+  "pushq  %rax;       \n\t"                                                    \
+  "movq   %ds,  %rax; \n\t"                                                    \
+  "pushq  %rax;       \n\t"                                                    \
+  "xorq   %rax, %rax; \n\t"                                                    \
+  "pushq  %rbp;       \n\t"                                                    \
+  "pushq  %rdi;       \n\t"                                                    \
+  "pushq  %rsi;       \n\t"                                                    \
+  "pushq  %rdx;       \n\t"                                                    \
+  "pushq  %rcx;       \n\t"                                                    \
+  "pushq  %rbx;       \n\t"                                                    \
+  "pushq  %r8;        \n\t"                                                    \
+  "pushq  %r9;        \n\t"                                                    \
+  "pushq  %r10;       \n\t"                                                    \
+  "pushq  %r11;       \n\t"                                                    \
+  "pushq  %r12;       \n\t"                                                    \
+  "pushq  %r13;       \n\t"                                                    \
+  "pushq  %r14;       \n\t"                                                    \
+  "pushq  %r15;       \n\t"                                                    \
+  "movq   $0x10, %rdx;\n\t"                                                    \
+  "movq   %rdx, %ds;  \n\t"                                                    \
+  "movq   %rdx, %es;  \n\t"
+
+/**
+ * 被打断的程序位于应用层（CS 的 RPL 为 3）时，切换到内核的 GS 基地址
+ * cs 为栈上 CS 相对栈顶的偏移，中断门会关闭中断，所以 swapgs 之前不会被其他中断打断
+ */
+#define SWAPGS_FROM_USER(cs)                                                   \
+  "testb $3, " #cs "(%rsp) \n\t"                                              \
+  "jz 1f \n\t"                                                                 \
+  "swapgs \n\t"                                                                \
+  "1: \n\t"
+
+#define IRQ_NAME2(nr) nr##_interrupt(void)
+#define IRQ_NAME(nr)  IRQ_NAME2(IRQ##nr)
+
+/**
+ * 定义中断处理函数的入口部分
+ * void IRQ_NAME(nr) 声明了函数 IRQnr_interrupt()
+ * 
+ * 后续的内嵌汇编定义了 IRQnr_interrupt 的入口部分
+ * 0. 从应用层进入时通过 swapgs 切换到本 CPU 的 cpu_data
+ * 1. 调用 SAVE_ALL 保存相关寄存器，以及设置 ds 和 es 为内核代码段
+ * 2. 保存 ret_from_intr 的地址，用于中断处理函数执行完毕的 ret 指令
+ * 3. 跳转到 do_IRQ 函数执行
+ */
+#define Build_IRQ(nr)                                                          \
+  void IRQ_NAME(nr);                                                           \
+  __asm__(SYMBOL_NAME_STR(IRQ) #nr "_interrupt:\n\t"                           \
+                                   SWAPGS_FROM_USER(0x08)                      \
+                                   "pushq $0x00  \n\t" SAVE_ALL                \
+                                   "movq %rsp, %rdi  \n\t"                     \
+                                   "leaq ret_from_intr(%rip), %rax \n\t"       \
+                                   "pushq %rax \n\t"                           \
+                                   "movq $" #nr ", %rsi  \n\t"                 \
+                                   "jmp do_IRQ \n\t");
+
+/**
+ * 中断控制器的操作，8259A 和 I/O APIC 各提供一组
+ * enable/disable 屏蔽或者开启一条中断线，ack 在中断处理完成后发送 EOI
+ */
+struct hw_int_controller {
+  char *name;
+  void (*enable)(unsigned long irq);
+  void (*disable)(unsigned long irq);
+  void (*ack)(unsigned long irq);
+};
+
+typedef void (*irq_handler_t)(unsigned long irq, unsigned long parameter, struct pt_regs *regs);
+
+/* 中断处理函数，共享同一条中断线的处理函数连接成单链表，中断到来时依次调用 */
+struct irqaction {
+  irq_handler_t handler;
+  unsigned long parameter;  /* 注册时传入，调用处理函数时原样传回 */
+  char *name;
+  struct irqaction *next;
+};
+
+/**
+ * 中断线描述符
+ * count、total_cycles、max_cycles 统计中断次数以及从进入 do_IRQ 到发送 EOI 的 TSC 周期数；
+ * 同一个 IRQ 同一时刻只投递给一个 CPU 且处理期间关闭中断，所以统计值不需要加锁
+ */
+struct irq_desc {
+  struct hw_int_controller *controller;
+  struct irqaction *action;
+  spinlock_t lock;          /* 保护 action 链表 */
+  unsigned long count;
+  unsigned long total_cycles;
+  unsigned long max_cycles;
+};
+
+extern struct irq_desc irq_desc[NR_IRQS];
+extern struct hw_int_controller i8259_controller;
 
 void init_interrupt();
 void do_IRQ(unsigned long regs, unsigned long nr);
+int register_irq(unsigned long irq, irq_handler_t handler, unsigned long parameter, char *name);
+int unregister_irq(unsigned long irq, irq_handler_t handler, unsigned long parameter);
+void irq_stat_print();
 
 #endif
\ No newline at end of file
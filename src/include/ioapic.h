@@ -0,0 +1,31 @@
+#ifndef __IOAPIC_H_
+#define __IOAPIC_H_
+
+#include "interrupt.h"
+
+/* 没有解析 ACPI MADT，使用 PC 上 I/O APIC 的默认物理地址 */
+#define IOAPIC_PHY_ADDR 0xfec00000UL
+
+/* 间接访问寄存器：先向 IOREGSEL 写入寄存器编号，再通过 IOWIN 读写 */
+#define IOAPIC_IOREGSEL 0x00
+#define IOAPIC_IOWIN 0x10
+
+#define IOAPIC_ID 0x00
+#define IOAPIC_VER 0x01
+#define IOAPIC_REDTBL(pin) (0x10 + 2 * (pin))   /* 每个重定向表项 64 位，占两个寄存器 */
+
+/* 重定向表项 */
+#define IOAPIC_MASKED (1UL << 16)
+#define IOAPIC_LEVEL (1UL << 15)
+#define IOAPIC_ACTIVE_LOW (1UL << 13)
+#define IOAPIC_DEST_SHIFT 56
+
+extern int ioapic_enabled;
+extern struct hw_int_controller ioapic_controller;
+
+int ioapic_init();
+void ioapic_enable_irq(unsigned int irq);
+void ioapic_disable_irq(unsigned int irq);
+int irq_set_affinity(unsigned int irq, unsigned int cpu);
+
+#endif
@@ -22,6 +22,21 @@
 #define nop() __asm__ __volatile__("nop	\n\t")
 #define io_mfence() __asm__ __volatile__("mfence	\n\t" ::: "memory")
 
+/* 保存 RFLAGS 并关闭中断，与 local_irq_restore 配对使用 */
+#define local_irq_save(x)                                                      \
+  __asm__ __volatile__("pushfq	\n\t"                                         \
+                       "popq	%0	\n\t"                                        \
+                       "cli	\n\t"                                            \
+                       : "=g"(x)                                               \
+                       :                                                       \
+                       : "memory")
+#define local_irq_restore(x)                                                   \
+  __asm__ __volatile__("pushq	%0	\n\t"                                       \
+                       "popfq	\n\t"                                          \
+                       :                                                       \
+                       : "g"(x)                                                \
+                       : "memory")
+
 struct List {
   struct List *prev;
   struct List *next;
@@ -311,6 +326,91 @@ static inline unsigned long bit_clean(unsigned long *addr, unsigned long nr) {
   return *addr & (~(1UL << nr));
 }
 
+/**
+ * 返回 word 中最低的置位 bit 的下标，word 不能为 0
+ * rep; bsf 在支持 BMI1 的处理器上被解码为 tzcnt，在旧处理器上仍然是 bsf，两者对非 0 输入的结果相同
+ */
+static inline unsigned long __ffs(unsigned long word) {
+  __asm__("rep; bsfq	%1,	%0	\n\t" : "=r"(word) : "rm"(word));
+  return word;
+}
+
+/* 返回 word 中最低的复位 bit 的下标，word 不能全为 1 */
+static inline unsigned long ffz(unsigned long word) {
+  return __ffs(~word);
+}
+
+/* 统计 word 中置位 bit 的数量 */
+static inline unsigned long hweight64(unsigned long word) {
+  unsigned long res;
+  __asm__("popcntq	%1,	%0	\n\t" : "=r"(res) : "rm"(word));
+  return res;
+}
+
+/**
+ * @brief 从位图的第 offset 位开始查找第一个复位的 bit
+ * 按照 unsigned long 为单位跳过全为 1 的字，再用 tzcnt 直接定位字内的 bit
+ * 
+ * @param addr 位图起始地址
+ * @param size 位图的有效 bit 数
+ * @param offset 起始查找位置
+ * @return unsigned long 找到的 bit 下标，找不到时返回 size
+ */
+static inline unsigned long find_next_zero_bit(unsigned long *addr, unsigned long size, unsigned long offset) {
+  unsigned long idx, word;
+
+  if(offset >= size)
+    return size;
+  idx = offset >> 6;
+  word = addr[idx] | ((1UL << (offset & 63)) - 1);  /* 将 offset 之前的 bit 视为已置位 */
+  while(word == ~0UL) {
+    if((++idx << 6) >= size)
+      return size;
+    word = addr[idx];
+  }
+  offset = (idx << 6) + ffz(word);
+  return offset < size ? offset : size;
+}
+
+/* 从位图的第 offset 位开始查找第一个置位的 bit，找不到时返回 size */
+static inline unsigned long find_next_bit(unsigned long *addr, unsigned long size, unsigned long offset) {
+  unsigned long idx, word;
+
+  if(offset >= size)
+    return size;
+  idx = offset >> 6;
+  word = addr[idx] & ~((1UL << (offset & 63)) - 1); /* 将 offset 之前的 bit 视为已复位 */
+  while(!word) {
+    if((++idx << 6) >= size)
+      return size;
+    word = addr[idx];
+  }
+  offset = (idx << 6) + __ffs(word);
+  return offset < size ? offset : size;
+}
+
+/* 将位图中 [start, start + nr) 的 bit 全部置位 */
+static inline void bitmap_set(unsigned long *addr, unsigned long start, unsigned long nr) {
+  while(nr) {
+    unsigned long shift = start & 63;
+    unsigned long bits = 64 - shift < nr ? 64 - shift : nr;
+    addr[start >> 6] |= (bits == 64 ? ~0UL : ((1UL << bits) - 1)) << shift;
+    start += bits;
+    nr -= bits;
+  }
+}
+
+/* 将位图中 [start, start + nr) 的 bit 全部复位 */
+static inline void bitmap_clear(unsigned long *addr, unsigned long start, unsigned long nr) {
+  while(nr) {
+    unsigned long shift = start & 63;
+    unsigned long bits = 64 - shift < nr ? 64 - shift : nr;
+    addr[start >> 6] &= ~((bits == 64 ? ~0UL : ((1UL << bits) - 1)) << shift);
+    start += bits;
+    nr -= bits;
+  }
+}
+
 /*
 
 */
@@ -377,6 +477,13 @@ static inline void io_out32(unsigned short port, unsigned int value) {
                        "c"(nr)                                                 \
                        : "memory")
 
+/* 读取时间戳计数器 */
+static inline unsigned long rdtsc() {
+  unsigned int lo, hi;
+  __asm__ __volatile__("rdtsc	\n\t" : "=a"(lo), "=d"(hi) : : "memory");
+  return (unsigned long)hi << 32 | lo;
+}
+
 static inline unsigned long rdmsr(unsigned long address) {
   unsigned int tmp0 = 0;
   unsigned int tmp1 = 0;
@@ -1,8 +1,10 @@
 #ifndef __MEMORY_H_
 #define __MEMORY_H_
 
+#include "cpu.h"
 #include "printk.h"
 #include "lib.h"
+#include "spinlock.h"
 
 #define PTRS_PER_PAGE 512   /* 页表项个数 */
 #define PAGE_OFFSET ((unsigned long)0xffff800000000000)   /* 内核层的起始线性地址 */
@@ -15,10 +17,12 @@
 #define PAGE_4K_SHIFT  12
 
 /* 不同页大小的容量 */
+#define PAGE_1G_SIZE (1UL << PAGE_1G_SHIFT)
 #define PAGE_2M_SIZE (1UL << PAGE_2M_SHIFT)
 #define PAGE_4K_SIZE (1UL << PAGE_4K_SHIFT)
 
 /* 可以用于下取整 */
+#define PAGE_1G_MASK (~(PAGE_1G_SIZE - 1))
 #define PAGE_2M_MASK (~(PAGE_2M_SIZE - 1))
 #define PAGE_4K_MASK (~(PAGE_4K_SIZE - 1))
 
@@ -55,6 +59,30 @@ typedef struct {
 #define mk_pt(addr, attr) ((unsigned long)(addr) | (unsigned long)(attr))
 #define set_pt(ptptr, ptval) (*(ptptr) = (ptval))
 
+/* 页表项属性 */
+#define PAGE_XD (1UL << 63)     /* 禁止执行 */
+#define PAGE_PAT (1UL << 7)     /* 4K 页表项的 PAT 位 */
+#define PAGE_Global (1UL << 8)  /* 全局页，切换 CR3 时不刷新 */
+#define PAGE_PS (1UL << 7)      /* PDPTE 和 PDE 中表示 1G/2M 大页 */
+#define PAGE_Dirty (1UL << 6)
+#define PAGE_Accessed (1UL << 5)
+#define PAGE_PCD (1UL << 4)     /* 禁止缓存 */
+#define PAGE_PWT (1UL << 3)     /* 直写 */
+#define PAGE_U_S (1UL << 2)     /* 1: 应用层可以访问 */
+#define PAGE_R_W (1UL << 1)     /* 1: 可写 */
+#define PAGE_Present (1UL << 0)
+
+/* 页表项中物理地址部分的掩码 */
+#define PAGE_ADDR_MASK (0x000ffffffffff000UL)
+
+/* 指向下一级页表的表项属性，实际的访问权限由最后一级页表项决定 */
+#define PAGE_KERNEL_Dir (PAGE_R_W | PAGE_Present)
+#define PAGE_USER_Dir (PAGE_U_S | PAGE_R_W | PAGE_Present)
+
+/* 最后一级页表项属性，map_pages 会根据页大小自动加上 PAGE_PS */
+#define PAGE_KERNEL_Page (PAGE_R_W | PAGE_Present)
+#define PAGE_USER_Page (PAGE_U_S | PAGE_R_W | PAGE_Present)
+
 int ZONE_DMA_INDEX = 0;
 int ZONE_NORMAL_INDEX = 0;  // low 1GB RAM，已经在页表里面映射
 int ZONE_UNMAPED_INDEX = 0; // above 1GB RAM，没有经过页表映射
@@ -63,6 +91,7 @@ int ZONE_UNMAPED_INDEX = 0; // above 1GB RAM，没有经过页表映射
 #define ZONE_DMA (1 << 0)
 #define ZONE_NORMAL (1 << 1)
 #define ZONE_UNMAPED (1 << 2)
+#define ZONE_4K_FRAME (1 << 3)  // zone 由一个 2M 页拆分出来的 4K 页组成，见 struct frame_pool
 
 /* 页面属性 */
 #define PG_PTable_Maped (1 << 0)
@@ -75,6 +104,13 @@ int ZONE_UNMAPED_INDEX = 0; // above 1GB RAM，没有经过页表映射
 #define PG_Kernel (1 << 7)
 #define PG_K_Share_To_U (1 << 8)
 #define PG_Slab (1 << 9)
+#define PG_Frame_Pool (1 << 10)   /* 该 2M 页已经被拆分成 4K 页使用 */
+
+/* 启动阶段每个 zone 立即初始化的 page 数量，也是之后每次延迟初始化的 page 数量 */
+#define DEFERRED_INIT_PAGES 64
+
+/* 伙伴系统的阶数，最大空闲块为 2^(MAX_ORDER - 1) 个连续页 */
+#define MAX_ORDER 11
 
 /**
  * @brief 内存解析结构体，大小为 20B
@@ -96,6 +132,31 @@ struct E820 {
   unsigned int type;
 }__attribute__((packed));
 
+/**
+ * 每个 CPU 单页缓存一次从页池批量获取/归还的页数，以及缓存页数的上限
+ * 缓存只用于 4K 页，每个 CPU 最多缓存 PCP_HIGH 个 4K 页（256KB）；
+ * 2M 页的单页分配直接使用伙伴系统，不会把大量内存压在某个 CPU 的缓存中
+ */
+#define PCP_BATCH 16
+#define PCP_HIGH (PCP_BATCH * 4)
+
+/**
+ * @brief 每个 CPU 私有的 4K 单页缓存
+ * 单页的分配和释放只操作当前 CPU 的链表，链表头部是刚释放的热页，尾部是冷页；
+ * 缓存中的页面可以来自不同的页池，它们在页池看来是已使用的，批量获取/归还时才更新页池的统计信息
+ */
+struct per_cpu_pages {
+  struct List list;       /* 缓存的空闲页，链接 page->list */
+  unsigned long count;    /* 缓存的页数 */
+  unsigned long high;     /* 超过该值时归还 batch 个冷页 */
+  unsigned long batch;    /* 批量操作的页数 */
+
+  unsigned long hit;      /* 直接从缓存中分配的次数 */
+  unsigned long miss;     /* 缓存为空，需要从页池补充的次数 */
+  unsigned long drain;    /* 向页池归还的次数 */
+  volatile unsigned long flushed;   /* 响应 drain_all_pages 清空缓存的次数 */
+} ____cacheline_aligned;
+
 /**
  * @brief 保存所有关于内存的信息，用于内存管理
  */
@@ -124,6 +185,21 @@ struct Global_Memory_Descriptor {
    */
   unsigned long start_code, end_code, end_data, end_brk;
   unsigned long end_of_struct;
+
+  struct List frame_pools;          /* 所有 4K 页池 struct frame_pool 组成的链表 */
+  unsigned long frame_pools_count;  /* 4K 页池的数量 */
+  struct per_cpu_pages frame_pcp[NR_CPUS];  /* 每个 CPU 的 4K 单页缓存 */
+
+  spinlock_t lock;                  /* 保护伙伴系统以及 4K 页池，CPU 缓存只由所属的 CPU 在关闭中断时访问 */
+};
+
+/**
+ * @brief 伙伴系统中某一阶的空闲块链表
+ * 链表中链接的是每个空闲块首页的 page->list
+ */
+struct free_area {
+  struct List free_list;
+  unsigned long nr_free;  /* 该阶空闲块的数量 */
 };
 
 /**
@@ -142,6 +218,10 @@ struct zone {
   unsigned long page_using_count;     /* 已使用的物理内存页数量 */
   unsigned long page_free_count;      /* 空闲物理内存页数量 */
   unsigned long total_pages_link;     /* 本区域物理页被引用次数 */
+
+  struct free_area free_area[MAX_ORDER];  /* 伙伴系统空闲链表，第 i 项链接大小为 2^i 页的空闲块 */
+
+  unsigned long pages_initialized;    /* 已经初始化的 page 数量，从 pages_group 起始处开始计算 */
 };
 
 /**
@@ -153,15 +233,60 @@ struct page {
   unsigned long attribute;        /* 页的属性，映射状态、活动状态、使用者等信息 */
   unsigned long reference_count;  /* 该页的引用次数 */
   unsigned long age;              /* 该页的创建时间 */
+
+  struct List list;               /* 作为空闲块首页时链入 zone->free_area[] */
+  long buddy_order;               /* 空闲块首页记录块的阶数，不是空闲块首页时为 -1 */
+
+  struct slab *slab;              /* PG_Slab 页面所属的 slab 描述符 */
 };
 
+/* 一个 2M 页能拆分出来的 4K 页数量 */
+#define FRAME_POOL_PAGES (PAGE_2M_SIZE / PAGE_4K_SIZE)
+
+/**
+ * @brief 4K 页池，位于一个 2M 物理页的起始处
+ * 池内的 4K 页拥有独立的 struct page 数组，并由 zone 成员的伙伴系统管理，
+ * 本结构体自身占用的前若干个 4K 页在池初始化时就被标记为已使用
+ */
+struct frame_pool {
+  struct zone zone;         /* 以 4K 页为单位的 zone，attribute 为 ZONE_4K_FRAME */
+  struct List list;         /* 链入 memory_management_struct.frame_pools */
+  struct page *page_2m;     /* 承载本页池的 2M 物理页 */
+  struct page pages[FRAME_POOL_PAGES];
+};
+
+/* 页池头部占用的 4K 页数量 */
+#define FRAME_POOL_RESERVED ((sizeof(struct frame_pool) + PAGE_4K_SIZE - 1) >> PAGE_4K_SHIFT)
+
 void init_memory();
 unsigned long page_init(struct page *page, unsigned long flags);
 unsigned long page_clean(struct page *page);
 struct page *alloc_pages(int zone_select, int number, unsigned long page_flags);
+void free_pages(struct page *page, int number);
+void free_cold_page(struct page *page);
+void pcp_stat_print();
+void drain_local_pages();
+void deferred_memory_init();
+struct page *alloc_pages_4k(int number, unsigned long page_flags);
+void free_pages_4k(struct page *page, int number);
+struct page *phy_to_4k_page(unsigned long addr);
 extern struct Global_Memory_Descriptor memory_management_struct;
 extern unsigned long *Global_CR3;
 
+/* 页表管理，pgd 是 PML4 页表的物理地址 */
+void pagetable_init();
+int map_pages(unsigned long *pgd, unsigned long vaddr, unsigned long paddr, unsigned long size,
+              unsigned long prot);
+int unmap_pages(unsigned long *pgd, unsigned long vaddr, unsigned long size);
+int protect_pages(unsigned long *pgd, unsigned long vaddr, unsigned long size, unsigned long prot);
+unsigned long *get_pte(unsigned long *pgd, unsigned long vaddr, unsigned long *page_size);
+void tlb_init();
+unsigned long *pgd_alloc();
+void pgd_free(unsigned long *pgd);
+unsigned long pcid_alloc();
+void pcid_free(unsigned long pcid);
+int do_user_page_fault(unsigned long address, unsigned long error_code);
+
 /* 获取页目录地址 */
 static inline unsigned long *get_gdt() {
   unsigned long *tmp;
@@ -169,7 +294,15 @@ static inline unsigned long *get_gdt() {
   return tmp;
 }
 
-/* 刷新 TLB，只需要重新加载 CR3 寄存器即可 */
+#define CR4_PGE (1UL << 7)
+#define CR4_PCIDE (1UL << 17)
+#define CR3_NOFLUSH (1UL << 63)   /* 启用 PCID 后加载 CR3 时保留该 PCID 的 TLB 表项 */
+#define PCID_MASK 0xfffUL
+#define PCID_SHARED PCID_MASK     /* PCID 用完之后由多个地址空间共用，每次加载都刷新 */
+
+extern int pcid_enabled;
+
+/* 刷新当前 PCID 的非全局 TLB 表项，只需要重新加载 CR3 寄存器即可 */
 static inline void flush_tlb() {
   unsigned long tmpreg;
   __asm__ __volatile__("movq %%cr3, %0\n\t"
@@ -179,4 +312,73 @@ static inline void flush_tlb() {
                        : "memory");
 }
 
+/**
+ * 刷新所有 PCID 的全部 TLB 表项，包括全局页
+ * 修改 CR4.PGE 会无效化所有的 TLB 表项，翻转两次恢复原值
+ */
+static inline void flush_tlb_all() {
+  unsigned long cr4;
+  __asm__ __volatile__("movq %%cr4, %0\n\t"
+                       "xorq %1, %0\n\t"
+                       "movq %0, %%cr4\n\t"
+                       "xorq %1, %0\n\t"
+                       "movq %0, %%cr4\n\t"
+                       : "=&r"(cr4)
+                       : "r"(CR4_PGE)
+                       : "memory");
+}
+
+/**
+ * 无效化线性地址 addr 所在页面的 TLB 表项，对大页同样有效
+ * 全局页的表项在所有 PCID 中都会被无效化，非全局页只作用于当前 PCID
+ */
+static inline void flush_tlb_one(unsigned long addr) {
+  __asm__ __volatile__("invlpg (%0)\n\t" : : "r"(addr) : "memory");
+}
+
+/* 超过这么多页时逐页 invlpg 的开销比重新加载 CR3 更大 */
+#define TLB_FLUSH_ALL_THRESHOLD 32
+
+/**
+ * @brief 无效化线性地址 [start, end) 的 TLB 表项
+ * 1. 内核层的映射被所有地址空间共享，启用 PCID 后其他 PCID 中可能缓存着非全局的内核层表项，
+ *    invlpg 和重新加载 CR3 都只作用于当前 PCID，所以刷新所有 PCID；
+ *    内核层的修改只发生在启动和设备初始化时，不影响性能
+ * 2. 页数超过 TLB_FLUSH_ALL_THRESHOLD 时直接刷新整个 TLB，内核层需要连同全局页一起刷新
+ */
+static inline void flush_tlb_range(unsigned long start, unsigned long end) {
+  int many = ((end - start) >> PAGE_4K_SHIFT) > TLB_FLUSH_ALL_THRESHOLD;
+
+  if(end <= start)
+    return;
+  if(start >= PAGE_OFFSET && (pcid_enabled || many)) {
+    flush_tlb_all();
+    return;
+  }
+  if(many) {
+    flush_tlb();
+    return;
+  }
+  for(unsigned long addr = start & PAGE_4K_MASK; addr < end; addr += PAGE_4K_SIZE)
+    flush_tlb_one(addr);
+}
+
+/**
+ * @brief 切换页表
+ * 启用 PCID 后不同地址空间的 TLB 表项通过 PCID 区分，切换时不需要刷新 TLB
+ *
+ * @param pgd PML4 页表的物理地址
+ * @param pcid 地址空间的 PCID，未启用 PCID 时被忽略
+ * @param flush 不为 0 时丢弃该 PCID 原有的 TLB 表项
+ */
+static inline void load_cr3(unsigned long pgd, unsigned long pcid, int flush) {
+  unsigned long cr3 = pgd;
+  if(pcid_enabled) {
+    cr3 |= pcid & PCID_MASK;
+    if(!flush)
+      cr3 |= CR3_NOFLUSH;
+  }
+  __asm__ __volatile__("movq %0, %%cr3\n\t" : : "r"(cr3) : "memory");
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,79 @@
+#ifndef __PERCPU_H_
+#define __PERCPU_H_
+
+#include "cpu.h"
+
+#define IA32_FS_BASE 0xc0000100
+#define IA32_GS_BASE 0xc0000101
+#define IA32_KERNEL_GS_BASE 0xc0000102  /* swapgs 与 IA32_GS_BASE 交换的值 */
+
+struct task_struct;
+struct schedule;
+struct tss_struct;
+
+/**
+ * 每个 CPU 私有的数据区
+ * 内核运行时 IA32_GS_BASE 指向本 CPU 的 cpu_data，应用层的 GS 基地址保存在 IA32_KERNEL_GS_BASE 中，
+ * 进入和离开应用层时通过 swapgs 交换两者
+ * 成员都是 8B，可以通过一条 %gs 相对寻址的指令读写，entry.S 依赖 current_task、tss、softirq_pending 和 user_rsp 的偏移
+ */
+struct cpu_data {
+  struct cpu_data *self;            /* 0x00 本结构体的线性地址 */
+  struct task_struct *current_task; /* 0x08 当前进程 */
+  unsigned long cpu_id;             /* 0x10 */
+  struct schedule *rq;              /* 本 CPU 的就绪队列 */
+  struct tss_struct *tss;           /* 0x20 本 CPU 的 TSS */
+  unsigned long apic_id;            /* 本 CPU 的 local APIC ID，用作 I/O APIC 和 IPI 的投递目标 */
+  unsigned long softirq_pending;    /* 0x30 等待执行的软中断，每个软中断占一位 */
+  struct task_struct *ksoftirqd;    /* 本 CPU 的软中断线程 */
+  unsigned long next_tick;          /* local APIC 定时器下一次到期的 TSC 值 */
+  unsigned long tick_stopped;       /* 空闲时停止了周期性时钟节拍 */
+  struct task_struct *fpu_owner;    /* FPU 寄存器中保存的是该进程的状态，为 NULL 时不属于任何进程 */
+  unsigned long user_rsp;           /* 0x58 SYSCALL 入口切换到内核栈之前暂存应用层的 RSP */
+
+  /* 统计计数 */
+  unsigned long irq_count;          /* 外部中断次数 */
+  unsigned long ipi_count;          /* 处理器间中断次数 */
+  unsigned long syscall_count;      /* 系统调用次数 */
+  unsigned long switch_count;       /* 进程切换次数 */
+} __attribute__((aligned(64)));     /* 各 CPU 的数据不共享缓存行 */
+
+extern struct cpu_data cpu_data[NR_CPUS];
+
+#define this_cpu_offset(field) __builtin_offsetof(struct cpu_data, field)
+
+/* 读取本 CPU 的 cpu_data 成员 */
+#define this_cpu_read(field)                                                   \
+  ({                                                                           \
+    unsigned long __v;                                                         \
+    __asm__ __volatile__("movq %%gs:%c1, %0 \n\t"                              \
+                         : "=r"(__v)                                           \
+                         : "i"(this_cpu_offset(field)));                       \
+    (typeof(((struct cpu_data *)0)->field))__v;                                \
+  })
+
+#define this_cpu_write(field, value)                                           \
+  __asm__ __volatile__("movq %0, %%gs:%c1 \n\t"                                \
+                       :                                                       \
+                       : "r"((unsigned long)(value)), "i"(this_cpu_offset(field)) \
+                       : "memory")
+
+/* 只有本 CPU 会修改自己的计数，不需要 lock 前缀 */
+#define this_cpu_inc(field)                                                    \
+  __asm__ __volatile__("incq %%gs:%c0 \n\t" : : "i"(this_cpu_offset(field)) : "memory")
+
+/* 置位本 CPU 的 cpu_data 成员的第 nr 位，一条指令完成，不会被本 CPU 的中断打断 */
+#define this_cpu_set_bit(field, nr)                                            \
+  __asm__ __volatile__("btsq %0, %%gs:%c1 \n\t"                                \
+                       :                                                       \
+                       : "r"((unsigned long)(nr)), "i"(this_cpu_offset(field)) \
+                       : "memory", "cc")
+
+static inline unsigned int smp_processor_id() {
+  return this_cpu_read(cpu_id);
+}
+
+void percpu_init(unsigned int cpu);
+void percpu_stat_print();
+
+#endif
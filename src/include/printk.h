@@ -27,7 +27,18 @@
 
 extern unsigned char font_ascii[256][16];
 
-char buf[4096] = {0};
+/* loader 设置的 VBE 帧缓存物理地址，head.S 将它映射到 0xffff800000a00000 */
+#define FB_PHY_ADDR 0xe0000000UL
+
+/* 日志级别，数值越小越重要 */
+#define LOG_EMERG 0
+#define LOG_ALERT 1
+#define LOG_CRIT 2
+#define LOG_ERR 3
+#define LOG_WARNING 4
+#define LOG_NOTICE 5
+#define LOG_INFO 6
+#define LOG_DEBUG 7
 
 /**
  * 用于屏幕显示信息的结构体，包含
@@ -53,6 +64,17 @@ struct position {
 void putchar(unsigned int *fb, int Xsize, int x, int y, unsigned int FRcolor,
              unsigned int BKcolor, unsigned char font);
 
+/* 字符显示方式，由 glyph_init 根据 CPUID 选择 */
+#define GLYPH_SCALAR 0
+#define GLYPH_SSE2 1
+#define GLYPH_AVX 2
+
+extern int glyph_mode;
+
+void glyph_init();
+void glyph_blit(unsigned int *fb, int Xsize, int x, int y, unsigned int FRcolor,
+                unsigned int BKcolor, unsigned char font, int simd);
+
 /*
 
 */
@@ -74,13 +96,14 @@ int skip_atoi(const char **s);
 
 */
 
-static char *number(char *str, long num, int base, int size, int precision,
+static char *number(char *str, char *end, long num, int base, int size, int precision,
                     int type);
 
 /*
 
 */
 
+int vsnprintf(char *buf, unsigned long size, const char *fmt, va_list args);
 int vsprintf(char *buf, const char *fmt, va_list args);
 
 /*
@@ -89,5 +112,12 @@ int vsprintf(char *buf, const char *fmt, va_list args);
 
 int color_printk(unsigned int FRcolor, unsigned int BKcolor, const char *fmt,
                  ...);
+int printk_level(unsigned int level, unsigned int FRcolor, unsigned int BKcolor, const char *fmt,
+                 ...);
+int vprintk_emit(unsigned int level, unsigned int FRcolor, unsigned int BKcolor, const char *fmt,
+                 va_list args);
+long console_write(unsigned int FRcolor, unsigned int BKcolor, const char *s, long len);
+void console_flush();
+void console_init();
 
 #endif
@@ -0,0 +1,39 @@
+#ifndef __SCHEDULE_H_
+#define __SCHEDULE_H_
+
+#include "spinlock.h"
+#include "task.h"
+#include "timer.h"
+
+/* 进程一次被调度能够运行的时钟节拍数，优先级越高时间片越长 */
+#define TASK_TIMESLICE(tsk) ((MAX_PRIO - (tsk)->priority) * HZ / 200 + 1)
+
+#define PRIO_BITMAP_LONGS ((MAX_PRIO + 63) / 64)
+
+/**
+ * 就绪队列，每个 CPU 一个
+ * 1. 每个优先级一个链表，相同优先级的进程先进先出
+ * 2. bitmap 记录哪些优先级的链表非空，最高优先级通过 bsf 指令在 O(1) 时间内找到
+ * 3. 正在运行的进程不在队列中，队列为空时运行本 CPU 的 0 号进程
+ * 4. 进程创建后固定在一个 CPU 上运行，只有本 CPU 会从队列中取出进程，
+ *    其他 CPU 只会在唤醒进程时向队列中插入，这两种操作都需要持有 lock
+ */
+struct schedule {
+  spinlock_t lock;
+  long running_task_count;                    /* 就绪队列中的进程数量 */
+  unsigned long bitmap[PRIO_BITMAP_LONGS];    /* 第 i 位置位表示 task_queue[i] 非空 */
+  struct List task_queue[MAX_PRIO];           /* 各优先级的就绪队列 */
+  struct task_struct *idle;                   /* 本 CPU 的 0 号进程 */
+};
+
+extern struct schedule task_schedule[NR_CPUS];
+
+void schedule_init();
+void schedule();
+void scheduler_tick();
+void check_preempt_curr();
+void wakeup_process(struct task_struct *tsk);
+long select_task_cpu();
+void cpu_idle();
+
+#endif
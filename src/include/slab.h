@@ -0,0 +1,72 @@
+#ifndef __SLAB_H_
+#define __SLAB_H_
+
+#include "lib.h"
+#include "linkage.h"
+#include "mem.h"
+
+/* 对象大小超过该值时，slab 描述符不再放在 slab 内部，而是通过 kmalloc 单独分配 */
+#define SLAB_OFF_SLAB_LIMIT 512
+
+/* 通用缓存的对象大小为 32B ~ 1MB 之间的 2 的幂 */
+#define KMALLOC_MIN_SHIFT 5
+#define KMALLOC_MAX_SHIFT 20
+#define KMALLOC_CACHE_NR (KMALLOC_MAX_SHIFT - KMALLOC_MIN_SHIFT + 1)
+
+/**
+ * @brief slab 描述符
+ * 一个 slab 由若干个连续的 4K 页组成，页面被划分成同样大小的对象，
+ * 对象的分配情况由 bitmap 记录，bit 为 1 表示该对象已被分配
+ */
+struct slab {
+  struct List list;             /* 链入 cache 的 partial/full/free 链表 */
+  struct kmem_cache *cache;     /* 所属的对象缓存 */
+  struct page *page;            /* slab 的第一个 4K 页 */
+
+  void *vaddress;               /* 第一个对象的线性地址，已经加上着色偏移 */
+  unsigned long color_offset;   /* 本 slab 的着色偏移 */
+
+  unsigned long using_count;    /* 已分配的对象数量 */
+  unsigned long free_count;     /* 空闲的对象数量 */
+
+  unsigned long *bitmap;        /* 对象分配位图 */
+};
+
+/**
+ * @brief 对象缓存，管理同一种大小对象的所有 slab
+ */
+struct kmem_cache {
+  char *name;
+  unsigned long size;           /* 对象大小，已按照 align 对齐 */
+  unsigned long align;          /* 对象对齐要求 */
+  unsigned long slab_pages;     /* 每个 slab 占用的 4K 页数量 */
+  unsigned long num;            /* 每个 slab 能容纳的对象数量 */
+  unsigned long off_slab;       /* slab 描述符是否位于 slab 之外 */
+
+  unsigned long color_unit;     /* 着色偏移的单位 */
+  unsigned long color_range;    /* 着色偏移的取值个数 */
+  unsigned long color_next;     /* 下一个 slab 使用的着色编号 */
+
+  unsigned long total_using;    /* 整个缓存已分配的对象数量 */
+  unsigned long total_free;     /* 整个缓存空闲的对象数量 */
+
+  struct List slabs_partial;    /* 部分分配的 slab */
+  struct List slabs_full;       /* 全部分配的 slab */
+  struct List slabs_free;       /* 全部空闲的 slab */
+
+  void (*ctor)(void *obj);      /* 对象被分配时调用 */
+  void (*dtor)(void *obj);      /* 对象被释放时调用 */
+
+  spinlock_t lock;              /* 保护 slab 链表以及对象分配位图 */
+};
+
+void slab_init();
+struct kmem_cache *kmem_cache_create(char *name, unsigned long size, unsigned long align,
+                                     void (*ctor)(void *obj), void (*dtor)(void *obj));
+unsigned long kmem_cache_destroy(struct kmem_cache *cache);
+void *kmem_cache_alloc(struct kmem_cache *cache);
+void kmem_cache_free(struct kmem_cache *cache, void *obj);
+void *kmalloc(unsigned long size);
+void kfree(void *address);
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef __SMP_H_
+#define __SMP_H_
+
+#include "cpu.h"
+
+#define APU_BOOT_ADDR 0x20000   /* AP 启动代码的物理地址，SIPI 的向量号为该地址右移 12 位 */
+
+/* 处理器间中断向量，不小于 IPI_VECTOR_BASE 的中断都由 local APIC 投递 */
+#define IPI_VECTOR_BASE 0x80
+#define IPI_TIMER_VECTOR 0xc8   /* BSP 将时钟节拍转发给其他处理器 */
+#define LOCAL_TIMER_VECTOR 0xc9 /* local APIC 定时器 */
+#define IPI_RESCHEDULE_VECTOR 0xca  /* 唤醒了其他 CPU 上的进程，通知空闲的目标 CPU 重新调度 */
+#define IPI_PCP_DRAIN_VECTOR 0xcb   /* 连续页面分配失败，通知其他 CPU 清空 4K 单页缓存 */
+
+extern unsigned long cpu_online_mask;   /* 第 i 位置位表示 CPU i 已经完成初始化 */
+extern unsigned int smp_num_cpus;       /* 在线的处理器数量 */
+
+static inline int cpu_online(long cpu) {
+  return (cpu_online_mask >> cpu) & 1;
+}
+
+void smp_init();
+void Start_SMP();
+void do_IPI(unsigned long regs, unsigned long nr);
+
+#endif
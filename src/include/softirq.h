@@ -0,0 +1,46 @@
+#ifndef __SOFTIRQ_H_
+#define __SOFTIRQ_H_
+
+#include "lib.h"
+
+/**
+ * 软中断编号，编号越小越先执行
+ * 中断处理函数（上半部）只记录数据并调用 raise_softirq，耗时的工作在开中断的下半部完成
+ */
+enum {
+  TIMER_SOFTIRQ = 0,
+  TASKLET_SOFTIRQ,
+  NR_SOFTIRQS
+};
+
+/* 一次 do_softirq 最多重复处理的轮数，之后仍有软中断等待时交给 ksoftirqd */
+#define MAX_SOFTIRQ_RESTART 10
+
+struct softirq_action {
+  void (*action)(unsigned long data);
+  unsigned long data;
+};
+
+#define TASKLET_STATE_SCHED (1 << 0)  /* 已经在某个 CPU 的 tasklet 链表上 */
+
+/**
+ * tasklet 在调用 tasklet_schedule 的 CPU 上执行，同一个 tasklet 在执行前被多次调度只执行一次
+ */
+struct tasklet_struct {
+  struct tasklet_struct *next;
+  unsigned long state;
+  void (*func)(unsigned long data);
+  unsigned long data;
+};
+
+#define DECLARE_TASKLET(name, func, data) \
+  struct tasklet_struct name = {NULL, 0, func, data}
+
+void softirq_init();
+void ksoftirqd_init();
+void register_softirq(unsigned int nr, void (*action)(unsigned long data), unsigned long data);
+void raise_softirq(unsigned int nr);
+void do_softirq();
+void tasklet_schedule(struct tasklet_struct *t);
+
+#endif
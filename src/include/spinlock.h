@@ -0,0 +1,62 @@
+#ifndef __SPINLOCK_H_
+#define __SPINLOCK_H_
+
+#include "lib.h"
+
+/**
+ * 自旋锁，lock 为 1 表示空闲，0 表示已被占用
+ * 锁保护的数据如果也会在中断处理函数中访问，必须使用 spin_lock_irqsave 版本
+ */
+typedef struct {
+  volatile long lock;
+} spinlock_t;
+
+#define SPIN_LOCK_UNLOCKED {1}
+
+static inline void spin_init(spinlock_t *lock) {
+  lock->lock = 1;
+}
+
+/* 原子地将 lock 减一，结果为负说明锁已被占用，自旋等待到锁被释放后重试 */
+static inline void spin_lock(spinlock_t *lock) {
+  __asm__ __volatile__("1:	\n\t"
+                       "lock	decq	%0	\n\t"
+                       "jns	3f	\n\t"
+                       "2:	\n\t"
+                       "pause	\n\t"
+                       "cmpq	$0,	%0	\n\t"
+                       "jle	2b	\n\t"
+                       "jmp	1b	\n\t"
+                       "3:	\n\t"
+                       : "+m"(lock->lock)
+                       :
+                       : "memory");
+}
+
+/* 尝试获取锁，不会自旋等待，成功返回 1，锁已被占用返回 0 */
+static inline int spin_trylock(spinlock_t *lock) {
+  long old = 1;
+  __asm__ __volatile__("lock	cmpxchgq	%2,	%1	\n\t"
+                       : "+a"(old), "+m"(lock->lock)
+                       : "r"(0L)
+                       : "memory", "cc");
+  return old == 1;
+}
+
+static inline void spin_unlock(spinlock_t *lock) {
+  __asm__ __volatile__("movq	$1,	%0	\n\t" : "=m"(lock->lock) : : "memory");
+}
+
+#define spin_lock_irqsave(lock, flags)                                         \
+  do {                                                                         \
+    local_irq_save(flags);                                                     \
+    spin_lock(lock);                                                           \
+  } while(0)
+
+#define spin_unlock_irqrestore(lock, flags)                                    \
+  do {                                                                         \
+    spin_unlock(lock);                                                         \
+    local_irq_restore(flags);                                                  \
+  } while(0)
+
+#endif
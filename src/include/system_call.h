@@ -1,8 +1,12 @@
 #ifndef __SYSTEM_CALL_H_
 #define __SYSTEN_CALL_H_
 
+#include "percpu.h"
 #include "printk.h"
 #include "ptrace.h"
+#include "task.h"
+#include "uaccess.h"
+#include "uring.h"
 
 #define MAX_SYSTEM_CALL_NR 128
 typedef unsigned long (*system_call_t)(struct pt_regs *regs);
@@ -11,15 +15,47 @@ unsigned long no_system_call(struct pt_regs *regs) {
   return -1;
 }
 
-unsigned long sys_printf(struct pt_regs *regs) {
-  color_printk(BLACK, WHITE, (char *)regs->rdi);
-  return 1;
+#define SYS_WRITE_MAX 4096  /* 一次 write 最多显示的字节数，避免长时间关闭中断 */
+
+/**
+ * @brief write(fd, buf, len)，把应用层缓冲区中的内容直接显示到屏幕上
+ * 1. fd 为 1（标准输出）或者 2（标准错误），后者使用红色显示
+ * 2. 缓冲区经过 access_ok 检查并预先建立映射之后，直接从应用层地址显示，不经过格式化，
+ *    也不复制到内核缓冲区
+ * 3. len 超过 SYS_WRITE_MAX 时只写入前 SYS_WRITE_MAX 个字节
+ *
+ * @return unsigned long 写入的字节数，参数非法时返回 -1
+ */
+unsigned long sys_write(struct pt_regs *regs) {
+  unsigned long fd = regs->rdi, addr = regs->rsi, len = regs->rdx;
+
+  if(fd != 1 && fd != 2)
+    return -1;
+  if(len > SYS_WRITE_MAX)
+    len = SYS_WRITE_MAX;
+  if(!access_ok(current->mm, addr, len, VM_READ) || fault_in_user(current->mm, addr, len, 0))
+    return -1;
+  return console_write(fd == 1 ? BLACK : RED, fd == 1 ? WHITE : BLACK, (const char *)addr, len);
+}
+
+/* 结束当前进程，rdi 为退出码，不会返回 */
+unsigned long sys_exit(struct pt_regs *regs) {
+  return do_exit(regs->rdi);
+}
+
+/* 返回当前 CPU 的编号，处理器不支持 RDTSCP 时 vdso_getcpu 使用 */
+unsigned long sys_getcpu(struct pt_regs *regs) {
+  return smp_processor_id();
 }
 
 system_call_t system_call_table[MAX_SYSTEM_CALL_NR] = { 
   [0] = no_system_call,
-  [1] = sys_printf,
-  [2 ... MAX_SYSTEM_CALL_NR - 1] = no_system_call
+  [1] = sys_write,
+  [2] = sys_exit,
+  [3] = sys_getcpu,
+  [NR_URING_SETUP] = sys_uring_setup,
+  [NR_URING_ENTER] = sys_uring_enter,
+  [6 ... MAX_SYSTEM_CALL_NR - 1] = no_system_call
 };
 
 #endif
\ No newline at end of file
@@ -4,6 +4,7 @@
 #include "cpu.h"
 #include "lib.h"
 #include "mem.h"
+#include "percpu.h"
 #include "ptrace.h"
 
 /* 由链接脚本给出 */
@@ -29,6 +30,12 @@ extern unsigned long _stack_start;  /* 在 head.S 中定义 */
 #define CLONE_FS	(1 << 0)
 #define CLONE_FILES	(1 << 1)
 #define CLONE_SIGNAL	(1 << 2)
+#define CLONE_VM	(1 << 3)	/* 与父进程共享地址空间 */
+#define CLONE_CPU	(1 << 4)	/* 运行在父进程所在的 CPU 上，用于每个 CPU 各一个的内核线程 */
+
+/* 进程优先级，数值越小优先级越高 */
+#define MAX_PRIO 40
+#define DEF_PRIORITY 20
 
 /* 进程运行状态 */
 #define TASK_RUNNING (1 << 0)
@@ -38,6 +45,10 @@ extern unsigned long _stack_start;  /* 在 head.S 中定义 */
 #define TASK_STOPPED (1 << 4)
 
 #define PF_KTHREAD (1 << 0)
+#define PF_NEED_SCHEDULE (1 << 1)   /* 进程需要被调度，在中断返回时检查 */
+
+/* 应用层线性地址空间的上限 */
+#define TASK_SIZE 0x0000800000000000UL
 
 /**
  * 进程的内核栈大小为 32768B(32KB)，其中包含了 task_struct 结构体的空间
@@ -56,22 +67,60 @@ struct thread_struct {
   unsigned long cr2;        /* CR2 控制寄存器 */
   unsigned long trap_nr;    /* 产生异常的异常号 */
   unsigned long error_code; /* 异常错误码 */
+  void *fpu;                /* FPU/SSE/AVX 状态保存区，第一次使用 FPU 时分配，64B 对齐 */
+};
+
+/* 虚拟内存区域属性 */
+#define VM_READ (1 << 0)
+#define VM_WRITE (1 << 1)
+#define VM_EXEC (1 << 2)
+#define VM_DONTCOPY (1 << 3)  /* fork 时不复制到子进程的地址空间 */
+
+/* 缺页异常错误码 */
+#define PF_PROTECTION (1 << 0)  /* 0 页面不存在，1 违反页面保护 */
+#define PF_WRITE (1 << 1)       /* 写入引发的异常 */
+
+struct mm_struct;
+struct uring;
+
+/**
+ * 虚拟内存区域，描述应用层一段连续的合法线性地址 [vm_start, vm_end)
+ * 区域内的页面在第一次访问时才通过缺页异常分配
+ */
+struct vm_area_struct {
+  struct List list;         /* 按照起始地址升序连接在 mm_struct->mmap 上 */
+  unsigned long vm_start;
+  unsigned long vm_end;
+  unsigned long vm_flags;
+  struct mm_struct *vm_mm;  /* 所属的地址空间 */
 };
 
 struct mm_struct {
   pml4t_t *pgd;   /* 页目录基地址 */
+  unsigned long pcid;   /* 地址空间使用的 PCID */
+  unsigned long pcid_stale;   /* 第 i 位置位表示 CPU i 上该 PCID 可能残留其他地址空间的 TLB 表项，下次加载时需要刷新 */
+  long users;     /* 共享该地址空间的进程数量，减为 0 时由 mmput 释放，init_mm 不计数 */
+  struct List mmap;   /* 虚拟内存区域链表 */
+  /**
+   * 保护虚拟内存区域链表和应用层页表，CLONE_VM 的线程共享地址空间，缺页处理可能被抢占
+   * 获取时关闭中断，同时也就禁止了抢占；持有期间可以分配页面，锁的顺序在 memory_management_struct.lock 之前
+   */
+  spinlock_t page_table_lock;
 
   unsigned long start_code, end_code;       /* 代码段 */
   unsigned long start_data, end_data;       /* 数据段 */
   unsigned long start_rodata, end_rodata;   /* 只读数据段 */
   unsigned long start_brk, end_brk;         /* 堆 */
   unsigned long start_stack;                /* 栈 */
+
+  struct uring *uring;    /* 系统调用环形队列在内核中的地址，没有创建时为 NULL */
 };
 
 struct task_struct {
-  struct List list;       /* 双向链表，用于连接各个进程的控制体 */
+  struct List list;       /* 双向链表，处于就绪状态时连接在调度器的就绪队列上 */
   volatile long state;    /* 进程状态 */
   unsigned long flags;    /* 进程标志：进程、线程、内核线程 */
+  long preempt_count;     /* 不为 0 时禁止抢占 */
 
   struct mm_struct *mm;   /* 内存空间分布结构体，记录内存页表和程序段信息 */
   struct thread_struct *thread; /* 进程切换时保留的状态信息 */
@@ -83,6 +132,7 @@ struct task_struct {
   long counter;   /* 进程可用时间片 */
   long signal;    /* 进程持有信号 */
   long priority;  /* 进程优先级 */
+  long cpu_id;    /* 进程所在的 CPU，创建后不再改变 */
 };
 
 /**
@@ -104,7 +154,8 @@ struct thread_struct init_thread;
   {                                                                            \
     .state = TASK_UNINTERRUPTIBLE, .flags = PF_KTHREAD, .mm = &init_mm,        \
     .thread = &init_thread, .addr_limit = 0xffff800000000000, .pid = 0,        \
-    .counter = 1, .signal = 0, .priority = 0                                   \
+    .counter = 1, .signal = 0, .priority = DEF_PRIORITY, .preempt_count = 0,   \
+    .cpu_id = 0                                                                \
   }
 
 /* 定义 0 号进程的栈以及 task_struct 结构体初始化 */
@@ -165,23 +216,17 @@ struct tss_struct {
 
 struct tss_struct init_tss[NR_CPUS] = {[0 ... NR_CPUS - 1] = INIT_TSS}; /* 初始化每个 CPU 的 TSS */
 
-/* 借助当前栈指针，获取进程 task_struct 结构体 */
+/**
+ * 获取当前进程的 task_struct，由 __switch_to 记录在本 CPU 的 cpu_data 中
+ * 只需要一条 %gs 相对寻址的读指令，不再依赖内核栈的大小和对齐
+ */
 static inline struct task_struct *get_current() {
-  struct task_struct *current = NULL;
-  /**
-   * 这里输入使用与输出相同的寄存器
-   * andq 相当于把准备输出的寄存器与 %%rsp 与运算一下，也就是 %%rsp & ~32767
-   * 相当于结果按照 32KB 下取整，刚好 task_struct 结构体保存在栈顶最大值的地方 也就是低地址处
-   */
-  __asm__ __volatile__("andq %%rsp, %0 \n\t" : "=r"(current) : "0"(~32767UL));
-  return current;
+  return this_cpu_read(current_task);
 }
 
 #define current get_current()
 
-#define GET_CURRENT                                                            \
-  "movq %rsp, %rbx \n\t"                                                       \
-  "andq $-32768,  %rbx \n\t"
+#define GET_CURRENT "movq %gs:0x08, %rbx \n\t"
 
 /**
  * @brief 进程切换函数
@@ -213,6 +258,27 @@ static inline struct task_struct *get_current() {
                          : "memory");                                          \
   } while (0)
 
+/* 系统调用相关的 MSR */
+#define IA32_SYSENTER_CS 0x174
+#define IA32_SYSENTER_ESP 0x175
+#define IA32_SYSENTER_EIP 0x176
+#define IA32_EFER 0xc0000080
+#define IA32_STAR 0xc0000081
+#define IA32_LSTAR 0xc0000082
+#define IA32_FMASK 0xc0000084
+#define EFER_SCE (1UL << 0)   /* 开启 SYSCALL/SYSRET */
+
 void task_init();
+void syscall_init();
+int kernel_thread(unsigned long (*fn)(unsigned long), unsigned long arg, unsigned long flags);
+unsigned long do_exit(unsigned long code);
+unsigned long do_system_call(struct pt_regs *regs);
+
+struct vm_area_struct *find_vma(struct mm_struct *mm, unsigned long addr);
+struct vm_area_struct *insert_vma(struct mm_struct *mm, unsigned long start, unsigned long end,
+                                  unsigned long flags);
+int handle_mm_fault(struct mm_struct *mm, unsigned long address, unsigned long error_code);
+int dup_mmap(struct mm_struct *mm, struct mm_struct *oldmm);
+void exit_mmap(struct mm_struct *mm);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,63 @@
+#ifndef __TIMER_H_
+#define __TIMER_H_
+
+#include "lib.h"
+
+#define HZ 100                  /* 每秒的时钟中断次数 */
+#define PIT_FREQ 1193182UL      /* 8253/8254 PIT 的输入时钟频率 */
+
+#define IA32_TSC_DEADLINE 0x6e0
+
+extern volatile unsigned long jiffies;
+
+/**
+ * TSC 时钟源，启动时使用 PIT 通道 2 校准
+ * 假设各个 CPU 的 TSC 同步并且频率恒定（invariant TSC）
+ */
+extern unsigned long tsc_khz;
+
+void tsc_calibrate();
+unsigned long tsc_to_ns(unsigned long cycles);
+unsigned long tsc_to_ktime(unsigned long tsc);
+unsigned long ktime_get_ns();
+
+/**
+ * 内核定时器，在 expires 时刻（jiffies）之后由设置定时器的 CPU 在 TIMER_SOFTIRQ 中调用 function
+ * 定时器处理函数在开中断的情况下执行，不能睡眠
+ */
+struct timer_list {
+  struct List list;
+  unsigned long expires;
+  void (*function)(unsigned long data);
+  unsigned long data;
+  struct timer_base *base;  /* 定时器所在的 CPU 的时间轮，未激活时为 NULL */
+};
+
+static inline void init_timer(struct timer_list *timer, void (*function)(unsigned long data),
+                              unsigned long data) {
+  list_init(&timer->list);
+  timer->function = function;
+  timer->data = data;
+  timer->base = NULL;
+}
+
+static inline int timer_pending(struct timer_list *timer) {
+  return timer->base != NULL;
+}
+
+void init_timers();
+void add_timer(struct timer_list *timer);
+int del_timer(struct timer_list *timer);
+int mod_timer(struct timer_list *timer, unsigned long expires);
+unsigned long next_timer_interrupt();
+long schedule_timeout(long timeout);
+
+void timer_init();
+void local_timer_init();
+void local_timer_interrupt();
+void do_timer();
+void update_process_times();
+void tick_nohz_idle_enter();
+void tick_nohz_idle_exit();
+
+#endif
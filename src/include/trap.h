@@ -1,6 +1,7 @@
 #ifndef __TRAP_H_
 #define __TRAP_H_
 
+#include "cpu.h"
 #include "lib.h"
 #include "linkage.h"
 #include "printk.h"
@@ -0,0 +1,19 @@
+#ifndef __UACCESS_H_
+#define __UACCESS_H_
+
+struct mm_struct;
+
+/**
+ * 系统调用访问应用层内存的接口，所有从应用层传入的指针都要经过这里
+ * 1. access_ok 检查 [addr, addr + size) 是否完整地落在进程带有相应权限的虚拟内存区域中
+ * 2. fault_in_user 预先建立这段内存的映射（包括写时复制），之后内核访问它不会再发生缺页；
+ *    处理器没有开启 CR0.WP，内核写入只读页面不会触发异常，所以写之前必须先经过这一步
+ * 3. copy_from_user、copy_to_user 的参数顺序与 memcpy 相同，源地址在前，
+ *    返回没有复制的字节数，成功时为 0
+ */
+int access_ok(struct mm_struct *mm, unsigned long addr, unsigned long size, unsigned long flags);
+int fault_in_user(struct mm_struct *mm, unsigned long addr, unsigned long size, int write);
+unsigned long copy_from_user(const void *from, void *to, unsigned long size);
+unsigned long copy_to_user(const void *from, void *to, unsigned long size);
+
+#endif
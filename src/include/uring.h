@@ -0,0 +1,98 @@
+#ifndef __URING_H_
+#define __URING_H_
+
+#define URING_ADDR 0x600000UL       /* 环形队列在应用层的位置 */
+#define URING_PAGES 4
+#define URING_SQ_ENTRIES 128        /* 都必须是 2 的幂 */
+#define URING_CQ_ENTRIES 256
+
+/* 系统调用号 */
+#define NR_URING_SETUP 4
+#define NR_URING_ENTER 5
+
+struct pt_regs;
+
+/* 提交队列项：一次系统调用，参数按照 RDI、RSI、RDX、R10、R8、R9 的顺序 */
+struct uring_sqe {
+  unsigned long opcode;             /* 系统调用号 */
+  unsigned long args[6];
+  unsigned long user_data;          /* 原样复制到完成队列项中 */
+};
+
+struct uring_cqe {
+  unsigned long user_data;
+  unsigned long res;                /* 系统调用的返回值 */
+};
+
+/**
+ * 应用层和内核共享的提交队列（SQ）和完成队列（CQ）
+ * 1. head 和 tail 只增不减，使用时与 entries - 1 按位与得到下标，tail - head 是队列中的项数
+ * 2. SQ 的 tail 和 CQ 的 head 由应用层修改，SQ 的 head 和 CQ 的 tail 由内核修改
+ * 3. 生产者先写入队列项再推进 tail，x86 的写操作不会重排，只需要阻止编译器重排
+ * 应用层可以连续放入多个请求，然后通过一次 uring_enter 提交，每个请求不再需要单独进出内核
+ */
+struct uring {
+  struct {
+    volatile unsigned int head;
+    volatile unsigned int tail;
+  } sq __attribute__((aligned(64)));
+  struct {
+    volatile unsigned int head;
+    volatile unsigned int tail;
+  } cq __attribute__((aligned(64)));
+  struct uring_sqe sqes[URING_SQ_ENTRIES] __attribute__((aligned(64)));
+  struct uring_cqe cqes[URING_CQ_ENTRIES];
+};
+
+unsigned long sys_uring_setup(struct pt_regs *regs);
+unsigned long sys_uring_enter(struct pt_regs *regs);
+
+/**
+ * 下面是应用层使用的函数，全部内联到调用者中
+ * uring_get_sqe 取得空闲的提交队列项，填写之后调用 uring_sqe_commit，攒够一批再调用 uring_enter；
+ * 完成的结果通过 uring_peek_cqe 和 uring_cqe_seen 读取
+ */
+
+/* 创建当前地址空间的环形队列，失败时返回 NULL */
+static inline struct uring *uring_setup() {
+  long ret;
+  __asm__ __volatile__("syscall \n\t" : "=a"(ret) : "0"(NR_URING_SETUP) : "rcx", "r11", "memory");
+  return ret == -1 ? (struct uring *)0 : (struct uring *)ret;
+}
+
+/* 处理最多 to_submit 个提交队列项，返回实际处理的数量 */
+static inline long uring_enter(unsigned long to_submit) {
+  long ret;
+  __asm__ __volatile__("syscall \n\t"
+                       : "=a"(ret)
+                       : "0"(NR_URING_ENTER), "D"(to_submit)
+                       : "rcx", "r11", "memory");
+  return ret;
+}
+
+/* 提交队列已满时返回 NULL */
+static inline struct uring_sqe *uring_get_sqe(struct uring *ring) {
+  if(ring->sq.tail - ring->sq.head >= URING_SQ_ENTRIES)
+    return (struct uring_sqe *)0;
+  return ring->sqes + (ring->sq.tail & (URING_SQ_ENTRIES - 1));
+}
+
+static inline void uring_sqe_commit(struct uring *ring) {
+  __asm__ __volatile__("" ::: "memory");
+  ring->sq.tail++;
+}
+
+/* 完成队列为空时返回 NULL */
+static inline struct uring_cqe *uring_peek_cqe(struct uring *ring) {
+  if(ring->cq.head == ring->cq.tail)
+    return (struct uring_cqe *)0;
+  __asm__ __volatile__("" ::: "memory");
+  return ring->cqes + (ring->cq.head & (URING_CQ_ENTRIES - 1));
+}
+
+static inline void uring_cqe_seen(struct uring *ring) {
+  __asm__ __volatile__("" ::: "memory");
+  ring->cq.head++;
+}
+
+#endif
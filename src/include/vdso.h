@@ -0,0 +1,105 @@
+#ifndef __VDSO_H_
+#define __VDSO_H_
+
+#include "cpu.h"
+
+#define VDSO_ADDR 0x700000UL        /* vdso_data 在应用层的位置，位于代码页之前 */
+#define VDSO_SHIFT 24               /* 纳秒 = TSC 周期数 * mult >> VDSO_SHIFT */
+#define IA32_TSC_AUX 0xc0000103     /* RDTSCP 同时读出的值，内核设置为 CPU 编号 */
+
+struct mm_struct;
+
+/* 每个 CPU 的统计计数，只由该 CPU 在时钟节拍中更新，各占一个缓存行 */
+struct vdso_cpu_stat {
+  unsigned long irq_count;
+  unsigned long syscall_count;
+  unsigned long switch_count;
+  unsigned long nr_running;         /* 就绪队列中的进程数 */
+} __attribute__((aligned(64)));
+
+/**
+ * 内核维护、映射到每个应用层地址空间的只读页面，应用层读取时间、CPU 编号和统计信息不需要进入内核
+ * 1. 时间：内核在 jiffies 推进时记录 cycle_last 和对应的 ns_last，
+ *    应用层用 ns_last + (rdtsc - cycle_last) * mult >> VDSO_SHIFT 计算启动以来的纳秒数
+ * 2. 时间相关成员由 seq 保护：内核更新期间 seq 为奇数，应用层读取前后 seq 不变才说明读到的值是一致的
+ * 3. 处理器支持 RDTSCP 时 IA32_TSC_AUX 保存 CPU 编号，否则 vdso_getcpu 退回到系统调用
+ * 页面位于内核映像中而不是 4K 页池，fork 时直接共享，进程退出时也不会被释放
+ */
+struct vdso_data {
+  volatile unsigned long seq;
+  unsigned long cycle_last;
+  unsigned long ns_last;
+  unsigned long mult;
+  unsigned long jiffies;
+  unsigned long tsc_khz;
+  unsigned long nr_cpus;            /* 在线的处理器数量 */
+  unsigned long rdtscp;             /* 是否可以通过 RDTSCP 取得 CPU 编号 */
+  struct vdso_cpu_stat cpu[NR_CPUS];
+} __attribute__((aligned(4096)));
+
+extern struct vdso_data vdso_data;
+
+void vdso_init();
+void vdso_cpu_init();
+void vdso_update_time();
+void vdso_update_cpu();
+int vdso_map(struct mm_struct *mm);
+
+/**
+ * 下面是应用层使用的函数，只访问 VDSO_ADDR 处的页面，全部内联到调用者中
+ * 复制到应用层的代码（例如 user_level_function）也可以直接使用
+ */
+#define VDSO ((const volatile struct vdso_data *)VDSO_ADDR)
+
+static inline unsigned long vdso_read_begin() {
+  unsigned long seq;
+  while((seq = VDSO->seq) & 1)
+    __asm__ __volatile__("pause \n\t" ::: "memory");
+  __asm__ __volatile__("" ::: "memory");
+  return seq;
+}
+
+static inline int vdso_read_retry(unsigned long seq) {
+  __asm__ __volatile__("" ::: "memory");
+  return VDSO->seq != seq;
+}
+
+/* 启动以来的纳秒数，lfence 保证 rdtsc 不会在读取 seq 之前执行 */
+static inline unsigned long vdso_clock_ns() {
+  unsigned long seq, ns;
+  unsigned int lo, hi;
+  long delta;
+
+  do {
+    seq = vdso_read_begin();
+    __asm__ __volatile__("lfence \n\t"
+                         "rdtsc \n\t"
+                         : "=a"(lo), "=d"(hi)
+                         :
+                         : "memory");
+    delta = ((unsigned long)hi << 32 | lo) - VDSO->cycle_last;
+    if(delta < 0)   /* 各 CPU 的 TSC 之间可能有微小的差异 */
+      delta = 0;
+    ns = VDSO->ns_last + ((unsigned long)delta * VDSO->mult >> VDSO_SHIFT);
+  } while(vdso_read_retry(seq));
+  return ns;
+}
+
+static inline unsigned long vdso_jiffies() {
+  return VDSO->jiffies;
+}
+
+/* 当前所在的 CPU 编号，进程不会在 CPU 之间迁移，结果可以缓存 */
+static inline long vdso_getcpu() {
+  unsigned int lo, hi, aux;
+  long cpu;
+
+  if(VDSO->rdtscp) {
+    __asm__ __volatile__("rdtscp \n\t" : "=a"(lo), "=d"(hi), "=c"(aux));
+    return aux;
+  }
+  __asm__ __volatile__("syscall \n\t" : "=a"(cpu) : "0"(3) : "rcx", "r11", "memory");
+  return cpu;
+}
+
+#endif
@@ -1,10 +1,16 @@
 #include "lib.h"
 #include "printk.h"
 #include "gate.h"
+#include "fpu.h"
 #include "trap.h"
 #include "mem.h"
 #include "interrupt.h"
+#include "percpu.h"
 #include "task.h"
+#include "slab.h"
+#include "schedule.h"
+#include "softirq.h"
+#include "timer.h"
 
 /**
  * @brief 内核程序代码段和数据段的相关信息
@@ -20,6 +26,9 @@ struct Global_Memory_Descriptor memory_management_struct = {{0}, 0};
 
 void Start_Kernel(void) {
   int *addr = (int *)0xffff800000a00000;
+  unsigned long boot_tsc = rdtsc();   /* 用于统计启动到 task_init 的时间 */
+
+  percpu_init(0);   /* 之后才可以使用 current */
 
   Pos.XResolution = 1440;
   Pos.YResolution = 900;
@@ -45,12 +54,20 @@ void Start_Kernel(void) {
   color_printk(RED, BLACK, "memory_init\n");
   init_memory();
 
+  color_printk(RED, BLACK, "slab init\n");
+  slab_init();
+  fpu_init();
+  glyph_init();
+
+  schedule_init();
+
   color_printk(RED, BLACK, "interrupt init\n");
+  softirq_init();
   init_interrupt();
+  timer_init();
 
-  color_printk(RED, BLACK, "task_init\n");
+  color_printk(RED, BLACK, "task_init, %ld cycles since Start_Kernel\n", rdtsc() - boot_tsc);
   task_init();
 
-  while(1)
-    ;
+  cpu_idle();
 }
\ No newline at end of file
@@ -0,0 +1,144 @@
+#include "printk.h"
+#include "cpu.h"
+#include "fpu.h"
+#include "lib.h"
+
+/**
+ * 字模展开表：字模的一行是 1B，从最高位开始每一位对应一个像素，
+ * glyph_mask[b] 是字节 b 展开成的 8 个像素的掩码，对应位为 1 的像素是 0xffffffff，否则为 0
+ * 一行像素 = ((FRcolor ^ BKcolor) & mask) ^ BKcolor，不再需要逐位判断和分支
+ * 每项 32B 对齐，SSE 用两次 16B 读取，AVX 用一次 32B 读取
+ */
+#define GM_BIT(n, i) ((((n) >> (i)) & 1) ? 0xffffffffU : 0)
+#define GM_1(n)                                                                \
+  { GM_BIT(n, 7), GM_BIT(n, 6), GM_BIT(n, 5), GM_BIT(n, 4),                    \
+    GM_BIT(n, 3), GM_BIT(n, 2), GM_BIT(n, 1), GM_BIT(n, 0) }
+#define GM_4(n) GM_1(n), GM_1((n) + 1), GM_1((n) + 2), GM_1((n) + 3)
+#define GM_16(n) GM_4(n), GM_4((n) + 4), GM_4((n) + 8), GM_4((n) + 12)
+#define GM_64(n) GM_16(n), GM_16((n) + 16), GM_16((n) + 32), GM_16((n) + 48)
+
+static const unsigned int glyph_mask[256][8] __attribute__((aligned(32))) = {
+  GM_64(0), GM_64(64), GM_64(128), GM_64(192)
+};
+
+/* 启动时根据 CPUID 选择的显示方式，glyph_init 之前只使用通用寄存器 */
+int glyph_mode = GLYPH_SCALAR;
+
+static const char *glyph_mode_name[] = {"scalar", "SSE2", "AVX"};
+
+/**
+ * @brief 根据 CPUID 选择字符的显示方式，需要在 fpu_init 之后调用
+ * 1. AVX：CPUID.01H:ECX[28]，并且 XCR0 开启了 SSE 和 AVX 状态（需要 CR4.OSXSAVE 才能执行 xgetbv）
+ * 2. SSE2：CPUID.01H:EDX[26]，64 位处理器总是支持
+ */
+void glyph_init() {
+  unsigned int a, b, c, d, lo, hi;
+  unsigned long cr4;
+
+  get_cpuid(1, 0, &a, &b, &c, &d);
+  if(d & (1 << 26))
+    glyph_mode = GLYPH_SSE2;
+  __asm__ __volatile__("movq %%cr4, %0 \n\t" : "=r"(cr4));
+  if((c & (1 << 28)) && (cr4 & CR4_OSXSAVE)) {
+    __asm__ __volatile__("xgetbv \n\t" : "=a"(lo), "=d"(hi) : "c"(0));
+    if((lo & 0x6) == 0x6)
+      glyph_mode = GLYPH_AVX;
+  }
+  color_printk(RED, BLACK, "glyph init, %s\n", glyph_mode_name[glyph_mode]);
+}
+
+/* 每行 8 个像素通过 4 次 8B 写入完成 */
+static void glyph_blit_scalar(unsigned int *addr, unsigned long stride, unsigned int FRcolor,
+                              unsigned int BKcolor, const unsigned char *fontp) {
+  unsigned long fx = FRcolor ^ BKcolor, bg = BKcolor;
+  unsigned long *dst;
+  const unsigned long *m;
+
+  fx |= fx << 32;
+  bg |= bg << 32;
+  for(int i = 0; i < 16; ++i) {
+    m = (const unsigned long *)glyph_mask[fontp[i]];
+    dst = (unsigned long *)addr;
+    dst[0] = (m[0] & fx) ^ bg;
+    dst[1] = (m[1] & fx) ^ bg;
+    dst[2] = (m[2] & fx) ^ bg;
+    dst[3] = (m[3] & fx) ^ bg;
+    addr += stride;
+  }
+}
+
+/**
+ * colors 的前 8 项为 FRcolor ^ BKcolor，后 8 项为 BKcolor
+ * 内核使用 -mno-sse 编译，SIMD 指令只能写在内嵌汇编中，一个字符的 16 行在一段汇编中完成；
+ * 编译器不会使用 XMM/YMM 寄存器，也不允许在 clobber 中声明它们，所以这里不列出
+ */
+static void glyph_blit_sse2(unsigned int *addr, unsigned long stride, const unsigned int *colors,
+                            const unsigned char *fontp) {
+  __asm__ __volatile__("movdqa (%4), %%xmm2 \n\t"
+                       "movdqa 32(%4), %%xmm3 \n\t"
+                       "movl $16, %%ecx \n\t"
+                       "1: \n\t"
+                       "movzbl (%0), %%eax \n\t"
+                       "shlq $5, %%rax \n\t"
+                       "movdqa (%2, %%rax), %%xmm0 \n\t"
+                       "movdqa 16(%2, %%rax), %%xmm1 \n\t"
+                       "pand %%xmm2, %%xmm0 \n\t"
+                       "pand %%xmm2, %%xmm1 \n\t"
+                       "pxor %%xmm3, %%xmm0 \n\t"
+                       "pxor %%xmm3, %%xmm1 \n\t"
+                       "movdqu %%xmm0, (%1) \n\t"
+                       "movdqu %%xmm1, 16(%1) \n\t"
+                       "incq %0 \n\t"
+                       "addq %3, %1 \n\t"
+                       "decl %%ecx \n\t"
+                       "jnz 1b \n\t"
+                       : "+r"(fontp), "+r"(addr)
+                       : "r"(glyph_mask), "r"(stride * 4), "r"(colors)
+                       : "rax", "rcx", "memory", "cc");
+}
+
+/* AVX 没有 256 位的整数逻辑运算，使用 vandps/vxorps 完成同样的位运算 */
+static void glyph_blit_avx(unsigned int *addr, unsigned long stride, const unsigned int *colors,
+                           const unsigned char *fontp) {
+  __asm__ __volatile__("vmovaps (%4), %%ymm2 \n\t"
+                       "vmovaps 32(%4), %%ymm3 \n\t"
+                       "movl $16, %%ecx \n\t"
+                       "1: \n\t"
+                       "movzbl (%0), %%eax \n\t"
+                       "shlq $5, %%rax \n\t"
+                       "vandps (%2, %%rax), %%ymm2, %%ymm0 \n\t"
+                       "vxorps %%ymm3, %%ymm0, %%ymm0 \n\t"
+                       "vmovups %%ymm0, (%1) \n\t"
+                       "incq %0 \n\t"
+                       "addq %3, %1 \n\t"
+                       "decl %%ecx \n\t"
+                       "jnz 1b \n\t"
+                       "vzeroupper \n\t"
+                       : "+r"(fontp), "+r"(addr)
+                       : "r"(glyph_mask), "r"(stride * 4), "r"(colors)
+                       : "rax", "rcx", "memory", "cc");
+}
+
+/**
+ * @brief 在帧缓存的 (x, y) 处显示一个 8*16 的字符
+ * simd 不为 0 时按照 glyph_mode 使用 SSE2 或者 AVX，调用者需要处于 kernel_fpu_begin/end 之间；
+ * 否则使用查表的通用寄存器版本，任何上下文都可以调用
+ */
+void glyph_blit(unsigned int *fb, int Xsize, int x, int y, unsigned int FRcolor,
+                unsigned int BKcolor, unsigned char font, int simd) {
+  unsigned int colors[16] __attribute__((aligned(32)));
+  unsigned int *addr = fb + Xsize * y + x;
+
+  if(!simd || glyph_mode == GLYPH_SCALAR) {
+    glyph_blit_scalar(addr, Xsize, FRcolor, BKcolor, font_ascii[font]);
+    return;
+  }
+  for(int i = 0; i < 8; ++i) {
+    colors[i] = FRcolor ^ BKcolor;
+    colors[i + 8] = BKcolor;
+  }
+  if(glyph_mode == GLYPH_AVX)
+    glyph_blit_avx(addr, Xsize, colors, font_ascii[font]);
+  else
+    glyph_blit_sse2(addr, Xsize, colors, font_ascii[font]);
+}
@@ -1,7 +1,53 @@
 #include <stdarg.h>
 #include "printk.h"
 #include "lib.h"
+#include "fpu.h"
 #include "linkage.h"
+#include "percpu.h"
+#include "spinlock.h"
+#include "task.h"
+#include "timer.h"
+
+/* 保护光标位置和帧缓存，同一时刻只有一个 CPU 在显示 */
+static spinlock_t printk_lock = SPIN_LOCK_UNLOCKED;
+
+/**
+ * 日志环形缓冲区，多个生产者、单个消费者，生产者不需要加锁
+ * 1. 每条记录的 seq 表示它的状态，序号为 i 的消息使用第 i / LOG_RING_SIZE 圈的记录：
+ *    seq 等于 LOG_FREE(i) 时空闲，等于 LOG_DONE(i) 时已经写入，
+ *    消费者显示完之后设置为 LOG_FREE(i + LOG_RING_SIZE)，留给下一圈的生产者；
+ *    第 0 圈的空闲状态是 0，缓冲区不需要初始化，第一条 printk 之前就可以使用
+ * 2. 生产者通过 cmpxchg 推进 log_head 一次预留若干条连续的记录，写入内容之后再设置 seq，
+ *    一条消息超过 LOG_TEXT_MAX 时占用多条记录，不会与其他 CPU 的消息交错
+ * 3. 消费者按序号依次显示，遇到还没有写完的记录就停止，不会等待生产者
+ * 缓冲区满时丢弃新的消息并计数
+ */
+#define LOG_RING_SIZE 256
+#define LOG_TEXT_MAX 216
+#define LOG_LINE_MAX 1024   /* 单条消息格式化之后的最大长度 */
+#define CONSOLE_INTERVAL (HZ / 25)  /* 控制台线程检查缓冲区的间隔 */
+#define LOG_FREE(i) ((i) / LOG_RING_SIZE * 2)
+#define LOG_DONE(i) (LOG_FREE(i) + 1)
+
+struct log_record {
+  volatile unsigned long seq;
+  unsigned long ts_ns;      /* 写入时的 ktime_get_ns */
+  unsigned int level;
+  unsigned int cpu;
+  unsigned int FRcolor;
+  unsigned int BKcolor;
+  unsigned int len;
+  char text[LOG_TEXT_MAX];
+} __attribute__((aligned(64)));
+
+static struct log_record log_ring[LOG_RING_SIZE];
+static volatile unsigned long log_head = 0;   /* 下一条要预留的记录 */
+static unsigned long log_tail = 0;            /* 下一条要显示的记录，只在持有 printk_lock 时修改 */
+static volatile unsigned long log_dropped = 0;
+static unsigned long log_dropped_shown = 0;
+
+/* 控制台线程启动之前以及 level 不高于 LOG_ERR 的消息同步显示 */
+static int console_async = 0;
 
 /**
  * 将整数值按照指定进制规格转换成字符串
@@ -10,7 +56,16 @@
  * @base: 指定的进制
  * @precision: 精度，@size: 位宽，@type: 标志位
  */
-static char *number(char *str, long num, int base, int size, int precision,
+/* 只在没有越过缓冲区结尾 end 时写入，str 仍然前进，用来计算完整的长度；c 总是会被求值 */
+#define PUTC(c)                                                                \
+  do {                                                                         \
+    char __c = (c);                                                            \
+    if (str < end)                                                             \
+      *str = __c;                                                              \
+    ++str;                                                                     \
+  } while (0)
+
+static char *number(char *str, char *end, long num, int base, int size, int precision,
                     int type) {
   char c, sign, tmp[50];
   /* 待显示的进制字符串 */
@@ -69,13 +124,13 @@ static char *number(char *str, long num, int base, int size, int precision,
   /* 既没有零填充也没有左对齐，则在显示进制字符前使用空格补充 */
   if (!(type & (ZEROPAD + LEFT)))
     while (size-- > 0)
-      *str++ = ' ';
+      PUTC(' ');
   /**
    * 根据前面的判断是不是需要显示符号
    * 前面已经把 size-- 了
    */
   if (sign)
-    *str++ = sign;
+    PUTC(sign);
   
   /**
    * 根据前面的判断是不是需要显示特殊字符
@@ -83,10 +138,10 @@ static char *number(char *str, long num, int base, int size, int precision,
    */
   if (type & SPECIAL)
     if (base == 8)          /* 显示八进制的 0 */
-      *str++ = '0';
+      PUTC('0');
     else if (base == 16) {  /* 显示十六进制的 0x */
-      *str++ = '0';
-      *str++ = digits[33];
+      PUTC('0');
+      PUTC(digits[33]);
     }
   
   /**
@@ -96,22 +151,22 @@ static char *number(char *str, long num, int base, int size, int precision,
    */
   if (!(type & LEFT))
     while (size-- > 0)
-      *str++ = c;
+      PUTC(c);
 
   /**
    * 进制字符串的长度 < 显示精度
    * 使用 '0' 补充不足的部分 
    */
   while (i < precision--)
-    *str++ = '0';
+    PUTC('0');
 
   /* 保存进制字符串 */
   while (i-- > 0)
-    *str++ = tmp[i];
+    PUTC(tmp[i]);
 
   /* 在这里说明需要左对齐，那么使用 ' ' 补充剩余字符 */
   while (size-- > 0)
-    *str++ = ' ';
+    PUTC(' ');
   
   /* 返回待显示字符的缓冲区 */
   return str;
@@ -126,8 +181,12 @@ int skip_atoi(const char **s) {
   return i;
 }
 
-int vsprintf(char *buf, const char *fmt, va_list args) {
-  char *str, *s;
+/**
+ * @brief 按照 fmt 格式化到 buf 中，最多写入 size 个字节（包括结尾的 '\0'）
+ * 超出的部分被截断，返回值仍然是完整格式化所需的长度，与标准库的 vsnprintf 相同
+ */
+int vsnprintf(char *buf, unsigned long size, const char *fmt, va_list args) {
+  char *str, *s, *end = buf + size;
   int flags;
   int field_width;
   int precision;
@@ -137,7 +196,7 @@ int vsprintf(char *buf, const char *fmt, va_list args) {
 
   for (str = buf; *fmt; fmt++) {
     if (*fmt != '%') {  /* 如果是可显示字符，直接存入缓冲区 */
-      *str++ = *fmt;
+      PUTC(*fmt);
       continue;
     }
     flags = 0;
@@ -208,10 +267,10 @@ int vsprintf(char *buf, const char *fmt, va_list args) {
 
       if (!(flags & LEFT))
         while (--field_width > 0)
-          *str++ = ' ';
-      *str++ = (unsigned char)va_arg(args, int);
+          PUTC(' ');
+      PUTC((unsigned char)va_arg(args, int));
       while (--field_width > 0)
-        *str++ = ' ';
+        PUTC(' ');
       break;
 
     case 's':
@@ -227,20 +286,20 @@ int vsprintf(char *buf, const char *fmt, va_list args) {
 
       if (!(flags & LEFT))
         while (len < field_width--)
-          *str++ = ' ';
+          PUTC(' ');
       for (i = 0; i < len; i++)
-        *str++ = *s++;
+        PUTC(*s++);
       while (len < field_width--)
-        *str++ = ' ';
+        PUTC(' ');
       break;
 
     case 'o':
 
       if (qualifier == 'l')
-        str = number(str, va_arg(args, unsigned long), 8, field_width,
+        str = number(str, end, va_arg(args, unsigned long), 8, field_width,
                      precision, flags);
       else
-        str = number(str, va_arg(args, unsigned int), 8, field_width, precision,
+        str = number(str, end, va_arg(args, unsigned int), 8, field_width, precision,
                      flags);
       break;
 
@@ -251,7 +310,7 @@ int vsprintf(char *buf, const char *fmt, va_list args) {
         flags |= ZEROPAD;
       }
 
-      str = number(str, (unsigned long)va_arg(args, void *), 16, field_width,
+      str = number(str, end, (unsigned long)va_arg(args, void *), 16, field_width,
                    precision, flags);
       break;
 
@@ -262,10 +321,10 @@ int vsprintf(char *buf, const char *fmt, va_list args) {
     case 'X':
 
       if (qualifier == 'l')
-        str = number(str, va_arg(args, unsigned long), 16, field_width,
+        str = number(str, end, va_arg(args, unsigned long), 16, field_width,
                      precision, flags);
       else
-        str = number(str, va_arg(args, unsigned int), 16, field_width,
+        str = number(str, end, va_arg(args, unsigned int), 16, field_width,
                      precision, flags);
       break;
 
@@ -276,10 +335,10 @@ int vsprintf(char *buf, const char *fmt, va_list args) {
     case 'u':
 
       if (qualifier == 'l')
-        str = number(str, va_arg(args, unsigned long), 10, field_width,
+        str = number(str, end, va_arg(args, unsigned long), 10, field_width,
                      precision, flags);
       else
-        str = number(str, va_arg(args, unsigned int), 10, field_width,
+        str = number(str, end, va_arg(args, unsigned int), 10, field_width,
                      precision, flags);
       break;
 
@@ -296,85 +355,56 @@ int vsprintf(char *buf, const char *fmt, va_list args) {
 
     case '%':
 
-      *str++ = '%';
+      PUTC('%');
       break;
 
     default:
 
-      *str++ = '%';
+      PUTC('%');
       if (*fmt)
-        *str++ = *fmt;
+        PUTC(*fmt);
       else
         fmt--;
       break;
     }
   }
-  *str = '\0';
-  return str - buf;   /* 返回 buf 的长度 */
+  if (size)
+    *(str < end ? str : end - 1) = '\0';
+  return str - buf;   /* 返回完整格式化的长度 */
+}
+
+/* 不限制长度的版本，调用者需要保证 buf 足够大 */
+int vsprintf(char *buf, const char *fmt, va_list args) {
+  return vsnprintf(buf, ~0U >> 1, fmt, args);
 }
 
 /**
  * @font: 待显示字符的 ASCII 编号
- * 1. 通过 font 获取预先设置好的 ASCII 矩阵信息
- * 2. 检查该矩阵的每一个 bit，如果是 1 表示该像素显示，否则不显示
- * 3. 针对像素是否显示，在帧缓存区设置像素的颜色信息
- * 一个字符的宽度是 16 行 8 列
+ * 通过 glyph_mask 表把字模的每一行展开成 8 个像素，一个字符的宽度是 16 行 8 列
+ * 只使用通用寄存器，任何上下文都可以调用
  */
 void putchar(unsigned int *fb, int Xsize, int x, int y, unsigned int FRcolor,
              unsigned int BKcolor, unsigned char font) {
-  int i = 0, j = 0;
-  unsigned int *addr = NULL;
-  unsigned char *fontp = NULL;
-  int testval = 0;
-  /**
-   * 获取 font 字符对应的 [ASCII 矩阵]，根据 [ASCII 矩阵] 来设置帧缓存区；
-   * 每个字符对应 8*16 的 bit 矩阵，总共是 16B
-   */
-  fontp = font_ascii[font];
+  glyph_blit(fb, Xsize, x, y, FRcolor, BKcolor, font, 0);
+}
 
-  /**
-   * 由于 [ASCII 矩阵] 总共有 16 行，所以需要循环 16 次；
-   * 1. 外层循环，每次循环完成设置一行所有像素点的颜色深度
-   * 2. 内存循环，每次循环完成设置一个像素点的颜色深度
-   */
-  for(i = 0; i < 16; ++i) {
-    /* 帧缓存区上第 i 行初始地址 */
-    addr = fb + Xsize * (y + i) + x;
-    testval = 0x100;
+/* 控制台线程显示时为 1，可以使用 SSE/AVX，只在持有 printk_lock 时修改 */
+static int console_simd = 0;
 
-    for(j = 0; j < 8; ++j) {
-      /**
-       * 第 j 次循环 testval 从左往右的第 j-bit 是 1
-       * 用 testval 检查该像素在 [ASCII 矩阵] 中的数据，以此决定在帧缓存区此像素的颜色信息
-       * 如果是 1 就帧缓存区像素就显示字体颜色，如果是 0 就显示背景色
-       */
-      testval >>= 1;
-      if(*fontp & testval)  /* 如果 bit = 1 */
-        *addr = FRcolor;
-      else                  /* 如果 bit = 0 */
-        *addr = BKcolor;
-      /* 下一个像素 */
-      ++addr;
-    }
-    /* [ASCII 矩阵] 上的下一行信息 */
-    ++fontp;
-  }
+static inline void console_blit(unsigned int FRcolor, unsigned int BKcolor, unsigned char font) {
+  glyph_blit(Pos.FB_addr, Pos.XResolution, Pos.XPosition * Pos.XCharSize,
+             Pos.YPosition * Pos.YCharSize, FRcolor, BKcolor, font, console_simd);
 }
 
 /**
- * 格式化字符串显示
- * 1. 调用 vsprintf 解析格式化字符串，将最终需要显示的内容保存到 buf
- * 2. 调用 putchar 通过设置像素点颜色在显示器上显示字符
+ * 在光标处显示 buf 中的 i 个字符，处理换行、退格和制表符，调用者需要持有 printk_lock
+ * 调用 putchar 通过设置像素点颜色在显示器上显示字符
  */
-int color_printk(unsigned int FRcolor, unsigned int BKcolor, const char *fmt,
-                 ...) {
-  int i = 0, count = 0, line = 0;
-  va_list args;
-  va_start(args, fmt);
-  i = vsprintf(buf, fmt, args);
-  va_end(args);
+static void console_putchars(unsigned int FRcolor, unsigned int BKcolor, const char *buf,
+                             long i) {
+  long count = 0;
+  int line = 0;
 
-  /* 检测格式化后的字符串 */
   for (count = 0; count < i || line; ++count) {
     if (line > 0) {
       --count;
@@ -398,8 +428,7 @@ int color_printk(unsigned int FRcolor, unsigned int BKcolor, const char *fmt,
         }
       }
       /* 将待删除的位置使用空格填充 */
-      putchar(Pos.FB_addr, Pos.XResolution, Pos.XPosition * Pos.XCharSize,
-              Pos.YPosition * Pos.YCharSize, FRcolor, BKcolor, ' ');
+      console_blit(FRcolor, BKcolor, ' ');
     } else if ((unsigned char)*(buf + count) == '\t') {
       /**
        * 如果待显示的字符是 '\t'
@@ -414,14 +443,11 @@ int color_printk(unsigned int FRcolor, unsigned int BKcolor, const char *fmt,
        * 显示一个字符，后续如果 line 还是大于 0，说明还没有填充满；
        * 则会继续通过 for 循环以及前面的 if(line > 0) 条件判断再次跳转到这里进行填充
        */
-      putchar(Pos.FB_addr, Pos.XResolution, Pos.XPosition * Pos.XCharSize,
-              Pos.YPosition * Pos.YCharSize, FRcolor, BKcolor, ' ');
+      console_blit(FRcolor, BKcolor, ' ');
       ++Pos.XPosition;
     } else {
       /* 到达这里说明待显示就是普通字符 */
-      putchar(Pos.FB_addr, Pos.XResolution, Pos.XPosition * Pos.XCharSize,
-              Pos.YPosition * Pos.YCharSize, FRcolor, BKcolor,
-              (unsigned char)*(buf + count));
+      console_blit(FRcolor, BKcolor, (unsigned char)*(buf + count));
       ++Pos.XPosition;
     }
 
@@ -434,5 +460,191 @@ int color_printk(unsigned int FRcolor, unsigned int BKcolor, const char *fmt,
       Pos.YPosition = 0;
     }
   }
-  return i;
-}
\ No newline at end of file
+}
+
+/**
+ * @brief 把 len 个字符写入日志缓冲区
+ *
+ * @return int 成功返回 0，缓冲区已满返回 -1
+ */
+static int log_store(unsigned int level, unsigned int FRcolor, unsigned int BKcolor,
+                     const char *text, int len) {
+  unsigned long n = (len + LOG_TEXT_MAX - 1) / LOG_TEXT_MAX, pos, old, last, ts;
+  struct log_record *rec;
+  long diff;
+
+  if(n == 0)
+    return 0;
+  while(1) {
+    pos = log_head;
+    last = pos + n - 1;
+    diff = (long)(log_ring[last & (LOG_RING_SIZE - 1)].seq - LOG_FREE(last));
+    if(diff < 0)      /* 最后一条记录还没有被消费者显示，之前的记录按序显示，也就都还没有空出来 */
+      return -1;
+    if(diff > 0)      /* log_head 已经被其他生产者推进 */
+      continue;
+    old = pos;
+    __asm__ __volatile__("lock cmpxchgq %2, %1 \n\t"
+                         : "+a"(old), "+m"(log_head)
+                         : "r"(pos + n)
+                         : "memory", "cc");
+    if(old == pos)
+      break;
+  }
+
+  ts = ktime_get_ns();
+  for(unsigned long i = 0; i < n; ++i) {
+    rec = log_ring + ((pos + i) & (LOG_RING_SIZE - 1));
+    rec->ts_ns = ts;
+    rec->level = level;
+    rec->cpu = smp_processor_id();
+    rec->FRcolor = FRcolor;
+    rec->BKcolor = BKcolor;
+    rec->len = len > LOG_TEXT_MAX ? LOG_TEXT_MAX : len;
+    memcpy((void *)text, rec->text, rec->len);
+    text += rec->len;
+    len -= rec->len;
+    __asm__ __volatile__("" ::: "memory");
+    rec->seq = LOG_DONE(pos + i);
+  }
+  return 0;
+}
+
+static int log_sprintf(char *buf, const char *fmt, ...) {
+  va_list args;
+  int len;
+
+  va_start(args, fmt);
+  len = vsprintf(buf, fmt, args);
+  va_end(args);
+  return len;
+}
+
+/**
+ * @brief 显示日志缓冲区中所有已经写入的记录
+ * 其他 CPU 或者被中断的代码正在显示时直接返回，由它们负责显示；
+ * 每显示一条记录释放一次锁，关闭中断的时间不超过一条记录
+ * simd 不为 0 时使用 SSE/AVX 显示，只有控制台线程这样做，中断处理函数中不能使用 FPU
+ */
+static void __console_flush(int simd) {
+  struct log_record *rec;
+  unsigned long flags, dropped;
+
+  while(1) {
+    local_irq_save(flags);
+    if(!spin_trylock(&printk_lock)) {
+      local_irq_restore(flags);
+      return;
+    }
+    rec = log_ring + (log_tail & (LOG_RING_SIZE - 1));
+    dropped = log_dropped;
+    if(rec->seq != LOG_DONE(log_tail) && dropped == log_dropped_shown) {
+      spin_unlock_irqrestore(&printk_lock, flags);
+      return;
+    }
+    if(simd) {
+      kernel_fpu_begin();
+      console_simd = 1;
+    }
+    if(dropped != log_dropped_shown) {
+      char msg[64];
+      int len = log_sprintf(msg, "<%ld messages dropped>\n", dropped - log_dropped_shown);
+      console_putchars(RED, BLACK, msg, len);
+      log_dropped_shown = dropped;
+    }
+    if(rec->seq == LOG_DONE(log_tail)) {
+      console_putchars(rec->FRcolor, rec->BKcolor, rec->text, rec->len);
+      __asm__ __volatile__("" ::: "memory");
+      rec->seq = LOG_FREE(log_tail + LOG_RING_SIZE);
+      log_tail++;
+    }
+    if(simd) {
+      console_simd = 0;
+      kernel_fpu_end();
+    }
+    spin_unlock_irqrestore(&printk_lock, flags);
+  }
+}
+
+void console_flush() {
+  __console_flush(0);
+}
+
+/**
+ * @brief 格式化消息并写入日志缓冲区
+ * 1. 在栈上格式化，不再使用全局的 buf，中断处理函数中也可以调用；超过 LOG_LINE_MAX - 1 的部分被截断
+ * 2. 缓冲区满时先尝试同步显示腾出空间，仍然满时丢弃
+ * 3. 控制台线程启动之前、或者 level 不高于 LOG_ERR 时，返回之前同步显示
+ *
+ * @return int 格式化之后的长度
+ */
+int vprintk_emit(unsigned int level, unsigned int FRcolor, unsigned int BKcolor, const char *fmt,
+                 va_list args) {
+  char text[LOG_LINE_MAX];
+  int len;
+
+  len = vsnprintf(text, LOG_LINE_MAX, fmt, args);
+  if(len > LOG_LINE_MAX - 1)    /* 超出的部分被截断 */
+    len = LOG_LINE_MAX - 1;
+  if(log_store(level, FRcolor, BKcolor, text, len)) {
+    console_flush();
+    if(log_store(level, FRcolor, BKcolor, text, len))
+      __asm__ __volatile__("lock incq %0 \n\t" : "+m"(log_dropped) : : "memory");
+  }
+  if(!console_async || level <= LOG_ERR)
+    console_flush();
+  return len;
+}
+
+int printk_level(unsigned int level, unsigned int FRcolor, unsigned int BKcolor, const char *fmt,
+                 ...) {
+  va_list args;
+  int len;
+
+  va_start(args, fmt);
+  len = vprintk_emit(level, FRcolor, BKcolor, fmt, args);
+  va_end(args);
+  return len;
+}
+
+/* 格式化字符串显示，级别为 LOG_INFO */
+int color_printk(unsigned int FRcolor, unsigned int BKcolor, const char *fmt,
+                 ...) {
+  va_list args;
+  int len;
+
+  va_start(args, fmt);
+  len = vprintk_emit(LOG_INFO, FRcolor, BKcolor, fmt, args);
+  va_end(args);
+  return len;
+}
+
+/**
+ * 不经过格式化和日志缓冲区，直接显示 s 中的 len 个字符，s 中的 '%' 没有特殊含义
+ * 先显示缓冲区中已有的记录，保持输出的顺序
+ * s 可以是应用层地址，调用者需要保证这段内存已经映射，显示期间不会发生缺页
+ */
+long console_write(unsigned int FRcolor, unsigned int BKcolor, const char *s, long len) {
+  unsigned long flags;
+
+  console_flush();
+  spin_lock_irqsave(&printk_lock, flags);
+  console_putchars(FRcolor, BKcolor, s, len);
+  spin_unlock_irqrestore(&printk_lock, flags);
+  return len;
+}
+
+/* 控制台线程，定期把日志缓冲区中的记录显示到屏幕上 */
+static unsigned long console_thread(unsigned long arg) {
+  console_async = 1;
+  while(1) {
+    __console_flush(1);
+    schedule_timeout(CONSOLE_INTERVAL);
+  }
+  return 0;
+}
+
+/* 创建控制台线程，之后普通级别的消息异步显示，在 task_init 中调用 */
+void console_init() {
+  kernel_thread(console_thread, 0, CLONE_FS | CLONE_FILES | CLONE_SIGNAL);
+}
@@ -0,0 +1,96 @@
+#include "apic.h"
+#include "gate.h"
+#include "interrupt.h"
+#include "lib.h"
+#include "mem.h"
+#include "percpu.h"
+#include "printk.h"
+
+unsigned long apic_base = 0;
+int x2apic_enabled = 0;
+
+Build_IRQ(0xff)
+
+/**
+ * @brief 将 local APIC 的寄存器页映射到内核线性地址空间
+ * 寄存器页不在 E820 可用内存中，pagetable_init 没有为它建立直接映射；
+ * 每个处理器的寄存器页物理地址都相同，只需要由 BSP 映射一次
+ */
+static int apic_map() {
+  unsigned long phys = rdmsr(IA32_APIC_BASE) & PAGE_ADDR_MASK;
+  unsigned long vaddr = (unsigned long)phy_to_virt(phys);
+
+  if(map_pages((unsigned long *)Global_CR3, vaddr, phys, PAGE_4K_SIZE,
+               PAGE_KERNEL_Page | PAGE_PCD | PAGE_PWT)) {
+    color_printk(RED, BLACK, "apic_map() ERROR: %#018lx\n", phys);
+    return -1;
+  }
+  apic_base = vaddr;
+  return 0;
+}
+
+/**
+ * @brief BSP 初始化 local APIC
+ * 处理器支持 x2APIC 时所有处理器都使用 x2APIC 模式，寄存器通过 MSR 访问；否则映射 xAPIC 的寄存器页
+ *
+ * @return int 处理器没有 local APIC 时返回 -1
+ */
+int apic_init() {
+  unsigned int a, b, c, d;
+
+  get_cpuid(1, 0, &a, &b, &c, &d);
+  if(!(d & (1 << 9))) {
+    color_printk(RED, BLACK, "apic_init() ERROR: local APIC is not supported\n");
+    return -1;
+  }
+  if(c & (1 << 21))
+    x2apic_enabled = 1;
+  else if(apic_map())
+    return -1;
+
+  set_intr_gate(SPURIOUS_VECTOR, 0, IRQ0xff_interrupt);
+  local_apic_init();
+  color_printk(ORANGE, BLACK, "local APIC: %s, ID: %d, version: %#010x\n", x2apic_enabled ? "x2APIC" : "xAPIC",
+               apic_id(), apic_read(APIC_VERSION));
+  return 0;
+}
+
+/**
+ * @brief 初始化当前处理器的 local APIC
+ * 打开硬件和软件使能，并允许接收所有优先级的中断
+ * LVT 保持 BIOS 或者 INIT 之后的默认设置，AP 的 LINT0/LINT1 因此处于屏蔽状态
+ */
+void local_apic_init() {
+  unsigned long base = rdmsr(IA32_APIC_BASE);
+
+  /* 必须先处于 xAPIC 模式才能切换到 x2APIC 模式 */
+  if(!(base & APIC_BASE_ENABLE))
+    wrmsr(IA32_APIC_BASE, base |= APIC_BASE_ENABLE);
+  if(x2apic_enabled && !(base & APIC_BASE_X2APIC))
+    wrmsr(IA32_APIC_BASE, base | APIC_BASE_X2APIC);
+  apic_write(APIC_TPR, 0);
+  apic_write(APIC_SVR, APIC_SVR_ENABLE | SPURIOUS_VECTOR);
+  this_cpu_write(apic_id, apic_id());
+}
+
+/**
+ * @brief 发送处理器间中断
+ * x2APIC 模式下 ICR 是一个 64 位 MSR，一次写入即可，也不需要等待投递完成
+ *
+ * @param dest 目标处理器的 APIC ID，icr 中指定了目标简写时被忽略
+ * @param icr ICR 低 32 位，包括向量号、投递模式和目标简写
+ */
+void apic_send_ipi(unsigned int dest, unsigned int icr) {
+  unsigned long flags;
+
+  if(x2apic_enabled) {
+    wrmsr(X2APIC_MSR_BASE + (APIC_ICR_LOW >> 4), (unsigned long)dest << 32 | icr);
+    return;
+  }
+  local_irq_save(flags);
+  apic_write(APIC_ICR_HIGH, dest << 24);
+  apic_write(APIC_ICR_LOW, icr);
+  while(apic_read(APIC_ICR_LOW) & APIC_ICR_BUSY)
+    __asm__ __volatile__("pause \n\t");
+  local_irq_restore(flags);
+}
@@ -1,65 +1,22 @@
 #include "mem.h"
+#include "apic.h"
 #include "gate.h"
 #include "interrupt.h"
+#include "ioapic.h"
 #include "lib.h"
 #include "linkage.h"
+#include "percpu.h"
 #include "printk.h"
+#include "slab.h"
+#include "smp.h"
+#include "softirq.h"
+#include "timer.h"
 
 /**
  * @brief 中断和异常的区别大概就在于芯片的操作上面吧
  * 
  */
 
-/* 保存中断的上下文，过程和异常上下文保存大致一样 */
-#define SAVE_ALL                                                               \
-  "cld;               \n\t"                                                    \
-  "pushq  %rax;       \n\t"                                                    \
-  "pushq  %rax;       \n\t"                                                    \
-  "movq   %es,  %rax; \n\t"                                                    \
-  "pushq  %rax;       \n\t"                                                    \
-  "movq   %ds,  %rax; \n\t"                                                    \
-  "pushq  %rax;       \n\t"                                                    \
-  "xorq   %rax, %rax; \n\t"                                                    \
-  "pushq  %rbp;       \n\t"                                                    \
-  "pushq  %rdi;       \n\t"                                                    \
-  "pushq  %rsi;       \n\t"                                                    \
-  "pushq  %rdx;       \n\t"                                                    \
-  "pushq  %rcx;       \n\t"                                                    \
-  "pushq  %rbx;       \n\t"                                                    \
-  "pushq  %r8;        \n\t"                                                    \
-  "pushq  %r9;        \n\t"                                                    \
-  "pushq  %r10;       \n\t"                                                    \
-  "pushq  %r11;       \n\t"                                                    \
-  "pushq  %r12;       \n\t"                                                    \
-  "pushq  %r13;       \n\t"                                                    \
-  "pushq  %r14;       \n\t"                                                    \
-  "pushq  %r15;       \n\t"                                                    \
-  "movq   $0x10, %rdx;\n\t"                                                    \
-  "movq   %rdx, %ds;  \n\t"                                                    \
-  "movq   %rdx, %es;  \n\t"
-
-#define IRQ_NAME2(nr) nr##_interrupt(void)
-#define IRQ_NAME(nr)  IRQ_NAME2(IRQ##nr)
-
-/**
- * 定义中断处理函数的入口部分
- * void IRQ_NAME(nr) 声明了函数 IRQnr_interrupt()
- * 
- * 后续的内嵌汇编定义了 IRQnr_interrupt 的入口部分
- * 1. 调用 SAVE_ALL 保存相关寄存器，以及设置 ds 和 es 为内核代码段
- * 2. 保存 ret_from_intr 的地址，用于中断处理函数执行完毕的 ret 指令
- * 3. 跳转到 do_IRQ 函数执行
- */
-#define Build_IRQ(nr)                                                          \
-  void IRQ_NAME(nr);                                                           \
-  __asm__(SYMBOL_NAME_STR(IRQ) #nr "_interrupt:\n\t"                           \
-                                   "pushq $0x00  \n\t" SAVE_ALL                \
-                                   "movq %rsp, %rdi  \n\t"                     \
-                                   "leaq ret_from_intr(%rip), %rax \n\t"       \
-                                   "pushq %rax \n\t"                           \
-                                   "movq $" #nr ", %rsi  \n\t"                 \
-                                   "jmp do_IRQ \n\t");
-
 Build_IRQ(0x20)
 Build_IRQ(0x21)
 Build_IRQ(0x22)
@@ -113,16 +70,91 @@ void (*interrupt[24])(void) = {
 	IRQ0x37_interrupt,
 };
 
+struct irq_desc irq_desc[NR_IRQS] = {0};
+
+/**
+ * 8259A 的操作，IRQ 0~7 在主芯片上，8~15 在从芯片上；
+ * 从芯片通过主芯片的 IR2 级联，开启从芯片上的中断线时要同时开启 IR2
+ */
+static void i8259_enable(unsigned long irq) {
+  if(irq < 8) {
+    io_out8(0x21, io_in8(0x21) & ~(1 << irq));
+  } else if(irq < 16) {
+    io_out8(0xa1, io_in8(0xa1) & ~(1 << (irq - 8)));
+    io_out8(0x21, io_in8(0x21) & ~(1 << 2));
+  }
+}
+
+static void i8259_disable(unsigned long irq) {
+  if(irq < 8)
+    io_out8(0x21, io_in8(0x21) | (1 << irq));
+  else if(irq < 16)
+    io_out8(0xa1, io_in8(0xa1) | (1 << (irq - 8)));
+}
+
+/* 发送 EOI 命令复位 ISR 的对应位，从芯片上的中断需要先后向从芯片和主芯片发送 */
+static void i8259_ack(unsigned long irq) {
+  if(irq >= 8)
+    io_out8(0xa0, 0x20);
+  io_out8(0x20, 0x20);
+}
+
+struct hw_int_controller i8259_controller = {
+  .name = "XT-PIC",
+  .enable = i8259_enable,
+  .disable = i8259_disable,
+  .ack = i8259_ack,
+};
+
+/**
+ * 暂时的键盘驱动，只打印扫描码
+ * 中断处理函数只把扫描码放入缓冲区，打印交给 tasklet 在开中断的情况下完成；
+ * 键盘中断只投递给一个 CPU，缓冲区只在关闭中断时访问
+ */
+#define KBD_BUF_SIZE 64
+
+static unsigned char kbd_buf[KBD_BUF_SIZE];
+static unsigned int kbd_head = 0, kbd_tail = 0;
+
+static void keyboard_tasklet_func(unsigned long data) {
+  unsigned char x;
+
+  while(1) {
+    cli();
+    if(kbd_tail == kbd_head) {
+      sti();
+      break;
+    }
+    x = kbd_buf[kbd_tail++ % KBD_BUF_SIZE];
+    sti();
+    color_printk(RED, BLACK, "key code:%#08x\n", x);
+  }
+}
+
+static DECLARE_TASKLET(keyboard_tasklet, keyboard_tasklet_func, 0);
+
+static void keyboard_handler(unsigned long irq, unsigned long parameter, struct pt_regs *regs) {
+  unsigned char x = io_in8(0x60); /* 读取键盘缓冲区 */
+
+  if(kbd_head - kbd_tail < KBD_BUF_SIZE)  /* 缓冲区满时丢弃 */
+    kbd_buf[kbd_head++ % KBD_BUF_SIZE] = x;
+  tasklet_schedule(&keyboard_tasklet);
+}
+
 /**
  * @brief 中断初始化
  * 1. 初始化中断门描述符
  * 2. 初始化 8259A 中断控制器
- * 3. 开启中断
+ * 3. 有 local APIC 和 I/O APIC 时屏蔽 8259A，改由 I/O APIC 投递外部中断
+ * 4. 初始化中断线描述符，注册键盘中断，开启中断
+ * 所有中断线在注册处理函数之前都是屏蔽的，时钟中断由 timer_init 注册
  */
 void init_interrupt() {
-  /* 初始化中断门描述符 */
+  struct hw_int_controller *controller = &i8259_controller;
+
+  /* 初始化中断门描述符，中断在被打断进程的内核栈上处理，返回前才能检查 current 是否需要调度 */
   for(int i = 32; i < 56; ++i) {
-    set_intr_gate(i, 2, interrupt[i - 32]);
+    set_intr_gate(i, 0, interrupt[i - 32]);
   }
 
   color_printk(RED, BLACK, "8259A init \n");
@@ -147,28 +179,148 @@ void init_interrupt() {
   io_out8(0xa1, 0x01);
 
   /**
-   * 复位 master/slave 的 IMR(OCW1) 寄存器的全部中断屏蔽位，并使能中断
+   * 置位 master/slave 的 IMR(OCW1) 寄存器的全部中断屏蔽位
    * 1. master OCW1 映射到 0x21
    * 2. slave OCW1 映射到 0xa1
    */
-  /* 下面暂时屏蔽除了键盘中断之外所有中断 */
-  io_out8(0x21, 0xfd);
+  io_out8(0x21, 0xff);
   io_out8(0xa1, 0xff);
 
+  /**
+   * I/O APIC 可以把中断投递给任意 CPU，EOI 也不需要访问 I/O 端口；
+   * 使用 I/O APIC 时 8259A 保持全部屏蔽，BSP 的 LINT0 也不再接收 8259A 的 ExtINT
+   */
+  if(!apic_init() && !ioapic_init()) {
+    apic_write(APIC_LVT_LINT0, APIC_LVT_MASKED);
+    controller = &ioapic_controller;
+  }
+  for(int i = 0; i < NR_IRQS; ++i) {
+    irq_desc[i].controller = controller;
+    spin_init(&irq_desc[i].lock);
+  }
+  color_printk(RED, BLACK, "interrupt controller: %s\n", controller->name);
+
+  register_irq(1, keyboard_handler, 0, "keyboard");
   sti();
 }
 
+/**
+ * @brief 为 IRQ irq 注册中断处理函数
+ * 同一条中断线可以注册多个处理函数，中断到来时按照注册顺序依次调用；
+ * 注册第一个处理函数时在中断控制器上开启该中断线
+ *
+ * @param parameter 调用 handler 时原样传回，共享中断线时用于区分设备
+ * @return int IRQ 无效或者内存不足时返回 -1
+ */
+int register_irq(unsigned long irq, irq_handler_t handler, unsigned long parameter, char *name) {
+  struct irq_desc *desc;
+  struct irqaction *action, **p;
+  unsigned long flags;
+
+  if(irq >= NR_IRQS || handler == NULL) {
+    color_printk(RED, BLACK, "register_irq() ERROR: irq: %ld\n", irq);
+    return -1;
+  }
+  action = (struct irqaction *)kmalloc(sizeof(struct irqaction));
+  if(action == NULL) {
+    color_printk(RED, BLACK, "register_irq() ERROR: kmalloc failed\n");
+    return -1;
+  }
+  action->handler = handler;
+  action->parameter = parameter;
+  action->name = name;
+  action->next = NULL;
+
+  desc = irq_desc + irq;
+  spin_lock_irqsave(&desc->lock, flags);
+  for(p = &desc->action; *p; p = &(*p)->next)
+    ;
+  *p = action;
+  if(desc->action == action && desc->controller->enable)
+    desc->controller->enable(irq);
+  spin_unlock_irqrestore(&desc->lock, flags);
+  return 0;
+}
+
+/**
+ * @brief 注销 IRQ irq 上由 handler 和 parameter 确定的处理函数
+ * 最后一个处理函数被注销时屏蔽该中断线；处理函数执行期间持有 desc->lock，
+ * 所以处理函数不能注册或注销自己所在的中断线
+ *
+ * @return int 没有找到对应的处理函数时返回 -1
+ */
+int unregister_irq(unsigned long irq, irq_handler_t handler, unsigned long parameter) {
+  struct irq_desc *desc;
+  struct irqaction *action = NULL, **p;
+  unsigned long flags;
+
+  if(irq >= NR_IRQS)
+    return -1;
+  desc = irq_desc + irq;
+  spin_lock_irqsave(&desc->lock, flags);
+  for(p = &desc->action; *p; p = &(*p)->next) {
+    if((*p)->handler == handler && (*p)->parameter == parameter) {
+      action = *p;
+      *p = action->next;
+      break;
+    }
+  }
+  if(action && desc->action == NULL && desc->controller->disable)
+    desc->controller->disable(irq);
+  spin_unlock_irqrestore(&desc->lock, flags);
+
+  if(action == NULL) {
+    color_printk(RED, BLACK, "unregister_irq() ERROR: irq: %ld\n", irq);
+    return -1;
+  }
+  kfree(action);
+  return 0;
+}
+
+/* 打印每条已注册中断线的处理函数、中断次数和平均、最大 TSC 周期数 */
+void irq_stat_print() {
+  for(int i = 0; i < NR_IRQS; ++i) {
+    struct irq_desc *desc = irq_desc + i;
+    if(desc->action == NULL && desc->count == 0)
+      continue;
+    color_printk(ORANGE, BLACK, "IRQ%d %s %s count: %ld, avg cycles: %ld, max cycles: %ld\n", i,
+                 desc->controller->name, desc->action ? desc->action->name : "-", desc->count,
+                 desc->count ? desc->total_cycles / desc->count : 0, desc->max_cycles);
+  }
+}
+
 /**
  * @brief 中断处理函数的主函数，作用是分发中断请求到各个中断处理函数
  * 所有的中断处理函数在执行完入口部分之后，都会跳转到这个主函数
- * 然后由主函数分发处理具体的中断，执行具体的中断处理函数
+ * 然后由主函数根据向量号找到中断线描述符，依次调用注册的处理函数，最后由中断控制器发送 EOI
  * @param regs 
  * @param nr 
  */
 void do_IRQ(unsigned long regs, unsigned long nr) {
-  unsigned char x;
-  color_printk(RED, BLACK, "do_IRQ:%#08x\t", nr);
-  x = io_in8(0x60); /* 读取键盘缓冲区 */
-  color_printk(RED, BLACK, "key code:%#08x\n", x);
-  io_out8(0x20, 0x20);  /* 中断结束，发送 EIO 命令给 8259A 来复位 ISR 的对应位 */
-}
\ No newline at end of file
+  unsigned long start = rdtsc(), cycles, irq = nr - IRQ_VECTOR_BASE;
+  struct irq_desc *desc;
+  struct irqaction *action;
+
+  if(nr >= IPI_VECTOR_BASE) {   /* 处理器间中断由 local APIC 投递，不经过中断线描述符 */
+    do_IPI(regs, nr);
+    return;
+  }
+  this_cpu_inc(irq_count);
+  desc = irq_desc + irq;
+
+  spin_lock(&desc->lock);
+  action = desc->action;
+  if(action == NULL)
+    color_printk(RED, BLACK, "do_IRQ:%#08x, no handler\n", nr);
+  for(; action; action = action->next)
+    action->handler(irq, action->parameter, (struct pt_regs *)regs);
+  spin_unlock(&desc->lock);
+
+  desc->controller->ack(irq);
+
+  cycles = rdtsc() - start;
+  desc->count++;
+  desc->total_cycles += cycles;
+  if(cycles > desc->max_cycles)
+    desc->max_cycles = cycles;
+}
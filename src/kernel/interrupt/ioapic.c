@@ -0,0 +1,151 @@
+#include "ioapic.h"
+#include "apic.h"
+#include "lib.h"
+#include "mem.h"
+#include "percpu.h"
+#include "printk.h"
+#include "smp.h"
+#include "spinlock.h"
+
+int ioapic_enabled = 0;
+
+static unsigned long ioapic_base = 0;   /* I/O APIC 寄存器的线性地址 */
+static unsigned int ioapic_pins = 0;    /* 重定向表项数量 */
+static spinlock_t ioapic_lock = SPIN_LOCK_UNLOCKED;   /* IOREGSEL 和 IOWIN 必须成对访问 */
+
+static unsigned int ioapic_read(unsigned int reg) {
+  *(volatile unsigned int *)(ioapic_base + IOAPIC_IOREGSEL) = reg;
+  return *(volatile unsigned int *)(ioapic_base + IOAPIC_IOWIN);
+}
+
+static void ioapic_write(unsigned int reg, unsigned int value) {
+  *(volatile unsigned int *)(ioapic_base + IOAPIC_IOREGSEL) = reg;
+  *(volatile unsigned int *)(ioapic_base + IOAPIC_IOWIN) = value;
+}
+
+static unsigned long ioapic_read_entry(unsigned int pin) {
+  unsigned long low = ioapic_read(IOAPIC_REDTBL(pin));
+  return (unsigned long)ioapic_read(IOAPIC_REDTBL(pin) + 1) << 32 | low;
+}
+
+/* 先写高 32 位的投递目标，再写包含屏蔽位的低 32 位 */
+static void ioapic_write_entry(unsigned int pin, unsigned long entry) {
+  ioapic_write(IOAPIC_REDTBL(pin) + 1, entry >> 32);
+  ioapic_write(IOAPIC_REDTBL(pin), entry & 0xffffffff);
+}
+
+/**
+ * ISA IRQ 0（PIT）在 PC 上通过中断源覆盖连接到 I/O APIC 的 2 号引脚，其余 IRQ 与引脚一一对应
+ * IRQ 2 是 8259A 的级联线，不能使用
+ */
+static int irq_to_pin(unsigned int irq) {
+  if(irq == 2 || irq >= ioapic_pins)
+    return -1;
+  return irq == 0 ? 2 : irq;
+}
+
+static unsigned int pin_to_irq(unsigned int pin) {
+  return pin == 2 ? 0 : pin;
+}
+
+/**
+ * @brief 初始化 I/O APIC
+ * 所有引脚先被屏蔽并投递给 BSP，ISA 中断（0~15）为边沿触发、高电平有效，
+ * PCI 中断（16~23）为电平触发、低电平有效
+ *
+ * @return int 默认地址上没有 I/O APIC 时返回 -1
+ */
+int ioapic_init() {
+  unsigned long vaddr = (unsigned long)phy_to_virt(IOAPIC_PHY_ADDR);
+  unsigned int ver;
+
+  if(map_pages((unsigned long *)Global_CR3, vaddr, IOAPIC_PHY_ADDR, PAGE_4K_SIZE,
+               PAGE_KERNEL_Page | PAGE_PCD | PAGE_PWT)) {
+    color_printk(RED, BLACK, "ioapic_init() ERROR: %#018lx\n", IOAPIC_PHY_ADDR);
+    return -1;
+  }
+  ioapic_base = vaddr;
+  ver = ioapic_read(IOAPIC_VER);
+  if(ver == 0xffffffff) {
+    color_printk(RED, BLACK, "ioapic_init() ERROR: no I/O APIC at %#018lx\n", IOAPIC_PHY_ADDR);
+    unmap_pages((unsigned long *)Global_CR3, vaddr, PAGE_4K_SIZE);
+    ioapic_base = 0;
+    return -1;
+  }
+  ioapic_pins = ((ver >> 16) & 0xff) + 1;
+  if(ioapic_pins > NR_IRQS)
+    ioapic_pins = NR_IRQS;
+
+  for(unsigned int pin = 0; pin < ioapic_pins; ++pin) {
+    unsigned long entry = IOAPIC_MASKED | (IRQ_VECTOR_BASE + pin_to_irq(pin)) |
+                          (this_cpu_read(apic_id) << IOAPIC_DEST_SHIFT);
+    if(pin >= 16)
+      entry |= IOAPIC_LEVEL | IOAPIC_ACTIVE_LOW;
+    ioapic_write_entry(pin, entry);
+  }
+  ioapic_enabled = 1;
+  color_printk(ORANGE, BLACK, "I/O APIC: ID: %d, version: %#04x, pins: %d\n",
+               ioapic_read(IOAPIC_ID) >> 24, ver & 0xff, ioapic_pins);
+  return 0;
+}
+
+static void ioapic_mask_irq(unsigned int irq, int masked) {
+  int pin = irq_to_pin(irq);
+  unsigned long entry, flags;
+
+  if(pin < 0)
+    return;
+  spin_lock_irqsave(&ioapic_lock, flags);
+  entry = ioapic_read_entry(pin);
+  entry = masked ? entry | IOAPIC_MASKED : entry & ~IOAPIC_MASKED;
+  ioapic_write_entry(pin, entry);
+  spin_unlock_irqrestore(&ioapic_lock, flags);
+}
+
+void ioapic_enable_irq(unsigned int irq) {
+  ioapic_mask_irq(irq, 0);
+}
+
+void ioapic_disable_irq(unsigned int irq) {
+  ioapic_mask_irq(irq, 1);
+}
+
+/**
+ * @brief 设置 IRQ 的中断亲和性，之后该 IRQ 只投递给 CPU cpu
+ *
+ * @return int IRQ 无效、CPU 不在线或者没有使用 I/O APIC 时返回 -1
+ */
+int irq_set_affinity(unsigned int irq, unsigned int cpu) {
+  int pin = irq_to_pin(irq);
+  unsigned long entry, flags;
+
+  if(!ioapic_enabled || pin < 0 || cpu >= NR_CPUS || !cpu_online(cpu))
+    return -1;
+  spin_lock_irqsave(&ioapic_lock, flags);
+  entry = ioapic_read_entry(pin);
+  entry &= ~(0xffUL << IOAPIC_DEST_SHIFT);
+  entry |= cpu_data[cpu].apic_id << IOAPIC_DEST_SHIFT;
+  ioapic_write_entry(pin, entry);
+  spin_unlock_irqrestore(&ioapic_lock, flags);
+  return 0;
+}
+
+static void ioapic_enable(unsigned long irq) {
+  ioapic_enable_irq(irq);
+}
+
+static void ioapic_disable(unsigned long irq) {
+  ioapic_disable_irq(irq);
+}
+
+/* 边沿触发和电平触发的中断都由 local APIC 的 EOI 结束，电平触发的 EOI 会被广播到 I/O APIC */
+static void ioapic_ack(unsigned long irq) {
+  apic_eoi();
+}
+
+struct hw_int_controller ioapic_controller = {
+  .name = "IO-APIC",
+  .enable = ioapic_enable,
+  .disable = ioapic_disable,
+  .ack = ioapic_ack,
+};
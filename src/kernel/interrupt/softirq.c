@@ -0,0 +1,137 @@
+#include "softirq.h"
+#include "lib.h"
+#include "percpu.h"
+#include "printk.h"
+#include "schedule.h"
+#include "task.h"
+
+static struct softirq_action softirq_vec[NR_SOFTIRQS];
+
+/* 每个 CPU 等待执行的 tasklet，只在本 CPU 关闭中断时访问 */
+static struct tasklet_struct *tasklet_vec[NR_CPUS];
+
+void register_softirq(unsigned int nr, void (*action)(unsigned long data), unsigned long data) {
+  if(nr >= NR_SOFTIRQS) {
+    color_printk(RED, BLACK, "register_softirq() ERROR: nr: %d\n", nr);
+    return;
+  }
+  softirq_vec[nr].data = data;
+  softirq_vec[nr].action = action;
+}
+
+/* 标记本 CPU 的软中断 nr 等待执行，在中断返回或者 ksoftirqd 中处理 */
+void raise_softirq(unsigned int nr) {
+  this_cpu_set_bit(softirq_pending, nr);
+}
+
+/* ksoftirqd 处于睡眠状态时唤醒它，调用者需要关闭中断 */
+static void wakeup_softirqd() {
+  struct task_struct *tsk = this_cpu_read(ksoftirqd);
+
+  if(tsk && tsk->state != TASK_RUNNING)
+    wakeup_process(tsk);
+}
+
+/**
+ * @brief 执行本 CPU 等待的软中断
+ * 由 ret_from_intr 在中断返回前调用，或者由 ksoftirqd 调用
+ * 1. 关闭中断取走并清空 softirq_pending，然后开启中断依次执行对应的处理函数
+ * 2. 执行期间新产生的软中断最多再处理 MAX_SOFTIRQ_RESTART 轮，仍未处理完时唤醒 ksoftirqd，
+ *    避免中断频繁时被打断的进程一直得不到运行
+ * 执行期间增加 preempt_count，嵌套的中断返回时不会再次进入 do_softirq，也不会切换进程
+ */
+void do_softirq() {
+  struct task_struct *tsk = current;
+  unsigned long pending, flags;
+  int restart = MAX_SOFTIRQ_RESTART;
+
+  local_irq_save(flags);
+  tsk->preempt_count++;
+  while((pending = this_cpu_read(softirq_pending)) && restart--) {
+    this_cpu_write(softirq_pending, 0);
+    sti();
+    for(unsigned int nr = 0; pending; ++nr, pending >>= 1) {
+      if((pending & 1) && softirq_vec[nr].action)
+        softirq_vec[nr].action(softirq_vec[nr].data);
+    }
+    cli();
+  }
+  if(this_cpu_read(softirq_pending))
+    wakeup_softirqd();
+  tsk->preempt_count--;
+  local_irq_restore(flags);
+}
+
+/**
+ * @brief 将 tasklet 加入本 CPU 的 tasklet 链表
+ * tasklet 已经被调度还没有执行时直接返回
+ */
+void tasklet_schedule(struct tasklet_struct *t) {
+  unsigned long flags;
+  unsigned char old;
+
+  __asm__ __volatile__("lock btsq $0, %0 \n\t"
+                       "setc %1 \n\t"
+                       : "+m"(t->state), "=r"(old)
+                       :
+                       : "memory", "cc");
+  if(old)
+    return;
+  local_irq_save(flags);
+  t->next = tasklet_vec[smp_processor_id()];
+  tasklet_vec[smp_processor_id()] = t;
+  raise_softirq(TASKLET_SOFTIRQ);
+  local_irq_restore(flags);
+}
+
+/* 取走本 CPU 的全部 tasklet 并依次执行，执行前清除调度标志，处理函数可以再次调度自己 */
+static void tasklet_action(unsigned long data) {
+  struct tasklet_struct *list, *t;
+
+  cli();
+  list = tasklet_vec[smp_processor_id()];
+  tasklet_vec[smp_processor_id()] = NULL;
+  sti();
+
+  while(list) {
+    t = list;
+    list = list->next;
+    __asm__ __volatile__("lock andq %1, %0 \n\t"
+                         : "+m"(t->state)
+                         : "i"(~TASKLET_STATE_SCHED)
+                         : "memory", "cc");
+    t->func(t->data);
+  }
+}
+
+void softirq_init() {
+  register_softirq(TASKLET_SOFTIRQ, tasklet_action, 0);
+}
+
+/**
+ * @brief 每个 CPU 的软中断线程
+ * 没有等待的软中断时进入睡眠，由 do_softirq 在处理不完时唤醒；
+ * 检查和睡眠都在关闭中断的情况下进行，唤醒不会丢失
+ */
+static unsigned long ksoftirqd(unsigned long arg) {
+  struct task_struct *tsk = current;
+
+  this_cpu_write(ksoftirqd, tsk);
+  while(1) {
+    cli();
+    if(!this_cpu_read(softirq_pending)) {
+      tsk->state = TASK_INTERRUPTIBLE;
+      schedule();
+    }
+    sti();
+    do_softirq();
+    if(tsk->flags & PF_NEED_SCHEDULE)
+      schedule();
+  }
+  return 0;
+}
+
+/* 为当前 CPU 创建 ksoftirqd，BSP 在 task_init 中调用，AP 在 Start_SMP 中调用 */
+void ksoftirqd_init() {
+  kernel_thread(ksoftirqd, smp_processor_id(), CLONE_FS | CLONE_FILES | CLONE_SIGNAL | CLONE_CPU);
+}
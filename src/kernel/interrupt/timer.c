@@ -0,0 +1,176 @@
+#include "timer.h"
+#include "apic.h"
+#include "gate.h"
+#include "interrupt.h"
+#include "lib.h"
+#include "percpu.h"
+#include "printk.h"
+#include "schedule.h"
+#include "smp.h"
+#include "softirq.h"
+#include "vdso.h"
+
+/* 系统启动以来的时钟节拍数 */
+volatile unsigned long jiffies = 0;
+
+/**
+ * 处理器支持 TSC-deadline 模式（CPUID.01H:ECX[24]）时，每个 CPU 使用自己的 local APIC 定时器产生时钟节拍，
+ * 每次中断时写入下一次到期的 TSC 值；空闲的 CPU 可以停止周期性的节拍，只在下一个定时器到期时唤醒
+ * 否则使用 PIT 产生周期性时钟中断，由 BSP 通过 IPI 转发给其他处理器
+ */
+static int tsc_deadline_enabled = 0;
+static unsigned long tsc_per_tick = 0;  /* 一个时钟节拍的 TSC 周期数 */
+
+#define NOHZ_MAX_TICKS (10 * HZ)  /* 停止节拍时最长的睡眠时间，避免计算 TSC 值时溢出 */
+
+Build_IRQ(0xc9)   /* LOCAL_TIMER_VECTOR */
+
+static void timer_handler(unsigned long irq, unsigned long parameter, struct pt_regs *regs) {
+  do_timer();
+}
+
+/**
+ * @brief 初始化时钟
+ * 1. 使用 PIT 通道 2 校准 TSC
+ * 2. 支持 TSC-deadline 时由 local APIC 定时器产生时钟节拍，不再使用 PIT
+ * 3. 否则初始化 8253/8254 PIT 的通道 0，产生频率为 HZ 的周期性时钟中断，
+ *    通道 0 连接在 IRQ 0 上，中断向量号为 0x20，需要在 init_interrupt 之后调用
+ */
+void timer_init() {
+  unsigned long latch = (PIT_FREQ + HZ / 2) / HZ;
+  unsigned int a, b, c, d;
+
+  init_timers();
+  tsc_calibrate();
+  tsc_per_tick = tsc_khz * 1000 / HZ;
+  vdso_init();
+
+  get_cpuid(1, 0, &a, &b, &c, &d);
+  if((c & (1 << 24)) && tsc_per_tick && (x2apic_enabled || apic_base)) {
+    tsc_deadline_enabled = 1;
+    set_intr_gate(LOCAL_TIMER_VECTOR, 0, IRQ0xc9_interrupt);
+    local_timer_init();
+    color_printk(RED, BLACK, "timer init, HZ: %d, local APIC timer in TSC-deadline mode\n", HZ);
+    return;
+  }
+
+  io_out8(0x43, 0x34);                  /* 通道 0，先写低字节再写高字节，模式 2 */
+  io_out8(0x40, latch & 0xff);
+  io_out8(0x40, (latch >> 8) & 0xff);
+  register_irq(0, timer_handler, 0, "timer");
+  color_printk(RED, BLACK, "timer init, HZ: %d, latch: %d\n", HZ, latch);
+}
+
+/* 写入 IA32_TSC_DEADLINE，xAPIC 模式下需要保证之前对 LVT 的 MMIO 写入已经完成 */
+static void tsc_deadline_set(unsigned long deadline) {
+  io_mfence();
+  wrmsr(IA32_TSC_DEADLINE, deadline);
+}
+
+/* 初始化当前 CPU 的 local APIC 定时器，BSP 在 timer_init 中调用，AP 在 Start_SMP 中调用 */
+void local_timer_init() {
+  unsigned long next;
+
+  if(!tsc_deadline_enabled)
+    return;
+  apic_write(APIC_LVT_TIMER, APIC_TIMER_TSC_DEADLINE | LOCAL_TIMER_VECTOR);
+  next = rdtsc() + tsc_per_tick;
+  this_cpu_write(next_tick, next);
+  this_cpu_write(tick_stopped, 0);
+  tsc_deadline_set(next);
+}
+
+/**
+ * 根据 TSC 更新 jiffies，任何一个 CPU 的时钟中断都可以推进 jiffies，
+ * 所有 CPU 都停止节拍时，醒来的 CPU 也能补上睡眠期间的节拍
+ * 成功推进 jiffies 的 CPU 负责更新 vdso_data 中的时间
+ */
+static void update_jiffies() {
+  unsigned long now = ktime_get_ns() / (1000000000 / HZ), old;
+  unsigned char ok;
+
+  while((old = jiffies) < now) {
+    __asm__ __volatile__("lock cmpxchgq %3, %1 \n\t"
+                         "sete %2 \n\t"
+                         : "+a"(old), "+m"(jiffies), "=q"(ok)
+                         : "r"(now)
+                         : "memory", "cc");
+    if(ok) {
+      vdso_update_time();
+      break;
+    }
+  }
+}
+
+/* 每个时钟节拍在所有 CPU 上执行：消耗当前进程的时间片并处理本 CPU 的定时器 */
+void update_process_times() {
+  scheduler_tick();
+  vdso_update_cpu();
+  raise_softirq(TIMER_SOFTIRQ);
+}
+
+/* PIT 时钟中断处理函数，只在 BSP 上执行 */
+void do_timer() {
+  jiffies++;
+  vdso_update_time();
+  /* PIT 只连接在 BSP 上，由 BSP 把时钟节拍转发给其他处理器 */
+  if(smp_num_cpus > 1)
+    apic_send_ipi(0, APIC_DEST_ALLBUT | APIC_INT_ASSERT | APIC_DM_FIXED | IPI_TIMER_VECTOR);
+  update_process_times();
+}
+
+/**
+ * @brief local APIC 定时器中断处理函数，由 do_IPI 调用
+ * 下一次到期时间按照固定间隔推进，中断处理延迟不会累积；
+ * 错过了多个节拍时从当前时间重新开始
+ */
+void local_timer_interrupt() {
+  unsigned long now = rdtsc(), next = this_cpu_read(next_tick) + tsc_per_tick;
+
+  if((long)(next - now) <= 0)
+    next = now + tsc_per_tick;
+  this_cpu_write(next_tick, next);
+  this_cpu_write(tick_stopped, 0);
+  tsc_deadline_set(next);
+
+  update_jiffies();
+  update_process_times();
+}
+
+/**
+ * @brief 空闲 CPU 停止周期性时钟节拍
+ * 把 local APIC 定时器设置为本 CPU 下一个定时器到期的时间，之后 CPU 可以一直 hlt 到那个时候；
+ * 其他 CPU 唤醒本 CPU 上的进程时会发送 IPI_RESCHEDULE_VECTOR
+ * 调用者需要关闭中断
+ */
+void tick_nohz_idle_enter() {
+  unsigned long next, now;
+
+  if(!tsc_deadline_enabled || this_cpu_read(tick_stopped))
+    return;
+  next = next_timer_interrupt();
+  now = jiffies;
+  if((long)(next - now) <= 1)   /* 下一个节拍就有定时器到期，不需要停止 */
+    return;
+  if(next - now > NOHZ_MAX_TICKS)
+    next = now + NOHZ_MAX_TICKS;
+  next = this_cpu_read(next_tick) + (next - now - 1) * tsc_per_tick;
+  this_cpu_write(next_tick, next);
+  this_cpu_write(tick_stopped, 1);
+  tsc_deadline_set(next);
+}
+
+/* 空闲 CPU 要开始运行进程时恢复周期性时钟节拍，由 schedule 在切换出 0 号进程时调用 */
+void tick_nohz_idle_exit() {
+  unsigned long flags, next;
+
+  if(!tsc_deadline_enabled || !this_cpu_read(tick_stopped))
+    return;
+  local_irq_save(flags);
+  next = rdtsc() + tsc_per_tick;
+  this_cpu_write(next_tick, next);
+  this_cpu_write(tick_stopped, 0);
+  tsc_deadline_set(next);
+  update_jiffies();
+  local_irq_restore(flags);
+}
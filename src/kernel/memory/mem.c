@@ -1,5 +1,8 @@
 #include "mem.h"
 #include "lib.h"
+#include "percpu.h"
+#include "apic.h"
+#include "smp.h"
 
 unsigned long *Global_CR3 = NULL;
 
@@ -41,8 +44,10 @@ static void pages_init() {
    * 2. (tmp + sizeof(long) - 1) & (~(sizeof(long) - 1) 表示按照 long 的大小上取整对齐
    */
   memory_management_struct.pages_length = ((TotalMem >> PAGE_2M_SHIFT) * sizeof(struct page) + sizeof(long) - 1) & (~(sizeof(long) - 1));
-  /* 清零 pages[] 数组，以备后续的初始化程序使用 */
-  memset(memory_management_struct.pages_struct, 0x00, memory_management_struct.pages_length);
+  /**
+   * pages[] 数组不再整体清零，属于 zone 的 page 由 zone_init_pages 逐段初始化，
+   * 不属于任何 zone 的 page（内存空洞）在 init_usage_memory 中清零
+   */
 }
 
 static void zones_init() {
@@ -57,19 +62,65 @@ static void zones_init() {
   memset(memory_management_struct.zones_struct, 0x00, memory_management_struct.zones_length);
 }
 
+/**
+ * bits_map 只记录 2M 页的使用情况，4K 页池中的页面不需要操作 bitmap，
+ * 承载页池的 2M 页在分配时已经置位
+ */
+static inline void page_bitmap_set(struct page *page) {
+  if(page->zone_struct->attribute & ZONE_4K_FRAME)
+    return;
+  *(memory_management_struct.bits_map + ((page->PHY_address >> PAGE_2M_SHIFT) >> 6)) |=
+      1UL << (page->PHY_address >> PAGE_2M_SHIFT) % 64;
+}
+
+static inline void page_bitmap_clean(struct page *page) {
+  if(page->zone_struct->attribute & ZONE_4K_FRAME)
+    return;
+  *(memory_management_struct.bits_map + ((page->PHY_address >> PAGE_2M_SHIFT) >> 6)) &=
+      ~(1UL << (page->PHY_address >> PAGE_2M_SHIFT) % 64);
+}
+
+/**
+ * @brief 初始化 zone 中从 pages_initialized 开始的 nr 个 page 结构体，并复位它们在 bitmap 中的 bit 位
+ * 未初始化的 page 在 bitmap 中保持置位状态，不会被当作空闲页使用
+ * 
+ * @return unsigned long 本次初始化的 page 数量
+ */
+static unsigned long zone_init_pages(struct zone *z, unsigned long nr) {
+  unsigned long start = z->pages_initialized;
+  unsigned long end = start + nr < z->pages_length ? start + nr : z->pages_length;
+  struct page *p = z->pages_group + start;
+
+  for(unsigned long j = start; j < end; ++j, ++p) {   /* 初始化 page 结构体，复位 bitmap bit 位 */
+    p->zone_struct = z;   /* 第 j 个 page 对应的 zone[] */
+    p->PHY_address = z->zone_start_address + PAGE_2M_SIZE * j;  /* 第 j 个 page 的首地址 */
+    p->attribute = 0;
+    p->reference_count = 0;
+    p->age = 0;
+    p->buddy_order = -1;
+    p->slab = NULL;
+    page_bitmap_clean(p);
+  }
+  z->pages_initialized = end;
+  return end - start;
+}
+
 /**
  * @brief 初始化可用物理内存
  * 所有的 struct page 结构体连接在一起，首地址是 memory_management_struct.pages_struct
  * 所有的 struct zone 结构体连接在一起，首地址是 memory_management_struct.zones_struct
  * 每个 zone 对应 pages_struct 区间的某一小段区间，每个 page 都有其对应的 zone
  * 另外补充，这里第一页是从 2MB 开始的，0~2MB 的物理内存并没有被包含进去，详细可以运行内核观察一下物理内存段的输出结果
+ * 
+ * 启动阶段每个 zone 只初始化前 DEFERRED_INIT_PAGES 个 page，
+ * 剩余部分在第一次分配不到页面时或者由 deferred_memory_init 补充初始化
  */
 static void init_usage_memory() {
+  unsigned long hole_start = 0;   /* 上一个 zone 的结束页号，用于清零内存空洞对应的 page */
+
   for(int i = 0; i <= memory_management_struct.e820_length; ++i) {
     unsigned long start, end;
     struct zone *z;
-    struct page *p;
-    unsigned long *b;
 
     /* 过滤非物理内存段 */
     if(memory_management_struct.e820[i].type != 1)
@@ -93,29 +144,25 @@ static void init_usage_memory() {
     z->attribute = 0;
     z->GMD_struct = &memory_management_struct;
     z->pages_length = (end - start) >> PAGE_2M_SHIFT;
+    z->pages_initialized = 0;
     /**
      * zone 对应的 page 数组首地址
      * 如果是第 0 个 zone 的话，pages_group 指向的是第 1 页而不是第 0 页，原因在函数开头已经说明
      */
     z->pages_group = (struct page *)(memory_management_struct.pages_struct + (start >> PAGE_2M_SHIFT));
-    
-    /* page init */
-    p = z->pages_group;
-    for(int j = 0; j < z->pages_length; ++j, ++p) {   /* 遍历该段内的所有 page，初始化 page 结构体，复位 bitmap bit 位 */
-      p->zone_struct = z;   /* 第 j 个 page 对应的 zone[] */
-      p->PHY_address = start + PAGE_2M_SIZE * j;  /* 第 j 个 page 的首地址 */
-      p->attribute = 0;
-      p->reference_count = 0;
-      p->age = 0;
-      /**
-       * 复位 bitmap 对应的 bit 位
-       * 1. (p->PHY_address >> PAGE_2M_SHIFT) >> 6 计算出该 page 在 bitmap 中的第几个 long
-       * 2. ^= 1UL << (p->PHY_address >> PAGE_2M_SHIFT) % 64 对该位进行异或操作完成复位
-       */
-      *(memory_management_struct.bits_map + ((p->PHY_address >> PAGE_2M_SHIFT) >> 6)) ^=
-          1UL << (p->PHY_address >> PAGE_2M_SHIFT) % 64;
-    }
+
+    /* 清零 zone 之前的内存空洞对应的 page */
+    if((start >> PAGE_2M_SHIFT) > hole_start)
+      memset(memory_management_struct.pages_struct + hole_start, 0,
+             ((start >> PAGE_2M_SHIFT) - hole_start) * sizeof(struct page));
+    hole_start = end >> PAGE_2M_SHIFT;
+
+    /* page init，只初始化第一段 */
+    zone_init_pages(z, DEFERRED_INIT_PAGES);
   }
+  if(memory_management_struct.pages_size > hole_start)
+    memset(memory_management_struct.pages_struct + hole_start, 0,
+           (memory_management_struct.pages_size - hole_start) * sizeof(struct page));
 }
 
 unsigned long page_init(struct page *page, unsigned long flags) {
@@ -124,8 +171,7 @@ unsigned long page_init(struct page *page, unsigned long flags) {
      * 页面属性为空，则占用该页面
      */
     /* 置位 bitmap 对应的 bit 位 */
-    *(memory_management_struct.bits_map + ((page->PHY_address >> PAGE_2M_SHIFT) >> 6)) |=
-        1UL << (page->PHY_address >> PAGE_2M_SHIFT) % 64;
+    page_bitmap_set(page);
     page->attribute = flags;                /* 设置页面属性 */
     page->reference_count++;                /* 该页面引用计数增加 */
     page->zone_struct->page_using_count++;  /* 增加 zone 已使用页面数量 */
@@ -142,8 +188,351 @@ unsigned long page_init(struct page *page, unsigned long flags) {
     page->reference_count++;                /* 增加页面引用计数 */
     page->zone_struct->total_pages_link++;  /* 增加本区域内的页面引用计数 */
   } else {  // TODO
-    *(memory_management_struct.bits_map + ((page->PHY_address >> PAGE_2M_SHIFT) >> 6)) |=
-        1UL << (page->PHY_address >> PAGE_2M_SHIFT) % 64;
+    page_bitmap_set(page);
+  }
+  return 1;
+}
+
+/**
+ * @brief page_init 的逆操作，减少页面的引用计数
+ * 引用计数归零之后页面重新变为空闲页，复位 bitmap 并更新 zone 的统计信息，
+ * 之后由调用者负责把页面归还给伙伴系统
+ */
+unsigned long page_clean(struct page *page) {
+  if(!page->reference_count)
+    return 0;
+  page->reference_count--;
+  page->zone_struct->total_pages_link--;
+  if(!page->reference_count) {
+    page_bitmap_clean(page);
+    page->attribute = 0;
+    page->zone_struct->page_using_count--;
+    page->zone_struct->page_free_count++;
+  }
+  return 1;
+}
+
+/* 计算容纳 number 个页面所需的最小阶数 */
+static inline unsigned long get_order(unsigned long number) {
+  unsigned long order = 0;
+  while((1UL << order) < number)
+    ++order;
+  return order;
+}
+
+/**
+ * @brief 将 page 开始的 2^order 个页面作为一个空闲块放回 zone 的伙伴系统
+ * 块在 zone 内的下标为 idx，它的伙伴块下标为 idx ^ (1 << order)，
+ * 如果伙伴块同样是同阶的空闲块就合并成高一阶的块，直到无法合并或者到达最高阶
+ */
+static void buddy_free_block(struct zone *z, struct page *page, unsigned long order) {
+  unsigned long idx = page - z->pages_group;
+
+  while(order < MAX_ORDER - 1) {
+    unsigned long buddy_idx = idx ^ (1UL << order);
+    struct page *buddy = z->pages_group + buddy_idx;
+    /**
+     * 伙伴块越过了已经初始化的 page 结构体，或者不是同阶的空闲块；
+     * 未初始化的 page 内容不确定，不能读取，它们在延迟初始化放回伙伴系统时再与这里合并
+     */
+    if(buddy_idx + (1UL << order) > z->pages_initialized || buddy->buddy_order != order)
+      break;
+    list_del(&buddy->list);
+    buddy->buddy_order = -1;
+    z->free_area[order].nr_free--;
+    idx &= ~(1UL << order);   /* 合并后的块从两者中较小的下标开始 */
+    ++order;
+  }
+  page = z->pages_group + idx;
+  page->buddy_order = order;
+  list_add_to_behind(&z->free_area[order].free_list, &page->list);
+  z->free_area[order].nr_free++;
+}
+
+/**
+ * @brief 将 page 开始的 number 个连续页面放回伙伴系统
+ * 区间会被拆分成若干个按照自身大小对齐的 2^k 页面块，再逐个放回
+ */
+static void buddy_free_range(struct zone *z, struct page *page, unsigned long number) {
+  unsigned long idx = page - z->pages_group;
+
+  while(number) {
+    unsigned long order = 0;
+    /* 选取从 idx 开始、按自身大小对齐、且不超过剩余长度的最大块 */
+    while(order < MAX_ORDER - 1 && !(idx & (1UL << order)) && (2UL << order) <= number)
+      ++order;
+    buddy_free_block(z, z->pages_group + idx, order);
+    idx += 1UL << order;
+    number -= 1UL << order;
+  }
+}
+
+/**
+ * @brief 从 zone 的伙伴系统中取出一个 2^order 页的空闲块
+ * 从 order 阶开始向上查找第一个非空的链表，
+ * 如果找到的块比需要的大，就把它不断对半拆分，高地址的一半放回低一阶的链表
+ */
+static struct page *buddy_alloc(struct zone *z, unsigned long order) {
+  unsigned long cur;
+  struct page *page;
+
+  for(cur = order; cur < MAX_ORDER; ++cur)
+    if(!list_is_empty(&z->free_area[cur].free_list))
+      break;
+  if(cur == MAX_ORDER)
+    return NULL;
+
+  page = container_of(list_next(&z->free_area[cur].free_list), struct page, list);
+  list_del(&page->list);
+  page->buddy_order = -1;
+  z->free_area[cur].nr_free--;
+
+  while(cur > order) {
+    struct page *buddy;
+    --cur;
+    buddy = page + (1UL << cur);
+    buddy->buddy_order = cur;
+    list_add_to_behind(&z->free_area[cur].free_list, &buddy->list);
+    z->free_area[cur].nr_free++;
+  }
+  return page;
+}
+
+/**
+ * @brief 延迟初始化 zone 中下一段 page，并把它们交给伙伴系统
+ */
+static unsigned long zone_deferred_init(struct zone *z, unsigned long nr) {
+  unsigned long start = z->pages_initialized;
+  unsigned long n = zone_init_pages(z, nr);
+  if(n)
+    buddy_free_range(z, z->pages_group + start, n);
+  return n;
+}
+
+/* 从 zone 的伙伴系统中分配，空闲块不足时先补充初始化剩余的 page */
+static struct page *zone_buddy_alloc(struct zone *z, unsigned long order) {
+  struct page *page = buddy_alloc(z, order);
+  while(page == NULL && z->pages_initialized < z->pages_length) {
+    zone_deferred_init(z, DEFERRED_INIT_PAGES);
+    page = buddy_alloc(z, order);
+  }
+  return page;
+}
+
+/**
+ * @brief 完成所有 zone 剩余 page 的初始化
+ * 在启动完成之后由 init 进程调用，不占用启动关键路径的时间
+ */
+void deferred_memory_init() {
+  unsigned long total = 0;
+  for(int i = 0; i < memory_management_struct.zones_size; ++i) {
+    struct zone *z = memory_management_struct.zones_struct + i;
+    while(z->pages_initialized < z->pages_length) {
+      unsigned long flags;
+      spin_lock_irqsave(&memory_management_struct.lock, flags);
+      total += zone_deferred_init(z, DEFERRED_INIT_PAGES);
+      spin_unlock_irqrestore(&memory_management_struct.lock, flags);
+    }
+  }
+  color_printk(ORANGE, BLACK, "deferred memory init: %ld pages\n", total);
+}
+
+static void pcp_init() {
+  for(int i = 0; i < NR_CPUS; ++i) {
+    struct per_cpu_pages *pcp = memory_management_struct.frame_pcp + i;
+    list_init(&pcp->list);
+    pcp->count = 0;
+    pcp->high = PCP_HIGH;
+    pcp->batch = PCP_BATCH;
+    pcp->hit = pcp->miss = pcp->drain = 0;
+    pcp->flushed = 0;
+  }
+}
+
+static struct frame_pool *frame_pool_create();
+static void frame_pool_put(struct frame_pool *pool);
+static void __free_pages_4k(struct page *page, int number);
+
+/**
+ * @brief 从 4K 页池中一次取出 batch 个单页补充到 CPU 缓存
+ * 依次使用已有的页池，一个页也没有取到时才创建新的页池；
+ * 这些页面在页池看来已经被占用，所以在这里统一更新页池的统计信息
+ * 调用者需要持有 memory_management_struct.lock
+ */
+static void pcp_refill(struct per_cpu_pages *pcp) {
+  struct List *l = list_next(&memory_management_struct.frame_pools);
+  struct frame_pool *pool;
+  struct page *page;
+
+  while(pcp->count < pcp->batch) {
+    if(l == &memory_management_struct.frame_pools) {
+      if(pcp->count)
+        break;
+      pool = frame_pool_create();
+      if(pool == NULL)
+        break;
+      l = &pool->list;
+    }
+    pool = container_of(l, struct frame_pool, list);
+    page = buddy_alloc(&pool->zone, 0);
+    if(page == NULL) {
+      l = list_next(l);
+      continue;
+    }
+    pool->zone.page_using_count++;
+    pool->zone.page_free_count--;
+    pool->zone.total_pages_link++;
+    list_add_to_before(&pcp->list, &page->list);
+    pcp->count++;
+  }
+}
+
+/**
+ * 从 CPU 缓存的尾部取出最多 nr 个冷页归还各自的页池，变为完全空闲的页池随之释放
+ * 调用者需要持有 memory_management_struct.lock
+ */
+static void pcp_drain(struct per_cpu_pages *pcp, unsigned long nr) {
+  for(unsigned long i = 0; i < nr && pcp->count; ++i) {
+    struct page *page = container_of(list_prev(&pcp->list), struct page, list);
+    struct zone *z = page->zone_struct;
+    list_del(&page->list);
+    pcp->count--;
+    z->page_using_count--;
+    z->page_free_count++;
+    z->total_pages_link--;
+    buddy_free_block(z, page, 0);
+    frame_pool_put(container_of(z, struct frame_pool, zone));
+  }
+  pcp->drain++;
+}
+
+/**
+ * @brief 4K 单页分配的快速路径，只访问当前 CPU 的缓存
+ * 缓存只由所属的 CPU 访问，关闭本 CPU 的中断就足以保护它，命中时不需要获取全局锁；
+ * 缓存为空时才获取 memory_management_struct.lock，从页池批量补充
+ */
+static struct page *pcp_alloc(unsigned long page_flags) {
+  struct per_cpu_pages *pcp;
+  struct page *page = NULL;
+  unsigned long flags;
+
+  local_irq_save(flags);
+  pcp = memory_management_struct.frame_pcp + smp_processor_id();
+  if(!pcp->count) {
+    pcp->miss++;
+    spin_lock(&memory_management_struct.lock);
+    pcp_refill(pcp);
+    spin_unlock(&memory_management_struct.lock);
+  } else {
+    pcp->hit++;
+  }
+  if(pcp->count) {
+    page = container_of(list_next(&pcp->list), struct page, list);   /* 优先使用热页 */
+    list_del(&page->list);
+    pcp->count--;
+  }
+  local_irq_restore(flags);
+
+  if(page != NULL) {
+    page->attribute = page_flags;
+    page->reference_count = 1;
+  }
+  return page;
+}
+
+/**
+ * @brief 4K 单页释放的快速路径，页面放回当前 CPU 的缓存
+ * 与 pcp_alloc 相同，只有缓存超过 high、需要归还页池时才获取全局锁
+ * 
+ * @param cold 为 0 时作为热页放在链表头部，否则作为冷页放在尾部
+ */
+static void pcp_free(struct page *page, int cold) {
+  struct per_cpu_pages *pcp;
+  unsigned long flags;
+
+  page->attribute = 0;
+  page->reference_count = 0;
+  local_irq_save(flags);
+  pcp = memory_management_struct.frame_pcp + smp_processor_id();
+  if(cold)
+    list_add_to_before(&pcp->list, &page->list);
+  else
+    list_add_to_behind(&pcp->list, &page->list);
+  pcp->count++;
+  if(pcp->count > pcp->high) {
+    spin_lock(&memory_management_struct.lock);
+    pcp_drain(pcp, pcp->batch);
+    spin_unlock(&memory_management_struct.lock);
+  }
+  local_irq_restore(flags);
+}
+
+/* 把当前 CPU 缓存的 4K 页全部归还页池，也由 IPI_PCP_DRAIN_VECTOR 的处理函数调用 */
+void drain_local_pages() {
+  struct per_cpu_pages *pcp;
+  unsigned long flags;
+
+  spin_lock_irqsave(&memory_management_struct.lock, flags);
+  pcp = memory_management_struct.frame_pcp + smp_processor_id();
+  pcp_drain(pcp, pcp->count);
+  pcp->flushed++;
+  spin_unlock_irqrestore(&memory_management_struct.lock, flags);
+}
+
+/**
+ * @brief 清空所有 CPU 的 4K 单页缓存，在连续页面分配失败、重试之前调用
+ * 缓存只能由所属的 CPU 访问，其他 CPU 通过 IPI 通知它们自己清空；
+ * 调用者开着中断时等待所有 CPU 完成，关着中断时对方可能正在等待本 CPU，只发送通知不等待
+ * 调用时不能持有 memory_management_struct.lock
+ */
+static void drain_all_pages() {
+  unsigned long flushed[NR_CPUS], rflags;
+  unsigned int self = smp_processor_id();
+
+  drain_local_pages();
+  if(smp_num_cpus <= 1)
+    return;
+  for(int i = 0; i < NR_CPUS; ++i)
+    flushed[i] = memory_management_struct.frame_pcp[i].flushed;
+  apic_send_ipi(0, APIC_DEST_ALLBUT | APIC_INT_ASSERT | APIC_DM_FIXED | IPI_PCP_DRAIN_VECTOR);
+
+  __asm__ __volatile__("pushfq \n\t"
+                       "popq %0 \n\t"
+                       : "=r"(rflags));
+  if(!(rflags & (1UL << 9)))  /* RFLAGS.IF */
+    return;
+  for(int i = 0; i < NR_CPUS; ++i)
+    while(i != self && cpu_online(i) && memory_management_struct.frame_pcp[i].flushed == flushed[i])
+      __asm__ __volatile__("pause \n\t" ::: "memory");
+}
+
+/**
+ * @brief 初始化每个 zone 的伙伴系统
+ * 必须在内核与内存管理结构占用的页面初始化完成之后调用，
+ * 此时所有属性为 0 的页面都是空闲页，将这些连续的空闲页面放回伙伴系统
+ */
+static void buddy_init() {
+  pcp_init();
+  for(int i = 0; i < memory_management_struct.zones_size; ++i) {
+    struct zone *z = memory_management_struct.zones_struct + i;
+    unsigned long j = 0;
+
+    for(int k = 0; k < MAX_ORDER; ++k) {
+      list_init(&z->free_area[k].free_list);
+      z->free_area[k].nr_free = 0;
+    }
+
+    while(j < z->pages_initialized) {
+      unsigned long start;
+      if(z->pages_group[j].attribute) {
+        ++j;
+        continue;
+      }
+      start = j;
+      while(j < z->pages_initialized && !z->pages_group[j].attribute)
+        ++j;
+      buddy_free_range(z, z->pages_group + start, j - start);
+    }
   }
 }
 
@@ -189,8 +578,12 @@ static void management_page_init() {
    * 2. 设置 page 和 zone 结构属性
    */
   for(int j = 0; j < end_page_num; ++j) {
-    page_init(memory_management_struct.pages_struct + j,
-              PG_PTable_Maped | PG_Kernel_Init | PG_Active | PG_Kernel);
+    struct page *p = memory_management_struct.pages_struct + j;
+    struct zone *z = memory_management_struct.zones_struct;
+    /* 内核所在的 page 必须已经初始化，第一段不够覆盖时补充初始化 */
+    if(j && p >= z->pages_group && p - z->pages_group >= z->pages_initialized)
+      zone_init_pages(z, p - z->pages_group + 1 - z->pages_initialized);
+    page_init(p, PG_PTable_Maped | PG_Kernel_Init | PG_Active | PG_Kernel);
   }
 }
 
@@ -198,6 +591,8 @@ void init_memory() {
   int i, j;
   unsigned long TotalMem = 0;
   struct E820 *p = 0;
+
+  spin_init(&memory_management_struct.lock);
   color_printk(BLUE, BLACK,
                "Display Physics Address MAP, Type(1:RAM, 2:ROM or Reserved, "
                "3:ACPI Reclaim "
@@ -262,6 +657,7 @@ void init_memory() {
   memory_management_struct.pages_struct->attribute = 0;
   memory_management_struct.pages_struct->reference_count = 0;
   memory_management_struct.pages_struct->age = 0;
+  memory_management_struct.pages_struct->buddy_order = -1;
   /* 计算 zones[] 占用的字节大小 */
   memory_management_struct.zones_length = (memory_management_struct.zones_size * sizeof(struct zone) + sizeof(long) - 1) & (~(sizeof(long) - 1));
 
@@ -277,6 +673,12 @@ void init_memory() {
   /* 初始化内存管理结构所占的物理页的 page 结构体 */
   management_page_init();
 
+  /* 将剩余的空闲页面交给各个 zone 的伙伴系统管理 */
+  buddy_init();
+  /* 4K 页池在第一次分配 4K 页的时候才会创建 */
+  list_init(&memory_management_struct.frame_pools);
+  memory_management_struct.frame_pools_count = 0;
+
   /* 清空用于一致性映射的页表项，用于线性地址 0 开始的地址映射的页表项 */
   Global_CR3 = get_gdt();
   color_printk(INDIGO, BLACK, "Global_CR3\t: %#018lx\n", Global_CR3);   /* 打印 PML4E 首地址 */
@@ -288,19 +690,23 @@ void init_memory() {
   //   *(phy_to_virt(Global_CR3) + i) = 0UL;
   // }
   flush_tlb();
+
+  /* 建立所有物理内存的直接映射 */
+  pagetable_init();
 }
 
 /**
- * @brief 分页物理页，一次最多分配 64 页
+ * @brief 分配连续的物理页，一次最多分配 2^(MAX_ORDER - 1) 页
+ * 从伙伴系统中取出能容纳 number 个页面的最小块，多出来的尾部页面立即归还伙伴系统
  * 
  * @param zone_select 从 DMA, NORMAL 等区域选择 ZONE
- * @param number number <= 64
+ * @param number number <= 2^(MAX_ORDER - 1)
  * @param page_flags struct page 属性
  * @return struct page* 
  */
-struct page *alloc_pages(int zone_select, int number, unsigned long page_flags) {
-  unsigned long page = 0;
+static struct page *__alloc_pages(int zone_select, int number, unsigned long page_flags) {
   int zone_start = 0, zone_end = 0;
+  unsigned long order;
   /* 选择 ZONE 区域 */
   switch (zone_select) {
   case ZONE_DMA:
@@ -320,54 +726,291 @@ struct page *alloc_pages(int zone_select, int number, unsigned long page_flags)
     return NULL;
     break;
   }
+  if(number <= 0 || number > (1 << (MAX_ORDER - 1))) {
+    color_printk(RED, BLACK, "alloc_pages error number: %d\n", number);
+    return NULL;
+  }
+  order = get_order(number);
+
   for(int i = zone_start; i <= zone_end; ++i) {
-    struct zone *z;
-    unsigned long start, end, length;
-    unsigned long tmp;
+    struct zone *z = memory_management_struct.zones_struct + i;
+    struct page *page;
     /* 区域中没有足够的页面 */
-    if((memory_management_struct.zones_struct + i)->page_free_count < number)
+    if(z->page_free_count < number)
+      continue;
+    page = zone_buddy_alloc(z, order);
+    if(page == NULL)
       continue;
-    z = memory_management_struct.zones_struct + i;
-    start = z->zone_start_address >> PAGE_2M_SHIFT;
-    end = z->zone_end_address >> PAGE_2M_SHIFT;
-    length = z->zone_length >> PAGE_2M_SHIFT;
+    /* 块的大小是 2 的幂，归还多余的尾部页面 */
+    if((1UL << order) > number)
+      buddy_free_range(z, page + number, (1UL << order) - number);
+    for(unsigned long l = 0; l < number; ++l)   /* 占用这些物理页面 */
+      page_init(page + l, page_flags);
+    /* 返回连续页面的第一页 struct page 结构 */
+    return page;
+  }
+  return NULL;
+}
 
-    /**
-     * 为了按照 unsigned long 对齐，起始页开始的位图只能检索 tmp = 64 - start % 64 次
-     * 通过 j += j % 64 ? tmp : 64，可以将后续的步进过程按照 unsigned long 对齐
-     */
-    tmp = 64 - start % 64;
-    for(unsigned long j = start; j <= end; j += j % 64 ? tmp : 64) {
-      /* 确定一开始在 bitmap 的第几个 unsigned long */
-      unsigned long *p = memory_management_struct.bits_map + (j >> 6);
-      /* 确定此次 unsigned long 步长的起始偏移 */
-      unsigned long shift = j % 64;
-
-      /**
-       * k < 64 - shift 确定这次搜索的区间长度，除了第一次其余都是 64
-       * tmp = (*p >> k) | (*(p + 1) << (64 - k)) 表示将下一个 64bit 与当前 64bit 去掉前面 0~k-1 bit 之后的结果进行拼接
-       * tmp & (number == 64 ? 0xffffffffffffffffUL : ((1UL << number) - 1)) 表示需要 number 个连续的 page 就保留 tmp 拼接结果的 number bit
-       * 最后 ! 判断上述结果位图中是不是全是 0，只有全是 0 才是可以分配的连续页
-       * 
-       * 补充：
-       * 1. 关于 &() 括号中的部分为什么不直接使用 (1UL << number) - 1，是由于对于 64bit 寄存器来说 SHL 指令的左移范围是 0~63
-       * 2. 关于为什么需要拼接，是因为可能某一个 unsigned long 已经被占用了几个 bit 了，这样的话就需要下一个 unsigned long 来扩充
-       */
-      for(unsigned long k = shift; k < 64 - shift; ++k) {
-        if(!(((*p >> k) | (*(p + 1) << (64 - k))) & (number == 64 ? 0xffffffffffffffffUL : ((1UL << number) - 1)))) {
-          page = j + k - 1;   /* 获取连续页的起始页号 */
-          for(unsigned long l = 0; l < number; ++l) {   /* 占用这些物理页面 */
-            struct page *x = memory_management_struct.pages_struct + page + l;
-            page_init(x, page_flags);
-          }
-          goto find_free_pages;
-        }
-      }
+/**
+ * @brief 释放 alloc_pages 分配的连续物理页
+ * 每个页面的引用计数减一，引用计数归零的连续页面归还伙伴系统并与伙伴块合并
+ * 
+ * @param page 连续页面的第一页
+ * @param number 页面数量
+ */
+static void __free_pages(struct page *page, int number) {
+  struct zone *z;
+  int i = 0, start = -1;
+
+  if(page == NULL || number <= 0) {
+    color_printk(RED, BLACK, "free_pages error page or number\n");
+    return;
+  }
+  z = page->zone_struct;
+  /**
+   * 仍被共享引用的页面不能释放，只归还那些在本次调用中引用计数归零的连续页面；
+   * 引用计数已经为 0 的页面是重复释放，它们已经在伙伴系统或者 CPU 缓存中，跳过并报错
+   */
+  for(i = 0; i <= number; ++i) {
+    int freed = 0;
+    if(i < number) {
+      if(!(page + i)->reference_count)
+        color_printk(RED, BLACK, "free_pages error: page %#018lx is already free\n",
+                     (page + i)->PHY_address);
+      else
+        freed = page_clean(page + i) && !(page + i)->reference_count;
+    }
+    if(freed && start < 0) {
+      start = i;
+    } else if(!freed && start >= 0) {
+      buddy_free_range(z, page + start, i - start);
+      start = -1;
     }
   }
-  return NULL;
+}
+
+/**
+ * 伙伴系统由所有 CPU 共享，2M 页的分配和释放都在 memory_management_struct.lock 保护下进行
+ * 分配失败时先清空所有 CPU 的 4K 单页缓存再重试一次，缓存中的页面归还之后页池可能变为空闲并释放
+ */
+struct page *alloc_pages(int zone_select, int number, unsigned long page_flags) {
+  struct page *page;
+  unsigned long flags;
+  spin_lock_irqsave(&memory_management_struct.lock, flags);
+  page = __alloc_pages(zone_select, number, page_flags);
+  spin_unlock_irqrestore(&memory_management_struct.lock, flags);
+  if(page == NULL) {
+    drain_all_pages();
+    spin_lock_irqsave(&memory_management_struct.lock, flags);
+    page = __alloc_pages(zone_select, number, page_flags);
+    spin_unlock_irqrestore(&memory_management_struct.lock, flags);
+  }
+  return page;
+}
+
+void free_pages(struct page *page, int number) {
+  unsigned long flags;
+  spin_lock_irqsave(&memory_management_struct.lock, flags);
+  __free_pages(page, number);
+  spin_unlock_irqrestore(&memory_management_struct.lock, flags);
+}
+
+/**
+ * @brief 释放一个预计不会很快再被访问的 4K 单页
+ * 页面作为冷页放在 CPU 缓存的尾部，会优先被归还给页池；2M 页没有缓存，直接释放
+ */
+void free_cold_page(struct page *page) {
+  unsigned long flags;
+  if((page->zone_struct->attribute & ZONE_4K_FRAME) && page->reference_count == 1) {
+    pcp_free(page, 1);
+    return;
+  }
+  spin_lock_irqsave(&memory_management_struct.lock, flags);
+  if(page->zone_struct->attribute & ZONE_4K_FRAME)
+    __free_pages_4k(page, 1);
+  else
+    __free_pages(page, 1);
+  spin_unlock_irqrestore(&memory_management_struct.lock, flags);
+}
+
+/* 打印每个 CPU 的 4K 单页缓存命中统计，用于调整 PCP_BATCH */
+void pcp_stat_print() {
+  for(int i = 0; i < NR_CPUS; ++i) {
+    struct per_cpu_pages *pcp = memory_management_struct.frame_pcp + i;
+    if(!pcp->hit && !pcp->miss)
+      continue;
+    color_printk(ORANGE, BLACK, "cpu%d count: %ld, batch: %ld, high: %ld, hit: %ld, miss: %ld, drain: %ld\n",
+                 i, pcp->count, pcp->batch, pcp->high, pcp->hit, pcp->miss, pcp->drain);
+  }
+}
+
+/**
+ * @brief 从 2M 伙伴系统中申请一个物理页，并将其初始化为 4K 页池
+ * 页池头部（zone 与 4K page 数组）占用的 4K 页直接标记为已使用，其余页面交给页池的伙伴系统
+ */
+static struct frame_pool *frame_pool_create() {
+  struct frame_pool *pool;
+  struct zone *z;
+  struct page *p = __alloc_pages(ZONE_NORMAL, 1, PG_PTable_Maped | PG_Kernel | PG_Active | PG_Frame_Pool);
+  if(p == NULL)
+    return NULL;
+
+  pool = (struct frame_pool *)phy_to_virt(p->PHY_address);
+  pool->page_2m = p;
+  z = &pool->zone;
+  memset(z, 0, sizeof(*z));
+  z->pages_group = pool->pages;
+  z->pages_length = FRAME_POOL_PAGES;
+  z->zone_start_address = p->PHY_address;
+  z->zone_end_address = p->PHY_address + PAGE_2M_SIZE;
+  z->zone_length = PAGE_2M_SIZE;
+  z->attribute = ZONE_4K_FRAME;
+  z->GMD_struct = &memory_management_struct;
+  z->page_free_count = FRAME_POOL_PAGES;
+  z->pages_initialized = FRAME_POOL_PAGES;
+  for(int k = 0; k < MAX_ORDER; ++k)
+    list_init(&z->free_area[k].free_list);
+
+  for(unsigned long j = 0; j < FRAME_POOL_PAGES; ++j) {
+    struct page *x = pool->pages + j;
+    x->zone_struct = z;
+    x->PHY_address = p->PHY_address + PAGE_4K_SIZE * j;
+    x->attribute = 0;
+    x->reference_count = 0;
+    x->age = 0;
+    x->buddy_order = -1;
+  }
+  /* 页池头部所在的页面 */
+  for(unsigned long j = 0; j < FRAME_POOL_RESERVED; ++j)
+    page_init(pool->pages + j, PG_PTable_Maped | PG_Kernel_Init | PG_Active | PG_Kernel);
+  buddy_free_range(z, pool->pages + FRAME_POOL_RESERVED, FRAME_POOL_PAGES - FRAME_POOL_RESERVED);
+
+  list_add_to_before(&memory_management_struct.frame_pools, &pool->list);
+  memory_management_struct.frame_pools_count++;
+  return pool;
+}
+
+/**
+ * @brief 分配连续的多个 4K 物理页，调用者需要持有 memory_management_struct.lock
+ * 依次在已有的页池中查找，都不满足时再从 2M 伙伴系统申请一个新的页池；
+ * 页池的 2M 基地址对齐，因此返回的块按照 2^order 个 4K 页对齐
+ * 
+ * @param number 页面数量，大于 1，不能超过页池中除头部以外的最大块
+ * @param page_flags struct page 属性
+ * @return struct page* 第一个 4K 页的 struct page
+ */
+static struct page *__alloc_pages_4k(int number, unsigned long page_flags) {
+  struct List *l;
+  struct frame_pool *pool;
+  struct page *page = NULL;
+  unsigned long order;
+
+  order = get_order(number);
+
+  for(l = list_next(&memory_management_struct.frame_pools); l != &memory_management_struct.frame_pools; l = list_next(l)) {
+    pool = container_of(l, struct frame_pool, list);
+    if(pool->zone.page_free_count < number)
+      continue;
+    page = buddy_alloc(&pool->zone, order);
+    if(page != NULL)
+      goto find_free_pages;
+  }
+
+  pool = frame_pool_create();
+  if(pool == NULL)
+    return NULL;
+  page = buddy_alloc(&pool->zone, order);
 
 find_free_pages:
-  /* 返回连续页面的第一页 struct page 结构 */
-  return (struct page *)(memory_management_struct.pages_struct + page);
-}
\ No newline at end of file
+  if((1UL << order) > number)
+    buddy_free_range(&pool->zone, page + number, (1UL << order) - number);
+  for(unsigned long j = 0; j < number; ++j)
+    page_init(page + j, page_flags);
+  return page;
+}
+
+/* 页池变为完全空闲，并且它不是唯一的页池时，把承载它的 2M 页归还 */
+static void frame_pool_put(struct frame_pool *pool) {
+  if(pool->zone.page_using_count == FRAME_POOL_RESERVED && memory_management_struct.frame_pools_count > 1) {
+    list_del(&pool->list);
+    memory_management_struct.frame_pools_count--;
+    __free_pages(pool->page_2m, 1);
+  }
+}
+
+/**
+ * @brief 将 4K 物理页归还页池，页池因此变为完全空闲时随之释放
+ * 调用者需要持有 memory_management_struct.lock
+ */
+static void __free_pages_4k(struct page *page, int number) {
+  __free_pages(page, number);
+  frame_pool_put(container_of(page->zone_struct, struct frame_pool, zone));
+}
+
+static struct page *try_alloc_pages_4k(int number, unsigned long page_flags) {
+  struct page *page;
+  unsigned long flags;
+
+  if(number == 1)
+    return pcp_alloc(page_flags);
+  spin_lock_irqsave(&memory_management_struct.lock, flags);
+  page = __alloc_pages_4k(number, page_flags);
+  spin_unlock_irqrestore(&memory_management_struct.lock, flags);
+  return page;
+}
+
+/**
+ * @brief 分配连续的 4K 物理页
+ * 单页分配走 CPU 缓存，不获取全局锁；多页分配在 memory_management_struct.lock 保护下访问页池
+ * 与 alloc_pages 相同，失败时清空所有 CPU 的单页缓存之后重试一次
+ *
+ * @param number 页面数量，不能超过页池中除头部以外的最大块
+ * @param page_flags struct page 属性
+ * @return struct page* 第一个 4K 页的 struct page
+ */
+struct page *alloc_pages_4k(int number, unsigned long page_flags) {
+  struct page *page;
+
+  if(number <= 0 || number > FRAME_POOL_PAGES / 2) {
+    color_printk(RED, BLACK, "alloc_pages_4k error number: %d\n", number);
+    return NULL;
+  }
+  page = try_alloc_pages_4k(number, page_flags);
+  if(page == NULL) {
+    drain_all_pages();
+    page = try_alloc_pages_4k(number, page_flags);
+  }
+  return page;
+}
+
+/* 只被引用一次的单页放回 CPU 缓存，不获取全局锁；其他情况在锁的保护下归还页池 */
+void free_pages_4k(struct page *page, int number) {
+  unsigned long flags;
+
+  if(page == NULL || !(page->zone_struct->attribute & ZONE_4K_FRAME)) {
+    color_printk(RED, BLACK, "free_pages_4k error page\n");
+    return;
+  }
+  if(number == 1 && page->reference_count == 1) {
+    pcp_free(page, 0);
+    return;
+  }
+  spin_lock_irqsave(&memory_management_struct.lock, flags);
+  __free_pages_4k(page, number);
+  spin_unlock_irqrestore(&memory_management_struct.lock, flags);
+}
+
+/**
+ * @brief 根据物理地址获取所在 4K 页的 struct page
+ * 物理地址所在的 2M 页必须是一个 4K 页池，否则返回 NULL
+ */
+struct page *phy_to_4k_page(unsigned long addr) {
+  struct page *p = memory_management_struct.pages_struct + (addr >> PAGE_2M_SHIFT);
+  struct frame_pool *pool;
+
+  if(!(p->attribute & PG_Frame_Pool))
+    return NULL;
+  pool = (struct frame_pool *)phy_to_virt(addr & PAGE_2M_MASK);
+  return pool->pages + ((addr & (PAGE_2M_SIZE - 1)) >> PAGE_4K_SHIFT);
+}
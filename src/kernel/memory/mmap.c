@@ -0,0 +1,285 @@
+#include "task.h"
+#include "lib.h"
+#include "mem.h"
+#include "printk.h"
+#include "slab.h"
+
+/* 虚拟内存区域中页面的页表项属性 */
+static inline unsigned long vma_prot(struct vm_area_struct *vma) {
+  return PAGE_U_S | PAGE_Present | ((vma->vm_flags & VM_WRITE) ? PAGE_R_W : 0);
+}
+
+/* 查找包含线性地址 addr 的虚拟内存区域，没有则返回 NULL，调用者需要持有 mm->page_table_lock */
+struct vm_area_struct *find_vma(struct mm_struct *mm, unsigned long addr) {
+  struct List *l;
+  for(l = list_next(&mm->mmap); l != &mm->mmap; l = list_next(l)) {
+    struct vm_area_struct *vma = container_of(l, struct vm_area_struct, list);
+    if(addr < vma->vm_start)
+      break;
+    if(addr < vma->vm_end)
+      return vma;
+  }
+  return NULL;
+}
+
+/**
+ * @brief 向地址空间中添加虚拟内存区域 [start, end)，边界按照 4K 对齐
+ * 这里只记录区域，页面在第一次访问的时候由 handle_mm_fault 分配
+ * 地址空间已经被其他线程使用时，调用者需要持有 mm->page_table_lock
+ *
+ * @return struct vm_area_struct* 与已有区域重叠或者内存不足时返回 NULL
+ */
+struct vm_area_struct *insert_vma(struct mm_struct *mm, unsigned long start, unsigned long end,
+                                  unsigned long flags) {
+  struct vm_area_struct *vma;
+  struct List *l;
+
+  start &= PAGE_4K_MASK;
+  end = PAGE_4K_ALIGN(end);
+  if(start >= end || end > TASK_SIZE) {
+    color_printk(RED, BLACK, "insert_vma() ERROR: %#018lx ~ %#018lx\n", start, end);
+    return NULL;
+  }
+
+  /* 找到第一个位于新区域之后的区域，新区域插在它前面 */
+  for(l = list_next(&mm->mmap); l != &mm->mmap; l = list_next(l)) {
+    vma = container_of(l, struct vm_area_struct, list);
+    if(vma->vm_start >= end)
+      break;
+    if(vma->vm_end > start) {
+      color_printk(RED, BLACK, "insert_vma() ERROR: %#018lx ~ %#018lx overlaps\n", start, end);
+      return NULL;
+    }
+  }
+
+  vma = (struct vm_area_struct *)kmalloc(sizeof(struct vm_area_struct));
+  if(vma == NULL)
+    return NULL;
+  list_init(&vma->list);
+  vma->vm_start = start;
+  vma->vm_end = end;
+  vma->vm_flags = flags;
+  vma->vm_mm = mm;
+  list_add_to_before(l, &vma->list);
+  return vma;
+}
+
+/**
+ * @brief 处理应用层地址的缺页异常，调用者持有 mm->page_table_lock
+ * 1. 页面不存在：在合法的虚拟内存区域中分配一个清零的 4K 页并建立映射
+ * 2. 写入只读页面：页面带有 PG_K_Share_To_U 属性时执行写时复制，
+ *    仍被其他地址空间引用则复制一份私有页面，否则直接恢复页面的写权限
+ * 等待锁的期间其他线程可能已经处理了同一个地址，此时页表项已经满足要求，直接返回
+ *
+ * @param error_code 缺页异常的错误码
+ * @return int 成功处理返回 0，非法访问返回 -1
+ */
+static int __handle_mm_fault(struct mm_struct *mm, unsigned long address, unsigned long error_code) {
+  struct vm_area_struct *vma = find_vma(mm, address);
+  unsigned long *pgd = (unsigned long *)mm->pgd;
+  unsigned long *pte, size;
+  struct page *page, *new_page;
+  int only;
+
+  if(vma == NULL)
+    return -1;
+  if((error_code & PF_WRITE) && !(vma->vm_flags & VM_WRITE))
+    return -1;
+  address &= PAGE_4K_MASK;
+  pte = get_pte(pgd, address, &size);
+
+  if(!(error_code & PF_PROTECTION)) {
+    if(pte != NULL)
+      return 0;
+    page = alloc_pages_4k(1, PG_PTable_Maped | PG_Active);
+    if(page == NULL)
+      return -1;
+    memset(phy_to_virt(page->PHY_address), 0, PAGE_4K_SIZE);
+    if(map_pages(pgd, address, page->PHY_address, PAGE_4K_SIZE, vma_prot(vma))) {
+      free_pages_4k(page, 1);
+      return -1;
+    }
+    return 0;
+  }
+
+  if(!(error_code & PF_WRITE))
+    return -1;
+  if(pte == NULL || size != PAGE_4K_SIZE)
+    return -1;
+  if(*pte & PAGE_R_W)
+    return 0;
+  page = phy_to_4k_page(*pte & PAGE_ADDR_MASK);
+  if(page == NULL)
+    return -1;
+
+  /**
+   * 页面的引用计数和属性被共享它的所有地址空间修改，与 dup_mmap 和 free_pages_4k 一样
+   * 在 memory_management_struct.lock 的保护下读取和修改
+   */
+  spin_lock(&memory_management_struct.lock);
+  if(!(page->attribute & PG_K_Share_To_U)) {
+    spin_unlock(&memory_management_struct.lock);
+    return -1;
+  }
+  only = page->reference_count == 1;
+  if(only) {  /* 其他地址空间都已经释放了这个页面 */
+    page->attribute &= ~PG_K_Share_To_U;
+    *pte |= PAGE_R_W;
+  }
+  spin_unlock(&memory_management_struct.lock);
+
+  if(!only) {
+    new_page = alloc_pages_4k(1, PG_PTable_Maped | PG_Active);
+    if(new_page == NULL)
+      return -1;
+    memcpy(phy_to_virt(page->PHY_address), phy_to_virt(new_page->PHY_address), PAGE_4K_SIZE);
+    *pte = new_page->PHY_address | vma_prot(vma);
+    free_pages_4k(page, 1);   /* 只减少原页面的引用计数 */
+  }
+  flush_tlb_one(address);
+  return 0;
+}
+
+/* 同一个地址空间的缺页处理互斥进行，uaccess 也通过这里为内核访问建立映射 */
+int handle_mm_fault(struct mm_struct *mm, unsigned long address, unsigned long error_code) {
+  unsigned long flags;
+  int ret;
+
+  spin_lock_irqsave(&mm->page_table_lock, flags);
+  ret = __handle_mm_fault(mm, address, error_code);
+  spin_unlock_irqrestore(&mm->page_table_lock, flags);
+  return ret;
+}
+
+/**
+ * @brief 为新地址空间 mm 复制 oldmm 的虚拟内存区域
+ * 4K 页池中的页面不会被复制，而是在两个地址空间中都映射为只读并标记 PG_K_Share_To_U，
+ * 写入的时候再由 handle_mm_fault 复制，所以复制的开销只与页表规模有关
+ * 其他页面（例如 head.S 中的 2M 页）仍然按照原来的属性直接共享
+ * 带有 VM_DONTCOPY 的区域不会出现在子进程中
+ * 复制期间持有 oldmm->page_table_lock，与 oldmm 中其他线程的缺页处理互斥；mm 还没有被任何进程使用
+ *
+ * @return int 成功返回 0，失败返回 -1
+ */
+static int __dup_mmap(struct mm_struct *mm, struct mm_struct *oldmm) {
+  struct List *l;
+
+  for(l = list_next(&oldmm->mmap); l != &oldmm->mmap; l = list_next(l)) {
+    struct vm_area_struct *vma = container_of(l, struct vm_area_struct, list);
+    unsigned long addr, size;
+
+    if(vma->vm_flags & VM_DONTCOPY)
+      continue;
+    if(insert_vma(mm, vma->vm_start, vma->vm_end, vma->vm_flags) == NULL)
+      return -1;
+
+    for(addr = vma->vm_start; addr < vma->vm_end; addr += size) {
+      unsigned long *pte = get_pte((unsigned long *)oldmm->pgd, addr, &size);
+      unsigned long phys, prot;
+      struct page *page = NULL;
+
+      if(pte == NULL) {
+        size = PAGE_4K_SIZE;
+        continue;
+      }
+      addr &= ~(size - 1);
+      phys = *pte & PAGE_ADDR_MASK & ~(size - 1);
+      if(size == PAGE_4K_SIZE)
+        page = phy_to_4k_page(phys);
+      prot = *pte & ~(PAGE_ADDR_MASK | PAGE_PS);
+      if(page != NULL)
+        prot &= ~PAGE_R_W;
+      if(map_pages((unsigned long *)mm->pgd, addr, phys, size, prot))
+        return -1;
+      /* 映射成功之后才修改父进程的页面，失败时只需要撤销已经复制的页面 */
+      if(page != NULL) {
+        /* 引用计数也会被其他 CPU 上的 free_pages_4k 修改，中断已经在 dup_mmap 中关闭 */
+        spin_lock(&memory_management_struct.lock);
+        *pte &= ~PAGE_R_W;
+        page_init(page, PG_K_Share_To_U);
+        spin_unlock(&memory_management_struct.lock);
+      }
+    }
+    flush_tlb_range(vma->vm_start, vma->vm_end);
+  }
+  return 0;
+}
+
+/**
+ * @brief 撤销复制失败时对 mm 中页面的修改，调用者持有 mm->page_table_lock
+ * 子进程的映射已经由 exit_mmap 释放，不再被其他地址空间引用的共享页面恢复为私有页面，
+ * 可写区域中的页面恢复写权限，与 handle_mm_fault 中引用计数为 1 的处理相同
+ */
+static void unshare_mmap(struct mm_struct *mm) {
+  struct List *l;
+
+  for(l = list_next(&mm->mmap); l != &mm->mmap; l = list_next(l)) {
+    struct vm_area_struct *vma = container_of(l, struct vm_area_struct, list);
+    unsigned long addr, size;
+
+    for(addr = vma->vm_start; addr < vma->vm_end; addr += size) {
+      unsigned long *pte = get_pte((unsigned long *)mm->pgd, addr, &size);
+      struct page *page;
+
+      if(pte == NULL) {
+        size = PAGE_4K_SIZE;
+        continue;
+      }
+      addr &= ~(size - 1);
+      if(size != PAGE_4K_SIZE || (page = phy_to_4k_page(*pte & PAGE_ADDR_MASK)) == NULL)
+        continue;
+      spin_lock(&memory_management_struct.lock);
+      if((page->attribute & PG_K_Share_To_U) && page->reference_count == 1) {
+        page->attribute &= ~PG_K_Share_To_U;
+        *pte = (*pte & PAGE_ADDR_MASK) | vma_prot(vma);
+      }
+      spin_unlock(&memory_management_struct.lock);
+    }
+  }
+}
+
+/* 复制失败时释放 mm 中已经复制的区域和映射，mm 本身由调用者释放 */
+int dup_mmap(struct mm_struct *mm, struct mm_struct *oldmm) {
+  unsigned long flags;
+  int ret;
+
+  spin_lock_irqsave(&oldmm->page_table_lock, flags);
+  ret = __dup_mmap(mm, oldmm);
+  if(ret) {
+    exit_mmap(mm);
+    unshare_mmap(oldmm);
+  }
+  spin_unlock_irqrestore(&oldmm->page_table_lock, flags);
+  return ret;
+}
+
+/* 释放地址空间中的所有虚拟内存区域，并减少区域内页面的引用计数，调用时地址空间已经没有其他使用者 */
+void exit_mmap(struct mm_struct *mm) {
+  while(!list_is_empty(&mm->mmap)) {
+    struct vm_area_struct *vma = container_of(list_next(&mm->mmap), struct vm_area_struct, list);
+    unsigned long addr, size;
+
+    for(addr = vma->vm_start; addr < vma->vm_end; addr += size) {
+      unsigned long *pte = get_pte((unsigned long *)mm->pgd, addr, &size);
+      struct page *page;
+
+      if(pte == NULL) {
+        size = PAGE_4K_SIZE;
+        continue;
+      }
+      addr &= ~(size - 1);
+      if(size == PAGE_4K_SIZE && (page = phy_to_4k_page(*pte & PAGE_ADDR_MASK)) != NULL)
+        free_pages_4k(page, 1);
+    }
+    unmap_pages((unsigned long *)mm->pgd, vma->vm_start, vma->vm_end - vma->vm_start);
+    list_del(&vma->list);
+    kfree(vma);
+  }
+}
+
+/* 缺页异常处理函数的入口，只处理当前进程应用层地址的缺页 */
+int do_user_page_fault(unsigned long address, unsigned long error_code) {
+  if(address >= TASK_SIZE)
+    return -1;
+  return handle_mm_fault(current->mm, address, error_code);
+}
@@ -0,0 +1,371 @@
+#include "mem.h"
+#include "cpu.h"
+#include "lib.h"
+#include "printk.h"
+
+/* 处理器是否支持 1G 大页，CPUID.80000001H:EDX[26] */
+static int support_1g_page = 0;
+
+/* 是否启用了 PCID，CR4.PCIDE */
+int pcid_enabled = 0;
+
+/**
+ * 内核层直接映射的页表项属性
+ * 只允许内核访问，应用程序只能通过系统调用进入内核，不能经由直接映射区读写其他进程的页面和页表；
+ * 所有地址空间共享这些映射，设置为全局页，切换 CR3 时保留，invlpg 会在所有 PCID 中无效化它们
+ */
+#define DIRECT_MAP_PROT (PAGE_KERNEL_Page | PAGE_Global)
+
+/* 分配并清零一个 4K 页作为页表，返回页表的物理地址 */
+static unsigned long pgtable_alloc() {
+  struct page *p = alloc_pages_4k(1, PG_PTable_Maped | PG_Kernel | PG_Active);
+  if(p == NULL)
+    return 0;
+  memset(phy_to_virt(p->PHY_address), 0, PAGE_4K_SIZE);
+  return p->PHY_address;
+}
+
+/* 释放由 pgtable_alloc 分配的页表，head.S 中静态定义的页表不在 4K 页池中，不会被释放 */
+static void pgtable_free(unsigned long phys) {
+  struct page *p = phy_to_4k_page(phys);
+  if(p != NULL)
+    free_pages_4k(p, 1);
+}
+
+/* 递归释放 entry 指向的下一级页表，shift 是 entry 映射的地址范围位数 */
+static void pgtable_free_tree(unsigned long entry, int shift) {
+  unsigned long *table;
+  if(!(entry & PAGE_Present) || (entry & PAGE_PS) || shift == PAGE_4K_SHIFT)
+    return;
+  table = phy_to_virt(entry & PAGE_ADDR_MASK);
+  if(shift - 9 > PAGE_4K_SHIFT)
+    for(int i = 0; i < PTRS_PER_PAGE; ++i)
+      pgtable_free_tree(table[i], shift - 9);
+  pgtable_free(entry & PAGE_ADDR_MASK);
+}
+
+/**
+ * @brief 获取页表项 entry 指向的下一级页表
+ * 1. entry 为空时，alloc 不为 0 则分配一个新页表
+ * 2. entry 是一个大页时，把它拆分成 512 个下一级的页表项，拆分后的映射关系与属性保持不变
+ *
+ * @param entry 当前级别的页表项
+ * @param shift entry 映射的地址范围位数，PML4E 为 39，PDPTE 为 30，PDE 为 21
+ * @return unsigned long* 下一级页表的线性地址，失败时返回 NULL
+ */
+static unsigned long *pgtable_next(unsigned long *entry, int shift, int alloc) {
+  unsigned long phys, *table;
+
+  if((*entry & PAGE_Present) && !(*entry & PAGE_PS))
+    return phy_to_virt(*entry & PAGE_ADDR_MASK);
+  if(!alloc)
+    return NULL;
+
+  phys = pgtable_alloc();
+  if(!phys)
+    return NULL;
+  table = phy_to_virt(phys);
+
+  if(*entry & PAGE_Present) {   /* 拆分大页 */
+    unsigned long base = *entry & PAGE_ADDR_MASK & ~((1UL << shift) - 1);
+    unsigned long attr = *entry & ~PAGE_ADDR_MASK;
+    int child = shift - 9;
+    if(child == PAGE_4K_SHIFT)
+      attr &= ~PAGE_PS;
+    for(int i = 0; i < PTRS_PER_PAGE; ++i)
+      table[i] = (base + ((unsigned long)i << child)) | attr;
+  }
+  *entry = phys | PAGE_USER_Dir;
+  return table;
+}
+
+/**
+ * @brief 建立线性地址 [vaddr, vaddr + size) 到物理地址 [paddr, paddr + size) 的映射
+ * 在对齐和长度允许的情况下优先使用 1G 页，其次是 2M 页，否则使用 4K 页
+ *
+ * @param pgd PML4 页表的物理地址
+ * @param prot 最后一级页表项的属性，例如 PAGE_KERNEL_Page
+ * @return int 成功返回 0，参数未按 4K 对齐或页表分配失败返回 -1
+ */
+int map_pages(unsigned long *pgd, unsigned long vaddr, unsigned long paddr, unsigned long size,
+              unsigned long prot) {
+  unsigned long *pml4 = phy_to_virt(pgd);
+
+  unsigned long start = vaddr;
+
+  if((vaddr | paddr | size) & (PAGE_4K_SIZE - 1))
+    return -1;
+
+  while(size) {
+    unsigned long *table, *entry;
+    unsigned long step;
+
+    table = pgtable_next(pml4 + ((vaddr >> PAGE_GDT_SHIFT) & 0x1ff), PAGE_GDT_SHIFT, 1);
+    if(table == NULL)
+      return -1;
+    entry = table + ((vaddr >> PAGE_1G_SHIFT) & 0x1ff);
+    if(support_1g_page && !((vaddr | paddr) & (PAGE_1G_SIZE - 1)) && size >= PAGE_1G_SIZE) {
+      pgtable_free_tree(*entry, PAGE_1G_SHIFT);
+      *entry = paddr | prot | PAGE_PS;
+      step = PAGE_1G_SIZE;
+      goto next;
+    }
+
+    table = pgtable_next(entry, PAGE_1G_SHIFT, 1);
+    if(table == NULL)
+      return -1;
+    entry = table + ((vaddr >> PAGE_2M_SHIFT) & 0x1ff);
+    if(!((vaddr | paddr) & (PAGE_2M_SIZE - 1)) && size >= PAGE_2M_SIZE) {
+      pgtable_free_tree(*entry, PAGE_2M_SHIFT);
+      *entry = paddr | prot | PAGE_PS;
+      step = PAGE_2M_SIZE;
+      goto next;
+    }
+
+    table = pgtable_next(entry, PAGE_2M_SHIFT, 1);
+    if(table == NULL)
+      return -1;
+    table[(vaddr >> PAGE_4K_SHIFT) & 0x1ff] = paddr | prot;
+    step = PAGE_4K_SIZE;
+  next:
+    vaddr += step;
+    paddr += step;
+    size -= step;
+  }
+  flush_tlb_range(start, vaddr);
+  return 0;
+}
+
+/**
+ * @brief 修改 [vaddr, vaddr + size) 范围内的最后一级页表项
+ * 区间完整覆盖的大页被整体处理，只覆盖一部分的大页先拆分再处理，没有映射的部分被跳过
+ *
+ * @param unmap 不为 0 时清除页表项，否则把页表项属性替换为 prot
+ */
+static int change_pages(unsigned long *pgd, unsigned long vaddr, unsigned long size, int unmap,
+                        unsigned long prot) {
+  unsigned long *pml4 = phy_to_virt(pgd);
+  unsigned long start = vaddr;
+
+  if((vaddr | size) & (PAGE_4K_SIZE - 1))
+    return -1;
+
+  while(size) {
+    unsigned long *table = pml4, *entry;
+    unsigned long step;
+    int shift = PAGE_GDT_SHIFT;
+
+    while(1) {
+      entry = table + ((vaddr >> shift) & 0x1ff);
+      step = 1UL << shift;
+      if(!(*entry & PAGE_Present)) {  /* 没有映射，跳到该表项覆盖范围的结尾 */
+        step -= vaddr & (step - 1);
+        break;
+      }
+      if(shift == PAGE_4K_SHIFT || (*entry & PAGE_PS)) {
+        if(shift == PAGE_4K_SHIFT || (!(vaddr & (step - 1)) && size >= step)) {
+          if(unmap)
+            *entry = 0;
+          else
+            *entry = (*entry & (PAGE_ADDR_MASK | PAGE_PS)) | prot;
+          break;
+        }
+        /* 区间只覆盖了大页的一部分 */
+        table = pgtable_next(entry, shift, 1);
+        if(table == NULL)
+          return -1;
+      } else {
+        table = phy_to_virt(*entry & PAGE_ADDR_MASK);
+      }
+      shift -= 9;
+    }
+    if(step > size)
+      step = size;
+    vaddr += step;
+    size -= step;
+  }
+  flush_tlb_range(start, vaddr);
+  return 0;
+}
+
+/* 解除 [vaddr, vaddr + size) 的映射，页表本身不会被释放 */
+int unmap_pages(unsigned long *pgd, unsigned long vaddr, unsigned long size) {
+  return change_pages(pgd, vaddr, size, 1, 0);
+}
+
+/* 修改 [vaddr, vaddr + size) 已有映射的属性 */
+int protect_pages(unsigned long *pgd, unsigned long vaddr, unsigned long size, unsigned long prot) {
+  return change_pages(pgd, vaddr, size, 0, prot & ~(PAGE_ADDR_MASK | PAGE_PS));
+}
+
+/**
+ * @brief 查找映射线性地址 vaddr 的最后一级页表项
+ *
+ * @param page_size 不为 NULL 时返回该页表项映射的页大小
+ * @return unsigned long* 页表项地址，没有映射时返回 NULL
+ */
+unsigned long *get_pte(unsigned long *pgd, unsigned long vaddr, unsigned long *page_size) {
+  unsigned long *table = phy_to_virt(pgd), *entry;
+  int shift = PAGE_GDT_SHIFT;
+
+  while(1) {
+    entry = table + ((vaddr >> shift) & 0x1ff);
+    if(!(*entry & PAGE_Present))
+      return NULL;
+    if(shift == PAGE_4K_SHIFT || (*entry & PAGE_PS))
+      break;
+    table = phy_to_virt(*entry & PAGE_ADDR_MASK);
+    shift -= 9;
+  }
+  if(page_size)
+    *page_size = 1UL << shift;
+  return entry;
+}
+
+/**
+ * @brief 为新的地址空间分配 PML4 页表
+ * 内核层的 PML4 表项从 Global_CR3 复制，所有地址空间共享内核层的下级页表，应用层为空
+ *
+ * @return unsigned long* PML4 页表的物理地址，失败返回 NULL
+ */
+unsigned long *pgd_alloc() {
+  unsigned long phys = pgtable_alloc();
+  unsigned long *pml4;
+
+  if(!phys)
+    return NULL;
+  pml4 = phy_to_virt(phys);
+  memcpy(phy_to_virt(Global_CR3) + PTRS_PER_PAGE / 2, pml4 + PTRS_PER_PAGE / 2,
+         PTRS_PER_PAGE / 2 * sizeof(unsigned long));
+  return (unsigned long *)phys;
+}
+
+/**
+ * @brief 释放 pgd_alloc 分配的 PML4 页表以及应用层的各级页表
+ * 页表映射的页面由 exit_mmap 释放，内核层的下级页表由所有地址空间共享，不会被释放
+ */
+void pgd_free(unsigned long *pgd) {
+  unsigned long *pml4 = phy_to_virt(pgd);
+
+  for(int i = 0; i < PTRS_PER_PAGE / 2; ++i)
+    pgtable_free_tree(pml4[i], PAGE_GDT_SHIFT);
+  pgtable_free((unsigned long)pgd);
+}
+
+/* 正在使用的 PCID，PCID 0 留给 init_mm，PCID_SHARED 不通过位图分配 */
+static unsigned long pcid_map[(PCID_MASK + 1) / 64] = {1UL};
+static spinlock_t pcid_lock = SPIN_LOCK_UNLOCKED;
+
+/**
+ * @brief 为新的地址空间分配 PCID
+ * 只分配没有被其他存活的地址空间使用的 PCID，地址空间释放时由 pcid_free 归还；
+ * 被归还的 PCID 可能在各个 CPU 上残留旧地址空间的 TLB 表项，新的地址空间在每个 CPU 上第一次加载时刷新；
+ * 全部用完时返回 PCID_SHARED
+ */
+unsigned long pcid_alloc() {
+  unsigned long pcid, flags;
+
+  spin_lock_irqsave(&pcid_lock, flags);
+  pcid = find_next_zero_bit(pcid_map, PCID_SHARED, 1);
+  if(pcid < PCID_SHARED)
+    pcid_map[pcid >> 6] |= 1UL << (pcid % 64);
+  spin_unlock_irqrestore(&pcid_lock, flags);
+  return pcid;
+}
+
+void pcid_free(unsigned long pcid) {
+  unsigned long flags;
+
+  if(pcid == 0 || pcid >= PCID_SHARED)
+    return;
+  spin_lock_irqsave(&pcid_lock, flags);
+  pcid_map[pcid >> 6] &= ~(1UL << (pcid % 64));
+  spin_unlock_irqrestore(&pcid_lock, flags);
+}
+
+/**
+ * @brief 启用全局页，处理器支持时再启用 PCID，CPUID.01H:ECX[17]
+ * 设置 CR4.PCIDE 时 CR3[11:0] 必须为 0，此时当前地址空间使用 PCID 0
+ */
+void tlb_init() {
+  unsigned int a, b, c, d;
+  unsigned long cr4;
+
+  __asm__ __volatile__("movq %%cr4, %0\n\t"
+                       "orq %1, %0\n\t"
+                       "movq %0, %%cr4\n\t"
+                       : "=&r"(cr4)
+                       : "r"(CR4_PGE)
+                       : "memory");
+  get_cpuid(1, 0, &a, &b, &c, &d);
+  if(!((c >> 17) & 1) || ((unsigned long)get_gdt() & PCID_MASK))
+    return;
+  __asm__ __volatile__("movq %%cr4, %0\n\t"
+                       "orq %1, %0\n\t"
+                       "movq %0, %%cr4\n\t"
+                       : "=&r"(cr4)
+                       : "r"(CR4_PCIDE)
+                       : "memory");
+  pcid_enabled = 1;
+}
+
+/**
+ * @brief 将所有可用物理内存直接映射到内核层 PAGE_OFFSET 开始的线性地址
+ * head.S 只映射了前 10MB 内存和帧缓存，并且内核层与线性地址 0 处共享同一个 PDPT，
+ * 这里先在临时的 PML4 中建立完整的内核层映射，再一次性替换当前 PML4 的内核层表项，
+ * 线性地址 0 处的映射保持不变
+ *
+ * 帧缓存被重新映射到 phy_to_virt(FB_PHY_ADDR)，原来 0xffff800000a00000 处会变成普通内存
+ */
+void pagetable_init() {
+  unsigned int a, b, c, d;
+  unsigned long new_pgd, *new_pml4, *pml4;
+  unsigned long mapped = 0;
+
+  get_cpuid(0x80000001, 0, &a, &b, &c, &d);
+  support_1g_page = (d >> 26) & 1;
+  tlb_init();
+
+  new_pgd = pgtable_alloc();
+  if(!new_pgd) {
+    color_printk(RED, BLACK, "pagetable_init() ERROR: no memory for PML4\n");
+    return;
+  }
+
+  /* 前 2MB 包含 BIOS 数据区、IST 栈以及内核代码，与 head.S 一样整体映射 */
+  map_pages((unsigned long *)new_pgd, (unsigned long)phy_to_virt(0), 0, PAGE_2M_SIZE, DIRECT_MAP_PROT);
+  for(int i = 0; i <= memory_management_struct.e820_length; ++i) {
+    unsigned long start, end;
+    if(memory_management_struct.e820[i].type != 1)
+      continue;
+    start = PAGE_4K_ALIGN(memory_management_struct.e820[i].address);
+    end = (memory_management_struct.e820[i].address + memory_management_struct.e820[i].length) & PAGE_4K_MASK;
+    if(start < PAGE_2M_SIZE)
+      start = PAGE_2M_SIZE;
+    if(end <= start)
+      continue;
+    if(map_pages((unsigned long *)new_pgd, (unsigned long)phy_to_virt(start), start, end - start, DIRECT_MAP_PROT)) {
+      color_printk(RED, BLACK, "pagetable_init() ERROR: map %#018lx ~ %#018lx\n", start, end);
+      return;
+    }
+    mapped += end - start;
+  }
+  map_pages((unsigned long *)new_pgd, (unsigned long)phy_to_virt(FB_PHY_ADDR), FB_PHY_ADDR,
+            PAGE_2M_ALIGN(Pos.FB_length), DIRECT_MAP_PROT);
+
+  /* 替换内核层的 PML4 表项，在刷新 TLB 之前不能调用 color_printk */
+  new_pml4 = phy_to_virt(new_pgd);
+  pml4 = phy_to_virt(Global_CR3);
+  Pos.FB_addr = (unsigned int *)phy_to_virt(FB_PHY_ADDR);
+  for(int i = PTRS_PER_PAGE / 2; i < PTRS_PER_PAGE; ++i)
+    if(new_pml4[i] & PAGE_Present)
+      pml4[i] = new_pml4[i];
+  flush_tlb_all();
+  pgtable_free(new_pgd);
+
+  /* 所有物理内存都已经映射，ZONE_NORMAL 可以覆盖全部 zone */
+  ZONE_NORMAL_INDEX = memory_management_struct.zones_size - 1;
+
+  color_printk(ORANGE, BLACK, "direct map: %#018lx bytes, 1G page: %s, PCID: %s, frame buffer: %#018lx\n",
+               mapped, support_1g_page ? "yes" : "no", pcid_enabled ? "yes" : "no", Pos.FB_addr);
+}
@@ -0,0 +1,316 @@
+#include "slab.h"
+#include "lib.h"
+#include "mem.h"
+#include "printk.h"
+
+/* 通用缓存，kmalloc_cache[i] 的对象大小为 2^(i + KMALLOC_MIN_SHIFT) */
+struct kmem_cache kmalloc_cache[KMALLOC_CACHE_NR];
+
+/* 用于存放 kmem_cache_create 创建的缓存描述符 */
+static struct kmem_cache *cache_cachep = NULL;
+
+#define BITS_TO_LONGS(nr) (((nr) + sizeof(long) * 8 - 1) / (sizeof(long) * 8))
+#define ALIGN(x, a) (((unsigned long)(x) + (a) - 1) & ~((unsigned long)(a) - 1))
+
+/**
+ * @brief 计算缓存的 slab 布局
+ * 1. 对象不超过 SLAB_OFF_SLAB_LIMIT 时 slab 只占一个 4K 页，slab 描述符和位图放在页面起始处
+ * 2. 否则 slab 占用能放下至少一个对象的 2 的幂个 4K 页，描述符通过 kmalloc 分配
+ * 布局之后剩余的空间用作着色偏移，使不同 slab 中同一下标的对象落在不同的 cache line 上
+ */
+static void cache_layout(struct kmem_cache *cache) {
+  unsigned long slab_size, head = 0, left;
+
+  if(cache->size <= SLAB_OFF_SLAB_LIMIT) {
+    cache->slab_pages = 1;
+    cache->off_slab = 0;
+    slab_size = PAGE_4K_SIZE;
+    cache->num = (slab_size - sizeof(struct slab)) / cache->size;
+    /* 描述符、位图以及对齐之后的对象必须能放进一个页面 */
+    while(ALIGN(sizeof(struct slab) + BITS_TO_LONGS(cache->num) * sizeof(long), cache->align) +
+          cache->num * cache->size > slab_size)
+      --cache->num;
+    head = ALIGN(sizeof(struct slab) + BITS_TO_LONGS(cache->num) * sizeof(long), cache->align);
+  } else {
+    cache->slab_pages = 1;
+    while(cache->slab_pages * PAGE_4K_SIZE < cache->size)
+      cache->slab_pages <<= 1;
+    cache->off_slab = 1;
+    slab_size = cache->slab_pages * PAGE_4K_SIZE;
+    cache->num = slab_size / cache->size;
+  }
+
+  left = slab_size - head - cache->num * cache->size;
+  cache->color_unit = cache->align > L1_CACHE_BYTES ? cache->align : L1_CACHE_BYTES;
+  cache->color_range = left / cache->color_unit + 1;
+  cache->color_next = 0;
+}
+
+static void cache_setup(struct kmem_cache *cache, char *name, unsigned long size, unsigned long align,
+                        void (*ctor)(void *obj), void (*dtor)(void *obj)) {
+  if(align < sizeof(long))
+    align = sizeof(long);
+  cache->name = name;
+  cache->align = align;
+  cache->size = ALIGN(size, align);
+  cache->ctor = ctor;
+  cache->dtor = dtor;
+  cache->total_using = 0;
+  cache->total_free = 0;
+  spin_init(&cache->lock);
+  list_init(&cache->slabs_partial);
+  list_init(&cache->slabs_full);
+  list_init(&cache->slabs_free);
+  cache_layout(cache);
+}
+
+/**
+ * @brief 为 cache 创建一个新的 slab
+ * slab 的每个 4K 页都记录了所属的 slab，kfree 时可以通过地址找到 slab
+ */
+static struct slab *slab_create(struct kmem_cache *cache) {
+  struct page *page;
+  struct slab *slab;
+  unsigned char *base;
+  unsigned long bitmap_size = BITS_TO_LONGS(cache->num) * sizeof(long);
+
+  page = alloc_pages_4k(cache->slab_pages, PG_PTable_Maped | PG_Kernel | PG_Active | PG_Slab);
+  if(page == NULL) {
+    color_printk(RED, BLACK, "slab_create()->alloc_pages_4k() ERROR: %s\n", cache->name);
+    return NULL;
+  }
+  base = (unsigned char *)phy_to_virt(page->PHY_address);
+
+  if(cache->off_slab) {
+    slab = (struct slab *)kmalloc(sizeof(struct slab) + bitmap_size);
+    if(slab == NULL) {
+      free_pages_4k(page, cache->slab_pages);
+      return NULL;
+    }
+    slab->bitmap = (unsigned long *)(slab + 1);
+    slab->vaddress = base;
+  } else {
+    slab = (struct slab *)base;
+    slab->bitmap = (unsigned long *)(slab + 1);
+    slab->vaddress = base + ALIGN(sizeof(struct slab) + bitmap_size, cache->align);
+  }
+
+  slab->color_offset = cache->color_next * cache->color_unit;
+  slab->vaddress = (unsigned char *)slab->vaddress + slab->color_offset;
+  cache->color_next = (cache->color_next + 1) % cache->color_range;
+
+  list_init(&slab->list);
+  slab->cache = cache;
+  slab->page = page;
+  slab->using_count = 0;
+  slab->free_count = cache->num;
+  memset(slab->bitmap, 0, bitmap_size);
+
+  for(unsigned long i = 0; i < cache->slab_pages; ++i)
+    (page + i)->slab = slab;
+
+  cache->total_free += cache->num;
+  return slab;
+}
+
+/* 释放一个完全空闲的 slab，调用者负责把它从链表中摘下 */
+static void slab_destroy(struct kmem_cache *cache, struct slab *slab) {
+  struct page *page = slab->page;
+
+  cache->total_free -= slab->free_count;
+  for(unsigned long i = 0; i < cache->slab_pages; ++i)
+    (page + i)->slab = NULL;
+  if(cache->off_slab)
+    kfree(slab);
+  free_pages_4k(page, cache->slab_pages);
+}
+
+/**
+ * @brief 创建一个对象缓存
+ *
+ * @param name 缓存名称
+ * @param size 对象大小
+ * @param align 对象对齐要求，为 0 时按照 long 对齐
+ * @param ctor 对象分配时调用的构造函数，可以为 NULL
+ * @param dtor 对象释放时调用的析构函数，可以为 NULL
+ * @return struct kmem_cache*
+ */
+struct kmem_cache *kmem_cache_create(char *name, unsigned long size, unsigned long align,
+                                     void (*ctor)(void *obj), void (*dtor)(void *obj)) {
+  struct kmem_cache *cache;
+
+  if(size == 0 || size > (1UL << KMALLOC_MAX_SHIFT)) {
+    color_printk(RED, BLACK, "kmem_cache_create() ERROR: %s size %#018lx\n", name, size);
+    return NULL;
+  }
+  cache = (struct kmem_cache *)kmem_cache_alloc(cache_cachep);
+  if(cache == NULL)
+    return NULL;
+  cache_setup(cache, name, size, align, ctor, dtor);
+  return cache;
+}
+
+/**
+ * @brief 销毁对象缓存，缓存中不能还有已分配的对象
+ */
+unsigned long kmem_cache_destroy(struct kmem_cache *cache) {
+  unsigned long flags;
+
+  spin_lock_irqsave(&cache->lock, flags);
+  if(cache->total_using) {
+    spin_unlock_irqrestore(&cache->lock, flags);
+    color_printk(RED, BLACK, "kmem_cache_destroy() ERROR: %s is busy\n", cache->name);
+    return 0;
+  }
+  while(!list_is_empty(&cache->slabs_free)) {
+    struct slab *slab = container_of(list_next(&cache->slabs_free), struct slab, list);
+    list_del(&slab->list);
+    slab_destroy(cache, slab);
+  }
+  spin_unlock_irqrestore(&cache->lock, flags);
+  kmem_cache_free(cache_cachep, cache);
+  return 1;
+}
+
+/**
+ * @brief 从对象缓存中分配一个对象
+ * 优先使用部分分配的 slab，其次是空闲 slab，最后才创建新的 slab
+ */
+void *kmem_cache_alloc(struct kmem_cache *cache) {
+  struct slab *slab;
+  unsigned long idx, flags;
+  void *obj;
+
+  if(cache == NULL)
+    return NULL;
+
+  spin_lock_irqsave(&cache->lock, flags);
+  if(list_is_empty(&cache->slabs_partial)) {
+    if(!list_is_empty(&cache->slabs_free)) {
+      slab = container_of(list_next(&cache->slabs_free), struct slab, list);
+      list_del(&slab->list);
+    } else {
+      slab = slab_create(cache);
+      if(slab == NULL) {
+        spin_unlock_irqrestore(&cache->lock, flags);
+        return NULL;
+      }
+    }
+    list_add_to_behind(&cache->slabs_partial, &slab->list);
+  }
+  slab = container_of(list_next(&cache->slabs_partial), struct slab, list);
+
+  idx = find_next_zero_bit(slab->bitmap, cache->num, 0);
+  slab->bitmap[idx >> 6] |= 1UL << (idx % 64);
+  slab->using_count++;
+  slab->free_count--;
+  cache->total_using++;
+  cache->total_free--;
+
+  if(!slab->free_count) {   /* slab 已经全部分配 */
+    list_del(&slab->list);
+    list_add_to_behind(&cache->slabs_full, &slab->list);
+  }
+
+  obj = (unsigned char *)slab->vaddress + idx * cache->size;
+  spin_unlock_irqrestore(&cache->lock, flags);
+  if(cache->ctor)
+    cache->ctor(obj);
+  return obj;
+}
+
+/**
+ * @brief 将对象归还给对象缓存
+ * 变为空闲的 slab 会被保留一个，多余的空闲 slab 直接释放
+ */
+void kmem_cache_free(struct kmem_cache *cache, void *obj) {
+  struct page *page = phy_to_4k_page(virt_to_phy(obj));
+  struct slab *slab;
+  unsigned long offset, idx, flags;
+
+  if(page == NULL || !(page->attribute & PG_Slab) || page->slab == NULL || page->slab->cache != cache) {
+    color_printk(RED, BLACK, "kmem_cache_free() ERROR: %#018lx is not in %s\n", obj, cache->name);
+    return;
+  }
+  slab = page->slab;
+  /* 地址必须是某个对象的起始地址；低于第一个对象时相减的结果很大，同样会被下标检查拒绝 */
+  offset = (unsigned long)obj - (unsigned long)slab->vaddress;
+  idx = offset / cache->size;
+  if(offset % cache->size || idx >= cache->num) {
+    color_printk(RED, BLACK, "kmem_cache_free() ERROR: %#018lx is not an object of %s\n", obj,
+                 cache->name);
+    return;
+  }
+  spin_lock_irqsave(&cache->lock, flags);
+  if(!(slab->bitmap[idx >> 6] & (1UL << (idx % 64)))) {
+    spin_unlock_irqrestore(&cache->lock, flags);
+    color_printk(RED, BLACK, "kmem_cache_free() ERROR: double free %#018lx\n", obj);
+    return;
+  }
+
+  if(cache->dtor)
+    cache->dtor(obj);
+  slab->bitmap[idx >> 6] &= ~(1UL << (idx % 64));
+  if(!slab->free_count) {   /* 原来在 full 链表中 */
+    list_del(&slab->list);
+    list_add_to_behind(&cache->slabs_partial, &slab->list);
+  }
+  slab->using_count--;
+  slab->free_count++;
+  cache->total_using--;
+  cache->total_free++;
+
+  if(!slab->using_count) {
+    list_del(&slab->list);
+    if(list_is_empty(&cache->slabs_free))
+      list_add_to_behind(&cache->slabs_free, &slab->list);
+    else
+      slab_destroy(cache, slab);
+  }
+  spin_unlock_irqrestore(&cache->lock, flags);
+}
+
+/**
+ * @brief 从通用缓存中分配内存，大小向上取整为 2 的幂
+ *
+ * @param size 不超过 1MB
+ * @return void*
+ */
+void *kmalloc(unsigned long size) {
+  for(int i = 0; i < KMALLOC_CACHE_NR; ++i)
+    if(kmalloc_cache[i].size >= size)
+      return kmem_cache_alloc(kmalloc_cache + i);
+  color_printk(RED, BLACK, "kmalloc() ERROR: size %#018lx too large\n", size);
+  return NULL;
+}
+
+/* 释放 kmalloc 或 kmem_cache_alloc 分配的内存 */
+void kfree(void *address) {
+  struct page *page;
+
+  if(address == NULL)
+    return;
+  page = phy_to_4k_page(virt_to_phy(address));
+  if(page == NULL || !(page->attribute & PG_Slab) || page->slab == NULL) {
+    color_printk(RED, BLACK, "kfree() ERROR: %#018lx\n", address);
+    return;
+  }
+  kmem_cache_free(page->slab->cache, address);
+}
+
+/**
+ * @brief 初始化通用缓存以及存放缓存描述符的缓存
+ * 通用缓存从小到大依次初始化，大对象缓存的 slab 描述符会从小对象缓存中分配
+ */
+void slab_init() {
+  static struct kmem_cache cache_cache;
+
+  for(int i = 0; i < KMALLOC_CACHE_NR; ++i)
+    cache_setup(kmalloc_cache + i, "kmalloc", 1UL << (i + KMALLOC_MIN_SHIFT), 0, NULL, NULL);
+
+  cache_setup(&cache_cache, "kmem_cache", sizeof(struct kmem_cache), 0, NULL, NULL);
+  cache_cachep = &cache_cache;
+
+  color_printk(ORANGE, BLACK, "slab init: %d general caches, %d ~ %d bytes\n", KMALLOC_CACHE_NR,
+               kmalloc_cache[0].size, kmalloc_cache[KMALLOC_CACHE_NR - 1].size);
+}
@@ -0,0 +1,80 @@
+#include "uaccess.h"
+#include "lib.h"
+#include "mem.h"
+#include "task.h"
+
+/**
+ * @brief 检查应用层地址范围 [addr, addr + size) 是否可以按照 flags 访问
+ * 范围可以跨越多个相邻的虚拟内存区域，每个区域都要具有 flags 中的全部权限
+ * 内核线程没有应用层地址空间，总是返回 0
+ * 区域链表可能被同一个地址空间的其他线程修改，查找期间持有 mm->page_table_lock
+ *
+ * @param flags VM_READ、VM_WRITE 的组合
+ * @return int 可以访问返回 1，否则返回 0
+ */
+int access_ok(struct mm_struct *mm, unsigned long addr, unsigned long size, unsigned long flags) {
+  unsigned long end = addr + size;
+  struct vm_area_struct *vma;
+  unsigned long irqflags;
+  int ret = 1;
+
+  if(mm == NULL || mm == &init_mm)
+    return 0;
+  if(end < addr || end > TASK_SIZE)
+    return 0;
+  spin_lock_irqsave(&mm->page_table_lock, irqflags);
+  while(addr < end) {
+    vma = find_vma(mm, addr);
+    if(vma == NULL || (vma->vm_flags & flags) != flags) {
+      ret = 0;
+      break;
+    }
+    addr = vma->vm_end;
+  }
+  spin_unlock_irqrestore(&mm->page_table_lock, irqflags);
+  return ret;
+}
+
+/**
+ * @brief 为已经通过 access_ok 检查的范围建立映射
+ * 不存在的页面按照读缺页处理，write 不为 0 时只读页面再按照写缺页处理，完成写时复制
+ *
+ * @return int 成功返回 0，内存不足或者访问非法返回 -1
+ */
+int fault_in_user(struct mm_struct *mm, unsigned long addr, unsigned long size, int write) {
+  unsigned long end = addr + size, page_size, *pte;
+
+  for(addr &= PAGE_4K_MASK; addr < end; addr += PAGE_4K_SIZE) {
+    pte = get_pte((unsigned long *)mm->pgd, addr, &page_size);
+    if((pte == NULL || !(*pte & PAGE_Present)) && handle_mm_fault(mm, addr, write ? PF_WRITE : 0))
+      return -1;
+    if(!write)
+      continue;
+    pte = get_pte((unsigned long *)mm->pgd, addr, &page_size);
+    if(pte == NULL)
+      return -1;
+    if(!(*pte & PAGE_R_W) && handle_mm_fault(mm, addr, PF_PROTECTION | PF_WRITE))
+      return -1;
+  }
+  return 0;
+}
+
+unsigned long copy_from_user(const void *from, void *to, unsigned long size) {
+  struct mm_struct *mm = current->mm;
+
+  if(!access_ok(mm, (unsigned long)from, size, VM_READ) ||
+     fault_in_user(mm, (unsigned long)from, size, 0))
+    return size;
+  memcpy((void *)from, to, size);
+  return 0;
+}
+
+unsigned long copy_to_user(const void *from, void *to, unsigned long size) {
+  struct mm_struct *mm = current->mm;
+
+  if(!access_ok(mm, (unsigned long)to, size, VM_WRITE) ||
+     fault_in_user(mm, (unsigned long)to, size, 1))
+    return size;
+  memcpy((void *)from, to, size);
+  return 0;
+}
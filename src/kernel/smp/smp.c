@@ -0,0 +1,215 @@
+#include "smp.h"
+#include "apic.h"
+#include "fpu.h"
+#include "gate.h"
+#include "interrupt.h"
+#include "lib.h"
+#include "mem.h"
+#include "printk.h"
+#include "schedule.h"
+#include "slab.h"
+#include "softirq.h"
+#include "task.h"
+#include "timer.h"
+#include "vdso.h"
+
+extern char _APU_boot_start[];
+extern char _APU_boot_end[];
+extern struct kmem_cache *task_union_cachep;
+
+struct cpu_data cpu_data[NR_CPUS];
+
+unsigned long cpu_online_mask = 1;
+unsigned int smp_num_cpus = 1;
+
+/* 下一个获取 smp_boot_lock 的 AP 将成为 CPU smp_boot_cpu */
+volatile unsigned int smp_boot_cpu = 0;
+
+/* 第 0 位为 1 时 AP 在 APU_boot.S 中等待，由 BSP 在准备好 _stack_start 之后清零 */
+volatile unsigned long smp_boot_lock = 1;
+
+Build_IRQ(0xc8)
+Build_IRQ(0xca)
+Build_IRQ(0xcb)
+
+/**
+ * @brief 初始化 CPU cpu 的 cpu_data，并把 IA32_GS_BASE 指向它
+ * 必须在当前 CPU 第一次使用 current 之前调用，此时运行的是该 CPU 的 0 号进程
+ */
+void percpu_init(unsigned int cpu) {
+  struct cpu_data *p = cpu_data + cpu;
+
+  memset(p, 0, sizeof(*p));
+  p->self = p;
+  p->current_task = init_task[cpu];
+  p->cpu_id = cpu;
+  p->rq = task_schedule + cpu;
+  p->tss = init_tss + cpu;
+  wrmsr(IA32_GS_BASE, (unsigned long)p);
+  wrmsr(IA32_KERNEL_GS_BASE, 0);
+}
+
+/* 打印每个在线 CPU 的中断、系统调用以及进程切换次数 */
+void percpu_stat_print() {
+  for(int cpu = 0; cpu < NR_CPUS; ++cpu) {
+    struct cpu_data *p = cpu_data + cpu;
+    if(!cpu_online(cpu))
+      continue;
+    color_printk(ORANGE, BLACK, "cpu%d irq: %ld, ipi: %ld, syscall: %ld, switch: %ld\n", cpu,
+                 p->irq_count, p->ipi_count, p->syscall_count, p->switch_count);
+  }
+}
+
+/**
+ * @brief 为 AP 准备 0 号进程、TSS 以及 head.S 使用的栈
+ * AP 的 0 号进程与 BSP 的一样不进入就绪队列，只在本 CPU 没有其他进程时运行；
+ * NMI、#DF、#MC 使用的 IST 1 栈单独分配，其余中断和异常都在被打断进程的内核栈上处理
+ */
+static int smp_prepare_cpu(unsigned int cpu) {
+  struct task_struct *idle;
+  struct thread_struct *thd;
+  unsigned long ist;
+
+  idle = (struct task_struct *)kmem_cache_alloc(task_union_cachep);
+  if(idle == NULL)
+    return -1;
+  ist = (unsigned long)kmalloc(STACK_SIZE);
+  if(!ist) {
+    kmem_cache_free(task_union_cachep, idle);
+    return -1;
+  }
+
+  *idle = init_task_union.task;
+  list_init(&idle->list);
+  idle->flags = PF_KTHREAD;
+  idle->preempt_count = 0;
+  idle->cpu_id = cpu;
+  thd = (struct thread_struct *)(idle + 1);
+  *thd = init_thread;
+  thd->rsp0 = (unsigned long)idle + STACK_SIZE;
+  thd->rsp = thd->rsp0;
+  idle->thread = thd;
+  init_task[cpu] = idle;
+  task_schedule[cpu].idle = idle;
+
+  init_tss[cpu].rsp0 = thd->rsp0;
+  init_tss[cpu].rsp1 = thd->rsp0;
+  init_tss[cpu].rsp2 = thd->rsp0;
+  init_tss[cpu].ist1 = init_tss[cpu].ist2 = init_tss[cpu].ist3 = init_tss[cpu].ist4 =
+    init_tss[cpu].ist5 = init_tss[cpu].ist6 = init_tss[cpu].ist7 = ist + STACK_SIZE;
+  set_tss_descriptor(10 + cpu * 2, init_tss + cpu);
+
+  _stack_start = thd->rsp0;   /* 下一个获取 smp_boot_lock 的 AP 使用这个栈 */
+  smp_boot_cpu = cpu;
+  return 0;
+}
+
+/* 等待 ticks 个时钟节拍，调用者需要打开中断 */
+static void smp_delay(unsigned long ticks) {
+  unsigned long timeout = jiffies + ticks;
+  while(jiffies < timeout)
+    __asm__ __volatile__("pause \n\t");
+}
+
+/**
+ * @brief 启动所有的 AP
+ * 1. 处理器数量取 CPUID.01H:EBX[23:16] 与 NR_CPUS 中较小的一个
+ * 2. 广播 INIT-SIPI-SIPI，所有 AP 都会执行 APU_boot.S，并在 smp_boot_lock 上等待
+ * 3. 每次为一个 AP 准备好栈之后释放锁，等待它在 Start_SMP 中上线后再启动下一个
+ * 超过 NR_CPUS 的处理器会一直停留在 smp_boot_lock 上
+ */
+void smp_init() {
+  unsigned int a, b, c, d, count, cpu;
+  unsigned long timeout;
+
+  if(!x2apic_enabled && !apic_base) {   /* apic_init 失败 */
+    color_printk(RED, BLACK, "smp_init() ERROR: local APIC is not available\n");
+    return;
+  }
+  get_cpuid(1, 0, &a, &b, &c, &d);
+  count = (d & (1 << 28)) ? (b >> 16) & 0xff : 1;
+  if(count > NR_CPUS)
+    count = NR_CPUS;
+
+  set_intr_gate(IPI_TIMER_VECTOR, 0, IRQ0xc8_interrupt);
+  set_intr_gate(IPI_RESCHEDULE_VECTOR, 0, IRQ0xca_interrupt);
+  set_intr_gate(IPI_PCP_DRAIN_VECTOR, 0, IRQ0xcb_interrupt);
+  if(count <= 1)
+    return;
+
+  memcpy(_APU_boot_start, phy_to_virt(APU_BOOT_ADDR), _APU_boot_end - _APU_boot_start);
+
+  apic_send_ipi(0, APIC_DEST_ALLBUT | APIC_INT_ASSERT | APIC_DM_INIT);
+  smp_delay(1);
+  apic_send_ipi(0, APIC_DEST_ALLBUT | APIC_INT_ASSERT | APIC_DM_STARTUP | (APU_BOOT_ADDR >> 12));
+  smp_delay(1);
+  apic_send_ipi(0, APIC_DEST_ALLBUT | APIC_INT_ASSERT | APIC_DM_STARTUP | (APU_BOOT_ADDR >> 12));
+
+  for(cpu = 1; cpu < count; ++cpu) {
+    if(smp_prepare_cpu(cpu))
+      break;
+    smp_boot_lock = 0;
+    timeout = jiffies + HZ / 10;
+    while(!cpu_online(cpu) && jiffies < timeout)
+      __asm__ __volatile__("pause \n\t");
+    if(!cpu_online(cpu)) {
+      color_printk(RED, BLACK, "smp_init() ERROR: CPU %d is not responding\n", cpu);
+      break;
+    }
+    smp_num_cpus++;
+  }
+  color_printk(ORANGE, BLACK, "smp init: %d CPUs online\n", smp_num_cpus);
+}
+
+/**
+ * @brief AP 的 C 语言入口，由 head.S 跳转过来，此时已经运行在自己的 0 号进程栈上
+ * 加载自己的 TSS，初始化 TLB 特性、local APIC 以及 SYSENTER 使用的 MSR，
+ * 然后作为本 CPU 的 0 号进程等待调度
+ */
+void Start_SMP() {
+  unsigned int cpu = smp_boot_cpu;
+  unsigned int tr = 10 + cpu * 2;
+
+  percpu_init(cpu);
+  load_TR(tr);
+  tlb_init();
+  local_apic_init();
+  local_timer_init();
+  fpu_cpu_init();
+  vdso_cpu_init();
+
+  syscall_init();
+
+  ksoftirqd_init();
+
+  color_printk(ORANGE, BLACK, "CPU %d online, APIC ID: %d\n", cpu, apic_id());
+  __asm__ __volatile__("lock orq %1, %0 \n\t" : "+m"(cpu_online_mask) : "r"(1UL << cpu) : "memory");
+
+  sti();
+  cpu_idle();
+}
+
+/* 处理器间中断的主函数，由 do_IRQ 分发过来 */
+void do_IPI(unsigned long regs, unsigned long nr) {
+  this_cpu_inc(ipi_count);
+  switch(nr) {
+  case IPI_TIMER_VECTOR:
+    update_process_times();
+    break;
+  case LOCAL_TIMER_VECTOR:
+    local_timer_interrupt();
+    break;
+  case IPI_RESCHEDULE_VECTOR:   /* 被唤醒的进程已经在就绪队列中，需要时在中断返回时调度 */
+    check_preempt_curr();
+    break;
+  case IPI_PCP_DRAIN_VECTOR:
+    drain_local_pages();
+    break;
+  case SPURIOUS_VECTOR:   /* 伪中断不需要 EOI */
+    return;
+  default:
+    color_printk(RED, BLACK, "do_IPI:%#08x\n", nr);
+    break;
+  }
+  apic_eoi();
+}
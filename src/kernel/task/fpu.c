@@ -0,0 +1,218 @@
+#include "fpu.h"
+#include "cpu.h"
+#include "lib.h"
+#include "percpu.h"
+#include "printk.h"
+#include "slab.h"
+#include "task.h"
+
+unsigned long xstate_size = 512;
+int fpu_eager = 0;
+
+static unsigned long xfeatures = 0;   /* XCR0 的值，为 0 时使用 FXSAVE/FXRSTOR */
+static int fpu_xsaveopt = 0;
+static struct kmem_cache *fpu_cachep = NULL;
+
+/* XSAVE 系列指令通过 EDX:EAX 指定要保存的组件，全部置位表示 XCR0 中开启的所有组件 */
+static inline void fpu_save_area(void *area) {
+  if(fpu_xsaveopt)
+    __asm__ __volatile__("xsaveopt64 (%0) \n\t" : : "r"(area), "a"(-1), "d"(-1) : "memory");
+  else if(xfeatures)
+    __asm__ __volatile__("xsave64 (%0) \n\t" : : "r"(area), "a"(-1), "d"(-1) : "memory");
+  else
+    __asm__ __volatile__("fxsave64 (%0) \n\t" : : "r"(area) : "memory");
+}
+
+static inline void fpu_restore_area(void *area) {
+  if(xfeatures)
+    __asm__ __volatile__("xrstor64 (%0) \n\t" : : "r"(area), "a"(-1), "d"(-1) : "memory");
+  else
+    __asm__ __volatile__("fxrstor64 (%0) \n\t" : : "r"(area) : "memory");
+}
+
+/**
+ * 新的保存区清零后只需要设置 FCW 和 MXCSR：
+ * XSAVE 头部的 XSTATE_BV 为 0，XRSTOR 会把各组件恢复为初始状态，但 MXCSR 总是从内存中加载
+ */
+static void fpu_ctor(void *obj) {
+  memset(obj, 0, xstate_size);
+  *(unsigned short *)((unsigned char *)obj + FXSAVE_FCW) = FCW_DEFAULT;
+  *(unsigned int *)((unsigned char *)obj + FXSAVE_MXCSR) = MXCSR_DEFAULT;
+}
+
+/**
+ * @brief 设置当前 CPU 的 CR0、CR4 和 XCR0
+ * 开启 SSE 和 XSAVE 支持，并置位 CR0.TS，任何进程第一次使用 FPU 时都会触发 #NM
+ */
+void fpu_cpu_init() {
+  unsigned long cr0, cr4;
+
+  __asm__ __volatile__("movq %%cr0, %0 \n\t" : "=r"(cr0));
+  cr0 = (cr0 & ~CR0_EM) | CR0_MP | CR0_NE | CR0_TS;
+  __asm__ __volatile__("movq %0, %%cr0 \n\t" : : "r"(cr0) : "memory");
+
+  __asm__ __volatile__("movq %%cr4, %0 \n\t" : "=r"(cr4));
+  cr4 |= CR4_OSFXSR | CR4_OSXMMEXCPT;
+  if(xfeatures)
+    cr4 |= CR4_OSXSAVE;
+  __asm__ __volatile__("movq %0, %%cr4 \n\t" : : "r"(cr4) : "memory");
+
+  if(xfeatures)
+    __asm__ __volatile__("xsetbv \n\t"
+                         :
+                         : "c"(0), "a"((unsigned int)xfeatures), "d"((unsigned int)(xfeatures >> 32))
+                         : "memory");
+  this_cpu_write(fpu_owner, NULL);
+}
+
+/**
+ * @brief BSP 根据 CPUID 确定 FPU 状态的保存方式，然后初始化自己的 FPU
+ * 需要在 slab_init 之后调用，AP 在 Start_SMP 中调用 fpu_cpu_init
+ */
+void fpu_init() {
+  unsigned int a, b, c, d;
+
+  get_cpuid(1, 0, &a, &b, &c, &d);
+  if(c & (1 << 26)) {   /* XSAVE */
+    get_cpuid(0xd, 0, &a, &b, &c, &d);
+    xfeatures = ((unsigned long)d << 32 | a) & XFEATURE_MASK;
+  }
+  fpu_cpu_init();
+  if(xfeatures) {
+    get_cpuid(0xd, 0, &a, &b, &c, &d);  /* 设置 XCR0 之后，EBX 为开启的组件所需的保存区大小 */
+    xstate_size = b;
+    get_cpuid(0xd, 1, &a, &b, &c, &d);
+    fpu_xsaveopt = a & 1;
+  }
+  fpu_eager = fpu_xsaveopt;
+  fpu_cachep = kmem_cache_create("fpu_state", xstate_size, 64, fpu_ctor, NULL);
+  color_printk(RED, BLACK, "fpu init, %s, xfeatures: %#lx, xstate size: %ld, %s\n",
+               xfeatures ? (fpu_xsaveopt ? "XSAVEOPT" : "XSAVE") : "FXSAVE", xfeatures, xstate_size,
+               fpu_eager ? "eager" : "lazy");
+}
+
+/* 当前 CPU 的 FPU 寄存器中保存的是哪个进程的状态，调用者需要关闭中断 */
+static void fpu_save_owner() {
+  struct task_struct *owner = this_cpu_read(fpu_owner);
+
+  if(owner == NULL)
+    return;
+  clts();
+  fpu_save_area(owner->thread->fpu);
+  this_cpu_write(fpu_owner, NULL);
+}
+
+/**
+ * @brief 子进程复制父进程的 FPU 状态
+ * 父进程的状态可能还在 FPU 寄存器中，先保存到父进程的保存区，此时 FPU 不再属于任何进程
+ *
+ * @return int 内存不足时返回 -1
+ */
+int fpu_fork(struct task_struct *tsk) {
+  unsigned long flags;
+
+  tsk->thread->fpu = NULL;
+  if(current->thread->fpu == NULL)
+    return 0;
+  tsk->thread->fpu = kmem_cache_alloc(fpu_cachep);
+  if(tsk->thread->fpu == NULL)
+    return -1;
+  local_irq_save(flags);
+  if(this_cpu_read(fpu_owner) == current) {
+    fpu_save_owner();
+    stts();
+  }
+  memcpy(current->thread->fpu, tsk->thread->fpu, xstate_size);
+  local_irq_restore(flags);
+  return 0;
+}
+
+/* 进程执行新程序或者退出时丢弃 FPU 状态，下次使用 FPU 时从初始状态开始 */
+void fpu_release(struct task_struct *tsk) {
+  unsigned long flags;
+
+  local_irq_save(flags);
+  if(this_cpu_read(fpu_owner) == tsk) {
+    this_cpu_write(fpu_owner, NULL);
+    stts();
+  }
+  local_irq_restore(flags);
+  if(tsk->thread->fpu) {
+    kmem_cache_free(fpu_cachep, tsk->thread->fpu);
+    tsk->thread->fpu = NULL;
+  }
+}
+
+/**
+ * @brief 进程切换时处理 FPU 状态，由 __switch_to 在关闭中断的情况下调用
+ * 进程不会迁移到其他 CPU，FPU 寄存器中的状态只可能属于本 CPU 上的进程
+ * 1. eager 模式：保存 prev 的状态，next 使用过 FPU 时立即恢复；没有使用过时置位 CR0.TS
+ * 2. lazy 模式：FPU 寄存器中正好是 next 的状态时清除 CR0.TS，否则置位，等到 #NM 时再处理
+ */
+void switch_fpu(struct task_struct *prev, struct task_struct *next) {
+  struct task_struct *owner = this_cpu_read(fpu_owner);
+
+  if(!fpu_eager) {
+    if(owner == next)
+      clts();
+    else
+      stts();
+    return;
+  }
+  if(owner == prev)
+    fpu_save_owner();
+  if(next->thread->fpu) {
+    clts();
+    fpu_restore_area(next->thread->fpu);
+    this_cpu_write(fpu_owner, next);
+  } else {
+    stts();
+  }
+}
+
+/**
+ * @brief #NM 异常处理：当前进程使用了 FPU 而 CR0.TS 被置位
+ * 保存上一个使用者的状态，恢复当前进程的状态，第一次使用 FPU 的进程在这里分配保存区
+ * 处理期间关闭中断，避免被抢占后 FPU 的所有者发生变化
+ */
+void fpu_state_restore() {
+  struct task_struct *tsk = current;
+  unsigned long flags;
+
+  local_irq_save(flags);
+  clts();
+  if(this_cpu_read(fpu_owner) != tsk) {
+    fpu_save_owner();
+    if(tsk->thread->fpu == NULL)
+      tsk->thread->fpu = kmem_cache_alloc(fpu_cachep);
+    if(tsk->thread->fpu == NULL) {
+      color_printk(RED, BLACK, "fpu_state_restore() ERROR: pid: %ld, no memory\n", tsk->pid);
+      cpu_halt();
+    }
+    clts();
+    fpu_restore_area(tsk->thread->fpu);
+    this_cpu_write(fpu_owner, tsk);
+  }
+  local_irq_restore(flags);
+}
+
+/**
+ * @brief 内核代码使用 SSE/AVX 之前调用，与 kernel_fpu_end 配对
+ * 保存 FPU 寄存器中进程的状态，之后内核可以任意使用 FPU，期间禁止抢占；
+ * 中断处理函数中不能使用，被打断的代码可能正在使用 FPU
+ */
+void kernel_fpu_begin() {
+  unsigned long flags;
+
+  current->preempt_count++;
+  local_irq_save(flags);
+  fpu_save_owner();
+  clts();
+  local_irq_restore(flags);
+}
+
+/* FPU 不属于任何进程，进程下一次使用 FPU 时通过 #NM 恢复自己的状态 */
+void kernel_fpu_end() {
+  stts();
+  current->preempt_count--;
+}
@@ -0,0 +1,179 @@
+#include "schedule.h"
+#include "apic.h"
+#include "lib.h"
+#include "printk.h"
+#include "smp.h"
+#include "task.h"
+#include "timer.h"
+
+struct schedule task_schedule[NR_CPUS];
+
+void schedule_init() {
+  for(int cpu = 0; cpu < NR_CPUS; ++cpu) {
+    struct schedule *rq = task_schedule + cpu;
+    spin_init(&rq->lock);
+    for(int i = 0; i < MAX_PRIO; ++i)
+      list_init(rq->task_queue + i);
+    memset(rq->bitmap, 0, sizeof(rq->bitmap));
+    rq->running_task_count = 0;
+    rq->idle = init_task[cpu];
+  }
+}
+
+/* 将进程插入对应优先级队列的末尾，调用者需要持有 rq->lock */
+static void enqueue_task(struct schedule *rq, struct task_struct *tsk) {
+  list_add_to_before(rq->task_queue + tsk->priority, &tsk->list);
+  bitmap_set(rq->bitmap, tsk->priority, 1);
+  rq->running_task_count++;
+}
+
+/* 取出就绪队列中优先级最高的进程，队列为空时返回 0 号进程 */
+static struct task_struct *dequeue_task(struct schedule *rq) {
+  struct task_struct *tsk;
+  unsigned long prio = find_next_bit(rq->bitmap, MAX_PRIO, 0);
+
+  if(prio >= MAX_PRIO)
+    return rq->idle;
+  tsk = container_of(list_next(rq->task_queue + prio), struct task_struct, list);
+  list_del(&tsk->list);
+  if(list_is_empty(rq->task_queue + prio))
+    bitmap_clear(rq->bitmap, prio, 1);
+  rq->running_task_count--;
+  return tsk;
+}
+
+/**
+ * @brief 为新进程选择运行的 CPU
+ * 选择就绪进程最少的在线 CPU，数量相同时优先选择编号小的
+ */
+long select_task_cpu() {
+  long best = 0;
+  for(long cpu = 1; cpu < NR_CPUS; ++cpu) {
+    if(!cpu_online(cpu))
+      continue;
+    if(task_schedule[cpu].running_task_count < task_schedule[best].running_task_count)
+      best = cpu;
+  }
+  return best;
+}
+
+/**
+ * @brief 将进程设置为运行状态并加入所在 CPU 的就绪队列
+ * 被唤醒的进程优先级比当前进程高时，当前进程会在中断返回或者下一次调用 schedule 时被抢占
+ * 进程位于其他 CPU 时，对方空闲或者正在运行的进程优先级更低才发送 IPI，
+ * 由对方在 check_preempt_curr 中设置 PF_NEED_SCHEDULE，不需要等到时间片用完；
+ * 对方的当前进程可能在发送之前就已经切换，这种情况下 IPI 只会引起一次多余的检查
+ */
+void wakeup_process(struct task_struct *tsk) {
+  struct schedule *rq = task_schedule + tsk->cpu_id;
+  unsigned long flags;
+
+  spin_lock_irqsave(&rq->lock, flags);
+  tsk->state = TASK_RUNNING;
+  enqueue_task(rq, tsk);
+  if(tsk->cpu_id == smp_processor_id()) {
+    if(current == rq->idle || tsk->priority < current->priority)
+      current->flags |= PF_NEED_SCHEDULE;
+  } else if(cpu_data[tsk->cpu_id].current_task == rq->idle ||
+            tsk->priority < cpu_data[tsk->cpu_id].current_task->priority) {
+    apic_send_ipi(cpu_data[tsk->cpu_id].apic_id, APIC_INT_ASSERT | APIC_DM_FIXED | IPI_RESCHEDULE_VECTOR);
+  }
+  spin_unlock_irqrestore(&rq->lock, flags);
+}
+
+/**
+ * @brief 处理 IPI_RESCHEDULE_VECTOR，在目标 CPU 上调用
+ * 当前进程是 0 号进程，或者就绪队列中有优先级更高的进程时，在中断返回时调度
+ */
+void check_preempt_curr() {
+  struct task_struct *tsk = current;
+  struct schedule *rq = this_cpu_read(rq);
+
+  if(tsk == rq->idle || find_next_bit(rq->bitmap, MAX_PRIO, 0) < tsk->priority)
+    tsk->flags |= PF_NEED_SCHEDULE;
+}
+
+/* 由时钟中断调用，消耗当前进程的时间片 */
+void scheduler_tick() {
+  struct task_struct *tsk = current;
+  struct schedule *rq = this_cpu_read(rq);
+
+  if(tsk == rq->idle) {
+    if(rq->running_task_count)
+      tsk->flags |= PF_NEED_SCHEDULE;
+    return;
+  }
+  if(--tsk->counter <= 0)
+    tsk->flags |= PF_NEED_SCHEDULE;
+}
+
+/**
+ * @brief 进程调度
+ * 1. 当前进程仍处于运行状态时放回就绪队列，时间片用完的进程重新获得一个时间片
+ * 2. 从就绪队列中取出优先级最高的进程切换执行
+ * 0 号进程不进入就绪队列，只在没有其他进程可以运行时执行
+ * 放回队列的 prev 只能被本 CPU 取出，所以切换之前就可以释放队列锁
+ */
+void schedule() {
+  struct task_struct *prev = current, *next;
+  struct schedule *rq = this_cpu_read(rq);
+  unsigned long flags;
+
+  spin_lock_irqsave(&rq->lock, flags);
+  prev->flags &= ~PF_NEED_SCHEDULE;
+  if(prev != rq->idle && prev->state == TASK_RUNNING) {
+    if(prev->counter <= 0)
+      prev->counter = TASK_TIMESLICE(prev);
+    enqueue_task(rq, prev);
+  }
+  next = dequeue_task(rq);
+  spin_unlock(&rq->lock);
+  if(prev == rq->idle && next != prev)
+    tick_nohz_idle_exit();
+  if(next != prev) {
+    this_cpu_inc(switch_count);
+    switch_to(prev, next);
+  }
+  local_irq_restore(flags);
+}
+
+/**
+ * @brief 每个 CPU 的 0 号进程在初始化完成后执行的空闲循环
+ * 就绪队列为空时停止时钟节拍并进入低功耗状态，直到中断、IPI 或者就绪队列被修改时唤醒：
+ * 1. 支持 MONITOR/MWAIT（CPUID.01H:ECX[3]）时监视 running_task_count 所在的缓存行，
+ *    monitor 之后再检查一次队列，入队发生在 monitor 之前也不会错过
+ * 2. 否则执行 hlt
+ * sti 的下一条指令执行完之前不会响应中断，检查队列到 hlt/mwait 之间到来的中断不会丢失
+ */
+void cpu_idle() {
+  struct schedule *rq = this_cpu_read(rq);
+  unsigned int a, b, c, d;
+  int mwait;
+
+  get_cpuid(1, 0, &a, &b, &c, &d);
+  mwait = (c >> 3) & 1;
+
+  while(1) {
+    cli();
+    if(!rq->running_task_count && !(current->flags & PF_NEED_SCHEDULE)) {
+      tick_nohz_idle_enter();
+      if(mwait) {
+        __asm__ __volatile__("monitor \n\t" : : "a"(&rq->running_task_count), "c"(0), "d"(0));
+        if(!rq->running_task_count)
+          __asm__ __volatile__("sti \n\t"
+                               "mwait \n\t"
+                               : : "a"(0), "c"(0) : "memory");
+        else
+          sti();
+      } else {
+        __asm__ __volatile__("sti \n\t"
+                             "hlt \n\t"
+                             : : : "memory");
+      }
+    } else {
+      sti();
+    }
+    if(rq->running_task_count || (current->flags & PF_NEED_SCHEDULE))
+      schedule();
+  }
+}
@@ -1,51 +1,168 @@
 #include "task.h"
+#include "fpu.h"
 #include "gate.h"
 #include "lib.h"
 #include "linkage.h"
 #include "mem.h"
 #include "printk.h"
 #include "ptrace.h"
+#include "schedule.h"
+#include "slab.h"
+#include "smp.h"
+#include "softirq.h"
 #include "system_call.h"
+#include "vdso.h"
 
 extern void ret_from_intr(void);
 extern void ret_system_call(void);
 extern void system_call(void);
+extern void system_call_fast(void);
 
 /**
  * @brief 根据 regs 中保存的系统调用号，分发系统调用处理函数
+ * 也被 sys_uring_enter 用来执行提交队列中的请求
  * 
  * @param regs 上下文参数
  */
-unsigned long system_call_function(struct pt_regs *regs) {
+unsigned long do_system_call(struct pt_regs *regs) {
+	if(regs->rax >= MAX_SYSTEM_CALL_NR)
+		return no_system_call(regs);
 	return system_call_table[regs->rax](regs);
 }
 
+/* 系统调用入口 system_call 和 system_call_fast 调用的函数 */
+unsigned long system_call_function(struct pt_regs *regs) {
+	this_cpu_inc(syscall_count);
+	return do_system_call(regs);
+}
+
 /**
  * @brief 执行系统调用的过程
- * 1. 用户层将执行完系统调用的返回地址保存到 RDX，将执行完系统调用的栈地址保存到 RCX
- * 2. 指定系统调用号
- * 3. 执行 SYSENTER 执行系统调用
- * 4.1 SYSENTER 指令会从 IA32_SYSENTER_EIP 上取得系统调用的入口地址
- * 4.2 SYSENTER 指令从 IA32_ENTER_ESP 上取得系统调用使用的 RSP
- * 4.3 SYSENTER 指令从 IA32_ENTER_CS 上取得 SS, CS 段选择子，并设置段描述符
- * 5. 进入系统调用入口地址函数 system_call，该函数会保存通用寄存器
- * 6. 调用 system_call_function，根据系统调用号分配处理函数，然后执行系统调用处理函数
+ * 1. 用户层在 RAX 中指定系统调用号，参数依次放在 RDI、RSI、RDX、R10、R8、R9 中
+ * 2. 执行 SYSCALL 进入内核层
+ * 2.1 SYSCALL 指令把返回地址保存到 RCX，把 RFLAGS 保存到 R11，然后用 IA32_FMASK 屏蔽 RFLAGS 中的位
+ * 2.2 SYSCALL 指令从 IA32_LSTAR 上取得系统调用的入口地址，从 IA32_STAR[47:32] 上取得 CS 和 SS
+ * 2.3 SYSCALL 指令不会切换栈，由入口函数 system_call_fast 切换到进程的内核栈
+ * 3. system_call_fast 只保存会被 C 函数破坏的寄存器，然后调用 system_call_function 分发系统调用
+ * 4. 执行 SYSRET 返回用户层，RCX 和 R11 的值会被破坏
+ * 旧的 SYSENTER 入口 system_call 仍然保留
  */
 void user_level_function() {
-  color_printk(RED, BLACK, "user_level_function task is running\n");
   long ret = 0;
+  char banner[] = "user_level_function task is running\n";
   char string[] = "Hello World!\n";
 
-  __asm__ __volatile__("leaq	sysexit_return_address(%%rip),	%%rdx	\n\t"		/* 设置返回地址到 RDX 寄存器，SYSEXIT 指令会把它加载到 RIP 寄存器 */
-                       "movq	%%rsp,	%%rcx	\n\t"														/* 设置用户层的栈顶寄存器到 RDX，SYSEXIT 指令会把它加载到 RSP 寄存器 */
-                       "sysenter	\n\t"																			/* 执行 SYSENTER 指令，进入内核层 */
-                       "sysexit_return_address:	\n\t"												/* 系统调用执行完毕的返回地址 */
-                       : "=a"(ret)																					/* 系统调用执行的返回结果保存在 rax 中，并赋值给 ret */
-                       : "0"(1), "D"(string)															  /* rax 保存系统调用号 */
-                       : "memory");
-  // color_printk(RED, BLACK, "user_level_function task called sysenter, ret:%ld\n", ret);
-  while (1)
-    ;
+  /* 这段代码被复制到应用层执行，只能通过系统调用进入内核，输出都经过 sys_write 检查 */
+  __asm__ __volatile__("syscall \n\t"                 /* write(1, banner, len) */
+                       : "=a"(ret)
+                       : "0"(1), "D"(1), "S"(banner), "d"(sizeof(banner) - 1)
+                       : "rcx", "r11", "memory");
+  __asm__ __volatile__("syscall \n\t"                 /* write(1, string, len) */
+                       : "=a"(ret)                     /* 系统调用执行的返回结果保存在 rax 中 */
+                       : "0"(1), "D"(1), "S"(string), "d"(sizeof(string) - 1)  /* rax 保存系统调用号 */
+                       : "rcx", "r11", "memory");
+  __asm__ __volatile__("syscall \n\t"                 /* 调用 sys_exit 结束进程，不会返回 */
+                       :
+                       : "a"(2), "D"(ret)
+                       : "rcx", "r11", "memory");
+}
+
+/* 应用程序的代码和栈在应用层的位置 */
+#define USER_CODE_ADDR 0x800000UL
+#define USER_STACK_TOP 0xa00000UL
+#define USER_STACK_SIZE (PAGE_4K_SIZE * 16)
+
+/* 地址空间描述符缓存 */
+struct kmem_cache *mm_cachep = NULL;
+
+/* 进程内核栈缓存，每个对象是一个 STACK_SIZE 对齐的 task_union */
+struct kmem_cache *task_union_cachep = NULL;
+
+/* 创建一个只包含内核层映射的地址空间 */
+static struct mm_struct *mm_alloc() {
+  struct mm_struct *mm = (struct mm_struct *)kmem_cache_alloc(mm_cachep);
+  if(mm == NULL)
+    return NULL;
+  memset(mm, 0, sizeof(struct mm_struct));
+  mm->pgd = (pml4t_t *)pgd_alloc();
+  if(mm->pgd == NULL) {
+    kmem_cache_free(mm_cachep, mm);
+    return NULL;
+  }
+  mm->pcid = pcid_alloc();
+  mm->pcid_stale = ~0UL;
+  mm->users = 1;
+  list_init(&mm->mmap);
+  spin_init(&mm->page_table_lock);
+  return mm;
+}
+
+/**
+ * @brief 减少地址空间的使用者数量，最后一个使用者释放应用层的页面、页表、PCID 和 mm_struct
+ * 调用者需要先切换到其他地址空间；共享地址空间的线程都在同一个 CPU 上，
+ * 计数归零时没有 CPU 正在使用它的页表，PCID 残留的 TLB 表项由下一个使用者在加载时刷新
+ */
+static void mmput(struct mm_struct *mm) {
+  long users;
+
+  if(mm == &init_mm)
+    return;
+  __asm__ __volatile__("lock xaddq %0, %1 \n\t" : "=r"(users), "+m"(mm->users) : "0"(-1L) : "memory");
+  if(users != 1)
+    return;
+  exit_mmap(mm);
+  pgd_free((unsigned long *)mm->pgd);
+  pcid_free(mm->pcid);
+  kmem_cache_free(mm_cachep, mm);
+}
+
+/**
+ * @brief 切换到地址空间 mm 的页表
+ * 启用 PCID 后保留 TLB 表项，只有 PCID 分配之后在每个 CPU 上的第一次加载需要刷新，
+ * 共用的 PCID_SHARED 每次加载都刷新
+ */
+static void switch_mm(struct mm_struct *mm) {
+  unsigned long cpu_bit = 1UL << smp_processor_id();
+
+  load_cr3((unsigned long)mm->pgd, mm->pcid, (mm->pcid_stale & cpu_bit) || mm->pcid == PCID_SHARED);
+  if(mm->pcid_stale & cpu_bit)
+    __asm__ __volatile__("lock andq %1, %0 \n\t" : "+m"(mm->pcid_stale) : "r"(~cpu_bit) : "memory");
+}
+
+/**
+ * @brief 为新进程准备地址空间
+ * 1. 内核线程和带有 CLONE_VM 标志的进程与父进程共享地址空间
+ * 2. 否则创建新的地址空间，内核层共享，应用层通过 dup_mmap 以写时复制的方式复制，
+ *    复制失败时 dup_mmap 已经撤销了对父进程页面的修改，这里释放新的地址空间
+ */
+static int copy_mm(unsigned long clone_flags, struct task_struct *tsk) {
+  struct mm_struct *mm;
+
+  if((clone_flags & CLONE_VM) || current->mm == &init_mm) {
+    tsk->mm = current->mm;
+    if(tsk->mm != &init_mm)
+      __asm__ __volatile__("lock incq %0 \n\t" : "+m"(tsk->mm->users) : : "memory");
+    return 0;
+  }
+  mm = mm_alloc();
+  if(mm == NULL)
+    return -1;
+  mm->start_code = current->mm->start_code;
+  mm->end_code = current->mm->end_code;
+  mm->start_data = current->mm->start_data;
+  mm->end_data = current->mm->end_data;
+  mm->start_rodata = current->mm->start_rodata;
+  mm->end_rodata = current->mm->end_rodata;
+  mm->start_brk = current->mm->start_brk;
+  mm->end_brk = current->mm->end_brk;
+  mm->start_stack = current->mm->start_stack;
+  if(dup_mmap(mm, current->mm)) {
+    color_printk(RED, BLACK, "copy_mm()->dup_mmap() ERROR\n");
+    mmput(mm);
+    return -1;
+  }
+  tsk->mm = mm;
+  return 0;
 }
 
 /**
@@ -56,18 +173,45 @@ void user_level_function() {
  * @return unsigned long 
  */
 unsigned long do_execve(struct pt_regs *regs) {
-	/**
-	 * 0x800000 的选择只要是一个未使用的内存空间都可以，
-	 * 0xa00000 是为了与 0x800000 在同一个物理页内
-	 */
-	regs->rdx = 0x800000;		/* SYSEXIT 指令会使用 RDX 寄存器的值作为用户层的 RIP */
-	regs->rcx = 0xa00000;		/* SYSEXIT 指令会使用 RCX 寄存器的值作为用户层的 RSP */
+	struct mm_struct *mm = current->mm;
+	struct page *page;
+
+	fpu_release(current);   /* 新程序从 FPU 的初始状态开始 */
+
+	/* 内核线程使用的是 init_mm，为它创建自己的地址空间 */
+	if(mm == &init_mm) {
+		mm = mm_alloc();
+		if(mm == NULL)
+			return -1;
+		current->mm = mm;
+		switch_mm(mm);
+	}
+
+	regs->rdx = USER_CODE_ADDR;		/* SYSEXIT 指令会使用 RDX 寄存器的值作为用户层的 RIP */
+	regs->rcx = USER_STACK_TOP;		/* SYSEXIT 指令会使用 RCX 寄存器的值作为用户层的 RSP */
 	regs->rax = 1;					/* 系统调用的返回值 */
 	regs->ds = regs->es = 0;
 	color_printk(RED, BLACK, "do_execve task is running\n");
 
-	/* 将用户层的执行函数复制到用户层的第一条指令开始地址处 */
-	memcpy(user_level_function, (void *)regs->rdx, 1024);
+	/**
+	 * 将用户层的执行函数复制到代码页中，代码页只读；栈页面在访问时由缺页异常分配
+	 * 同时只读映射 vdso_data，应用层不需要系统调用就可以读取时间和 CPU 编号
+	 */
+	page = alloc_pages_4k(1, PG_PTable_Maped | PG_Active);
+	if(page == NULL)
+		return -1;
+	memcpy(user_level_function, phy_to_virt(page->PHY_address), 1024);
+	if(insert_vma(mm, USER_CODE_ADDR, USER_CODE_ADDR + PAGE_4K_SIZE, VM_READ | VM_EXEC) == NULL ||
+	   insert_vma(mm, USER_STACK_TOP - USER_STACK_SIZE, USER_STACK_TOP, VM_READ | VM_WRITE) == NULL ||
+	   vdso_map(mm) ||
+	   map_pages((unsigned long *)mm->pgd, USER_CODE_ADDR, page->PHY_address, PAGE_4K_SIZE,
+	             PAGE_U_S | PAGE_Present)) {
+		free_pages_4k(page, 1);
+		return -1;
+	}
+	mm->start_code = USER_CODE_ADDR;
+	mm->end_code = USER_CODE_ADDR + PAGE_4K_SIZE;
+	mm->start_stack = USER_STACK_TOP;
 	return 0;
 }
 
@@ -83,6 +227,10 @@ unsigned long do_execve(struct pt_regs *regs) {
 unsigned long init(unsigned long arg) {
   struct pt_regs *regs;
   color_printk(RED, BLACK, "init task is running,arg:%#018lx\n", arg);
+
+  /* 启动阶段只初始化了部分 page 结构体，在这里完成剩余的部分 */
+  deferred_memory_init();
+  smp_init();
 	
 	/* do_execve 的返回地址 */
   current->thread->rip = (unsigned long)ret_system_call;
@@ -111,33 +259,64 @@ void __switch_to(struct task_struct *prev, struct task_struct *next) {
    * 
    * 一个 CPU 只有一个 TSS，TR 寄存器永远指向那个地址
    */
-  init_tss[0].rsp0 = next->thread->rsp0;
-  /* 更新当前 CPU 的 TSS 段 */
-  set_tss64(init_tss[0].rsp0, init_tss[0].rsp1, init_tss[0].rsp2,
-            init_tss[0].ist1, init_tss[0].ist2, init_tss[0].ist3,
-            init_tss[0].ist4, init_tss[0].ist5, init_tss[0].ist6,
-            init_tss[0].ist7);
-  /* 保存当前进程的 fs, gs 数据段寄存器 */
-  __asm__ __volatile__("movq %%fs, %0 \n\t" : "=a"(prev->thread->fs));
-  __asm__ __volatile__("movq %%gs, %0 \n\t" : "=a"(prev->thread->gs));
+  struct tss_struct *tss = this_cpu_read(tss);
+
+  this_cpu_write(current_task, next);
+  tss->rsp0 = next->thread->rsp0;
+  /* BSP 的 TR 指向 head.S 中的 TSS64_Table，AP 的 TR 直接指向 init_tss 数组中的表项 */
+  if(tss == init_tss)
+    set_tss64(init_tss[0].rsp0, init_tss[0].rsp1, init_tss[0].rsp2,
+              init_tss[0].ist1, init_tss[0].ist2, init_tss[0].ist3,
+              init_tss[0].ist4, init_tss[0].ist5, init_tss[0].ist6,
+              init_tss[0].ist7);
+  switch_fpu(prev, next);
+
+  /* 同一个进程的线程共享地址空间，只有地址空间变化的时候才需要切换页表 */
+  if(prev->mm != next->mm)
+    switch_mm(next->mm);
+
+  /* SYSENTER 指令使用的内核栈也要切换到 next 进程的内核栈 */
+  wrmsr(IA32_SYSENTER_ESP, next->thread->rsp0);
 
-  /* 设置 fs, gs 数据段寄存器为 next 进程的上下文 */
+  /* 保存当前进程的 fs 数据段寄存器，并设置为 next 进程的上下文 */
+  __asm__ __volatile__("movq %%fs, %0 \n\t" : "=a"(prev->thread->fs));
   __asm__ __volatile__("movq %0, %%fs \n\t" :: "a"(next->thread->fs));
-  __asm__ __volatile__("movq %0, %%gs \n\t" :: "a"(next->thread->gs));
+  /**
+   * 不能重新加载 gs 段寄存器，否则 IA32_GS_BASE 会被清零而丢失 cpu_data；
+   * 应用层无法修改 GS 基地址（没有开启 CR4.FSGSBASE），所有进程的应用层 GS 基地址都是 0，不需要切换
+   */
 
-  color_printk(WHITE, BLACK, "prev->thread->rsp0:%#018lx\n", prev->thread->rsp0);
-  color_printk(WHITE, BLACK, "next->thread->rsp0:%#018lx\n", next->thread->rsp0);
+  /* 这里已经运行在 next 的内核栈上，退出的进程不会再被调度，回收它的 task_union */
+  if(prev->state == TASK_ZOMBIE)
+    kmem_cache_free(task_union_cachep, prev);
 }
 
 /**
  * @brief task_struct 释放函数
+ * 1. 释放 FPU 保存区，切换到 init_mm 之后释放自己的地址空间
+ * 2. 内核栈在切换到下一个进程之后由 __switch_to 回收
  * 
  * @param code 进程执行的返回值
  * @return unsigned long 
  */
 unsigned long do_exit(unsigned long code) {
+  struct mm_struct *mm = current->mm;
+  unsigned long flags;
+
   color_printk(RED, BLACK, "exit task is running, arg:%#018lx\n", code);
-  while(1);
+  fpu_release(current);
+  if(mm != &init_mm) {
+    local_irq_save(flags);
+    current->mm = &init_mm;
+    switch_mm(&init_mm);
+    local_irq_restore(flags);
+    mmput(mm);
+  }
+  /* 进程不再回到就绪队列，schedule 切换走之后不会再被执行 */
+  cli();
+  current->state = TASK_ZOMBIE;
+  while(1)
+    schedule();
 }
 
 /**
@@ -175,40 +354,59 @@ __asm__("kernel_thread_func:  \n\t"
         "movq %rax, %es \n\t"
         "popq %rax  \n\t"
         "addq $0x38,  %rsp \n\t"	/* 0x38 = 56 直接跳过了栈中 pt_regs 从 func 开始的最后 7 个数据 */
+        "sti  \n\t"               /* 从中断返回路径上的 schedule 切换过来时中断仍处于关闭状态 */
         "movq %rdx, %rdi  \n\t"
         "callq  *%rbx \n\t"
         "movq %rax, %rdi  \n\t" 	/* call *rbx 的返回值保存到 rdi 作为下一个函数的参数 */
         "callq  do_exit \n\t");
 
+/* 清空新分配的 task_struct 以及紧随其后的 thread_struct */
+static void task_union_ctor(void *obj) {
+  memset(obj, 0, sizeof(struct task_struct) + sizeof(struct thread_struct));
+}
+
 /* 初始化进程的 task_struct 和 thread_struct 结构体 */
 unsigned long do_fork(struct pt_regs *regs, unsigned long clone_flags,
                       unsigned long stack_start, unsigned long stack_size) {
   struct task_struct *tsk = NULL;   /* 进程描述符 */
   struct thread_struct *thd = NULL; /* 进程执行现场 */
-  struct page *p = NULL;
 
-  /* 首先分配一页内存，用来保存 tsk 和 thd */
-  color_printk(WHITE, BLACK, "alloc_pages,bitmap:%#018lx\n", *memory_management_struct.bits_map);
-  p = alloc_pages(ZONE_NORMAL, 1, PG_PTable_Maped | PG_Active | PG_Kernel);
-  color_printk(WHITE, BLACK, "alloc_pages,bitmap:%#018lx\n", *memory_management_struct.bits_map);
+  /**
+   * 首先从进程内核栈缓存中分配一个 task_union，用来保存 tsk、thd 以及内核栈
+   * 缓存对象按照 STACK_SIZE 对齐，构造函数已经清空了 tsk 和 thd
+   */
+  tsk = (struct task_struct *)kmem_cache_alloc(task_union_cachep);
+  if(tsk == NULL)
+    return -1;
 
   /**
    * @brief 下面开始初始化 task_struct 以及 thread_struct
    * 首先初始化 task_struct
    */
-  tsk = (struct task_struct *)phy_to_virt(p->PHY_address);  /* tsk 保存在分配得到的物理页起始位置 */
   color_printk(WHITE, BLACK, "struct task_struct address:%#018lx\n", (unsigned long)tsk);
-  memset(tsk, 0, sizeof(*tsk)); /* 清空 tsk */
   *tsk = *current;              /* copy 0 号进程的描述符 */
   list_init(&tsk->list);        /* 初始化 tsk 的列表 */
-  list_add_to_before(&init_task_union.task.list, &tsk->list); /* 加入进程描述符队列的尾部 */
   tsk->pid++;                   /* 设置进程 ID */
+  tsk->flags &= ~PF_NEED_SCHEDULE;
+  tsk->preempt_count = 0;
+  /* 与父进程共享用户地址空间的线程留在父进程的 CPU 上，TLB 因此不需要跨 CPU 刷新 */
+  if(!(clone_flags & CLONE_CPU) && !((clone_flags & CLONE_VM) && current->mm != &init_mm))
+    tsk->cpu_id = select_task_cpu();
+  if(copy_mm(clone_flags, tsk)) {
+    kmem_cache_free(task_union_cachep, tsk);
+    return -1;
+  }
 
   /**
    * thread_struct 紧接着 task_struct
    */
   thd = (struct thread_struct *)(tsk + 1);
   tsk->thread = thd;
+  if(fpu_fork(tsk)) {
+    mmput(tsk->mm);
+    kmem_cache_free(task_union_cachep, tsk);
+    return -1;
+  }
   
   /* 伪造进程执行现场，将执行现场数据复制到目标进程内核栈顶，这样在恢复现场的时候就可以弹出了 */
   memcpy(regs, (void *)((unsigned long)tsk + STACK_SIZE - sizeof(struct pt_regs)), sizeof(struct pt_regs));
@@ -220,7 +418,8 @@ unsigned long do_fork(struct pt_regs *regs, unsigned long clone_flags,
   if(!(tsk->flags & PF_KTHREAD))
     thd->rip = regs->rip = (unsigned long)ret_system_call;  /* 这里更改 RIP 并不会影响已经保存在栈上的寄存器值(memcpy 那一行) */
 
-  tsk->state = TASK_RUNNING;  /* 设置进程的状态 */
+  tsk->counter = TASK_TIMESLICE(tsk);   /* 新进程获得一个完整的时间片 */
+  wakeup_process(tsk);                  /* 设置进程的状态并加入就绪队列 */
   return 0;
 }
 
@@ -239,14 +438,32 @@ int kernel_thread(unsigned long (*fn)(unsigned long), unsigned long arg, unsigne
   return do_fork(&regs, flags, 0, 0);
 }
 
-void task_init() {
-  struct task_struct *p = NULL;
+/**
+ * @brief 设置当前 CPU 系统调用入口相关的 MSR，BSP 在 task_init 中调用，AP 在 Start_SMP 中调用
+ * 1. SYSENTER：IA32_SYSENTER_CS 同时决定 SYSEXIT 返回时的 CS 和 SS，IA32_SYSENTER_ESP 在进程切换时更新
+ * 2. SYSCALL：IA32_STAR[47:32] 为内核 CS（SS 为其 + 8），IA32_STAR[63:48] 为 0x18，
+ *    SYSRET 返回 64 位模式时 CS 为 0x18 + 16 即 0x2b，SS 为 0x18 + 8 即 0x23，对应 GDT 的第 5 和第 4 项
+ * 3. IA32_FMASK 在进入内核时清除 IF、TF、DF 和 AC，切换到内核栈之前不会响应中断
+ */
+void syscall_init() {
+  wrmsr(IA32_SYSENTER_CS, KERNEL_CS);
+  wrmsr(IA32_SYSENTER_ESP, current->thread->rsp0);
+  wrmsr(IA32_SYSENTER_EIP, (unsigned long)system_call);
+
+  wrmsr(IA32_EFER, rdmsr(IA32_EFER) | EFER_SCE);
+  wrmsr(IA32_STAR, (0x18UL << 48) | ((unsigned long)KERNEL_CS << 32));
+  wrmsr(IA32_LSTAR, (unsigned long)system_call_fast);
+  wrmsr(IA32_FMASK, 0x40700);
+}
 
+void task_init() {
   /**
    * @brief 0 号进程不存在用户层空间
    * 它的 mm_struct 保存的不是应用程序的信息，而是内核程序的各个段信息以及内核层的段基地址
    */
   init_mm.pgd = (pml4t_t *)Global_CR3;
+  list_init(&init_mm.mmap);
+  spin_init(&init_mm.page_table_lock);
   init_mm.start_code = memory_management_struct.start_code;
   init_mm.end_code = memory_management_struct.end_code;
   init_mm.start_data = (unsigned long)&_data;
@@ -257,12 +474,10 @@ void task_init() {
   init_mm.end_brk = memory_management_struct.end_brk;
   init_mm.start_stack = _stack_start;
 
-	/* 设置 IA32_SYSENTER_CS 寄存器，SYSENTER 和 SYSEXIT 指令都会用到 */
-	wrmsr(0x174, KERNEL_CS);
-	/* IA32_SYSENTER_ESP，SYSENTER 指令会将该寄存器里面的值载入到 RSP 寄存器中 */
-	wrmsr(0x175, current->thread->rsp0);
-	/* IA32_ENTER_EIP，SYSENTER 指令会将该寄存器的值载入到 RIP 寄存器中 */
-	wrmsr(0x176, (unsigned long)system_call);
+  task_union_cachep = kmem_cache_create("task_union", STACK_SIZE, STACK_SIZE, task_union_ctor, NULL);
+  mm_cachep = kmem_cache_create("mm_struct", sizeof(struct mm_struct), 0, NULL, NULL);
+
+  syscall_init();
 
   /* 初始化内存中的 TSS */
   set_tss64(init_thread.rsp0, init_tss[0].rsp1, init_tss[0].rsp2,
@@ -274,8 +489,10 @@ void task_init() {
   /* 在创建系统第一个 task_struct 的时候没有初始化 list，这里初始化一下 */
   list_init(&init_task_union.task.list);
 
-  kernel_thread(init, 10, CLONE_FS | CLONE_FILES | CLONE_SIGNAL);
   init_task_union.task.state = TASK_RUNNING;  /* 设置当前进程状态 */
-  p = container_of(list_next(&current->list), struct task_struct, list);  /* 获取下一个进程准备切换执行 */
-  switch_to(current, p);
+  kernel_thread(init, 10, CLONE_FS | CLONE_FILES | CLONE_SIGNAL);
+  ksoftirqd_init();
+  console_init();
+  /* 0 号进程让出处理器，之后只在就绪队列为空时运行 */
+  schedule();
 }
\ No newline at end of file
@@ -0,0 +1,101 @@
+#include "uring.h"
+#include "lib.h"
+#include "mem.h"
+#include "printk.h"
+#include "ptrace.h"
+#include "task.h"
+
+/**
+ * @brief 为当前地址空间创建环形队列，并映射到应用层的 URING_ADDR 处
+ * 队列页面从 4K 页池中连续分配，内核通过直接映射区访问，不依赖当前页表；
+ * 区域带有 VM_DONTCOPY，fork 出的子进程不会继承，页面也就不会变成写时复制
+ * 页面随地址空间释放：最后一个使用者退出时 mmput 调用 exit_mmap 解除映射并归还页面
+ * 同一个地址空间的多个线程可能同时调用，检查和建立映射都在 mm->page_table_lock 中完成
+ *
+ * @return unsigned long 队列在应用层的地址，失败返回 -1
+ */
+unsigned long sys_uring_setup(struct pt_regs *regs) {
+  struct mm_struct *mm = current->mm;
+  struct page *page;
+  unsigned long flags;
+
+  if(mm == &init_mm)
+    return -1;
+  if(mm->uring)
+    return URING_ADDR;
+
+  page = alloc_pages_4k(URING_PAGES, PG_PTable_Maped | PG_Active);
+  if(page == NULL)
+    return -1;
+  memset(phy_to_virt(page->PHY_address), 0, URING_PAGES * PAGE_4K_SIZE);
+  spin_lock_irqsave(&mm->page_table_lock, flags);
+  if(mm->uring) {   /* 其他线程已经创建了队列 */
+    spin_unlock_irqrestore(&mm->page_table_lock, flags);
+    free_pages_4k(page, URING_PAGES);
+    return URING_ADDR;
+  }
+  if(insert_vma(mm, URING_ADDR, URING_ADDR + URING_PAGES * PAGE_4K_SIZE,
+                VM_READ | VM_WRITE | VM_DONTCOPY) == NULL ||
+     map_pages((unsigned long *)mm->pgd, URING_ADDR, page->PHY_address, URING_PAGES * PAGE_4K_SIZE,
+               PAGE_U_S | PAGE_R_W | PAGE_Present)) {
+    spin_unlock_irqrestore(&mm->page_table_lock, flags);
+    color_printk(RED, BLACK, "sys_uring_setup() ERROR: pid: %ld\n", current->pid);
+    free_pages_4k(page, URING_PAGES);
+    return -1;
+  }
+  mm->uring = (struct uring *)phy_to_virt(page->PHY_address);
+  spin_unlock_irqrestore(&mm->page_table_lock, flags);
+  return URING_ADDR;
+}
+
+/**
+ * @brief 依次执行提交队列中最多 rdi 个请求，结果写入完成队列
+ * 1. 完成队列已满时停止，剩余的请求留在提交队列中
+ * 2. head 和 tail 都可以被应用层任意修改，内核只通过按位与之后的下标访问队列，不会越界；
+ *    一次最多处理 URING_SQ_ENTRIES 个请求
+ * 3. 请求中不能再嵌套 uring_setup 和 uring_enter
+ *
+ * @return unsigned long 处理的请求数量，没有创建队列时返回 -1
+ */
+unsigned long sys_uring_enter(struct pt_regs *regs) {
+  struct uring *ring = current->mm->uring;
+  unsigned long to_submit = regs->rdi, done = 0;
+  unsigned int head, tail, cq_tail;
+  struct pt_regs call;
+
+  if(ring == NULL)
+    return -1;
+  if(to_submit > URING_SQ_ENTRIES)
+    to_submit = URING_SQ_ENTRIES;
+  head = ring->sq.head;
+  tail = ring->sq.tail;
+  cq_tail = ring->cq.tail;
+  __asm__ __volatile__("" ::: "memory");
+
+  memset(&call, 0, sizeof(call));
+  while(done < to_submit && head != tail && cq_tail - ring->cq.head < URING_CQ_ENTRIES) {
+    struct uring_sqe *sqe = ring->sqes + (head & (URING_SQ_ENTRIES - 1));
+    struct uring_cqe *cqe = ring->cqes + (cq_tail & (URING_CQ_ENTRIES - 1));
+
+    call.rax = sqe->opcode;
+    call.rdi = sqe->args[0];
+    call.rsi = sqe->args[1];
+    call.rdx = sqe->args[2];
+    call.r10 = sqe->args[3];
+    call.r8 = sqe->args[4];
+    call.r9 = sqe->args[5];
+    cqe->user_data = sqe->user_data;
+    if(call.rax == NR_URING_SETUP || call.rax == NR_URING_ENTER)
+      cqe->res = -1;
+    else
+      cqe->res = do_system_call(&call);
+
+    head++;
+    cq_tail++;
+    done++;
+    __asm__ __volatile__("" ::: "memory");
+    ring->sq.head = head;
+    ring->cq.tail = cq_tail;
+  }
+  return done;
+}
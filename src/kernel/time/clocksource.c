@@ -0,0 +1,53 @@
+#include "timer.h"
+#include "lib.h"
+#include "printk.h"
+
+#define CALIBRATE_MS 10   /* 校准 TSC 时 PIT 计时的长度 */
+
+unsigned long tsc_khz = 0;
+static unsigned long tsc_base = 0;  /* 校准完成时的 TSC，ktime_get_ns 从这里开始计时 */
+
+/**
+ * @brief 使用 PIT 通道 2 校准 TSC 频率
+ * 通道 2 的 GATE 由 0x61 端口的 bit 0 控制，计数结束时 0x61 端口的 bit 5（OUT2）置位；
+ * 模式 0 下写入计数值之后开始计数，期间读取两次 TSC 即可得到 CALIBRATE_MS 毫秒内的 TSC 周期数
+ * 校准期间关闭中断，避免中断处理的时间被计入
+ */
+void tsc_calibrate() {
+  unsigned long latch = PIT_FREQ * CALIBRATE_MS / 1000;
+  unsigned long flags, t0, t1;
+
+  local_irq_save(flags);
+  io_out8(0x61, (io_in8(0x61) & ~0x02) | 0x01);   /* 打开通道 2 的 GATE，关闭扬声器 */
+  io_out8(0x43, 0xb0);                            /* 通道 2，先写低字节再写高字节，模式 0 */
+  io_out8(0x42, latch & 0xff);
+  io_out8(0x42, (latch >> 8) & 0xff);
+  t0 = rdtsc();
+  while(!(io_in8(0x61) & 0x20))
+    ;
+  t1 = rdtsc();
+  local_irq_restore(flags);
+
+  tsc_khz = (t1 - t0) / CALIBRATE_MS;
+  tsc_base = t1;
+  color_printk(RED, BLACK, "TSC calibrated: %ld.%03ld MHz\n", tsc_khz / 1000, tsc_khz % 1000);
+}
+
+/* TSC 周期数转换为纳秒，先除后乘避免溢出 */
+unsigned long tsc_to_ns(unsigned long cycles) {
+  if(!tsc_khz)
+    return 0;
+  return cycles / tsc_khz * 1000000 + cycles % tsc_khz * 1000000 / tsc_khz;
+}
+
+/* TSC 值 tsc 对应的校准完成以来的纳秒数 */
+unsigned long tsc_to_ktime(unsigned long tsc) {
+  return tsc_to_ns(tsc - tsc_base);
+}
+
+/* 校准完成以来的纳秒数，校准之前按照时钟节拍计算 */
+unsigned long ktime_get_ns() {
+  if(!tsc_khz)
+    return jiffies * (1000000000 / HZ);
+  return tsc_to_ktime(rdtsc());
+}
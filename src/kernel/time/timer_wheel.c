@@ -0,0 +1,236 @@
+#include "timer.h"
+#include "cpu.h"
+#include "lib.h"
+#include "percpu.h"
+#include "printk.h"
+#include "schedule.h"
+#include "softirq.h"
+#include "spinlock.h"
+#include "task.h"
+
+/**
+ * 分层时间轮，每个 CPU 一个
+ * tv1 有 256 个槽，每个槽对应一个时钟节拍；tvn[0..3] 各有 64 个槽，
+ * tvn[i] 的每个槽覆盖 2^(8 + 6 * i) 个节拍，最远可以表示 2^32 个节拍之后的定时器
+ * timer_jiffies 每次转过 tv1 的一圈时，把上一层的一个槽重新分散到下一层（cascade），
+ * 添加、删除定时器都是 O(1) 的
+ */
+#define TVN_BITS 6
+#define TVR_BITS 8
+#define TVN_SIZE (1 << TVN_BITS)
+#define TVR_SIZE (1 << TVR_BITS)
+#define TVN_MASK (TVN_SIZE - 1)
+#define TVR_MASK (TVR_SIZE - 1)
+
+#define MAX_TIMER_DELTA 0xffffffffUL
+
+struct timer_base {
+  spinlock_t lock;
+  unsigned long timer_jiffies;  /* 下一个要处理的时钟节拍 */
+  struct List tv1[TVR_SIZE];
+  struct List tvn[4][TVN_SIZE];
+};
+
+static struct timer_base timer_bases[NR_CPUS];
+
+/* 根据到期时间把定时器放入对应层的槽中，调用者需要持有 base->lock */
+static void internal_add_timer(struct timer_base *base, struct timer_list *timer) {
+  unsigned long expires = timer->expires;
+  unsigned long idx = expires - base->timer_jiffies;
+  struct List *vec;
+  int level;
+
+  if((long)idx < 0) {   /* 已经过期的定时器在下一个节拍处理 */
+    vec = base->tv1 + (base->timer_jiffies & TVR_MASK);
+  } else if(idx < TVR_SIZE) {
+    vec = base->tv1 + (expires & TVR_MASK);
+  } else {
+    if(idx > MAX_TIMER_DELTA) {
+      idx = MAX_TIMER_DELTA;
+      expires = base->timer_jiffies + idx;
+    }
+    for(level = 0; level < 3 && idx >= 1UL << (TVR_BITS + (level + 1) * TVN_BITS); ++level)
+      ;
+    vec = base->tvn[level] + ((expires >> (TVR_BITS + level * TVN_BITS)) & TVN_MASK);
+  }
+  list_add_to_before(vec, &timer->list);
+}
+
+/* 把 tvn[level] 的第 index 个槽中的定时器重新放入时间轮，返回 index */
+static int cascade(struct timer_base *base, int level, int index) {
+  struct List *head = base->tvn[level] + index;
+  struct timer_list *timer;
+
+  while(!list_is_empty(head)) {
+    timer = container_of(list_next(head), struct timer_list, list);
+    list_del(&timer->list);
+    internal_add_timer(base, timer);
+  }
+  return index;
+}
+
+#define INDEX(base, n) (((base)->timer_jiffies >> (TVR_BITS + (n) * TVN_BITS)) & TVN_MASK)
+
+/**
+ * @brief TIMER_SOFTIRQ 的处理函数，执行本 CPU 上所有已经到期的定时器
+ * 调用定时器处理函数时释放锁，处理函数可以重新添加自己
+ */
+static void run_timers(unsigned long data) {
+  struct timer_base *base = timer_bases + smp_processor_id();
+  struct timer_list *timer;
+  struct List *head;
+  void (*function)(unsigned long);
+  unsigned long flags, arg;
+  int index;
+
+  spin_lock_irqsave(&base->lock, flags);
+  while((long)(jiffies - base->timer_jiffies) >= 0) {
+    index = base->timer_jiffies & TVR_MASK;
+    if(!index && !cascade(base, 0, INDEX(base, 0)) && !cascade(base, 1, INDEX(base, 1)) &&
+       !cascade(base, 2, INDEX(base, 2)))
+      cascade(base, 3, INDEX(base, 3));
+    base->timer_jiffies++;
+    head = base->tv1 + index;
+    while(!list_is_empty(head)) {
+      timer = container_of(list_next(head), struct timer_list, list);
+      list_del(&timer->list);
+      list_init(&timer->list);
+      timer->base = NULL;
+      function = timer->function;
+      arg = timer->data;
+      spin_unlock_irqrestore(&base->lock, flags);
+      function(arg);
+      spin_lock_irqsave(&base->lock, flags);
+    }
+  }
+  spin_unlock_irqrestore(&base->lock, flags);
+}
+
+void init_timers() {
+  for(int cpu = 0; cpu < NR_CPUS; ++cpu) {
+    struct timer_base *base = timer_bases + cpu;
+    spin_init(&base->lock);
+    base->timer_jiffies = jiffies;
+    for(int i = 0; i < TVR_SIZE; ++i)
+      list_init(base->tv1 + i);
+    for(int level = 0; level < 4; ++level)
+      for(int i = 0; i < TVN_SIZE; ++i)
+        list_init(base->tvn[level] + i);
+  }
+  register_softirq(TIMER_SOFTIRQ, run_timers, 0);
+}
+
+/* 把定时器加入当前 CPU 的时间轮，定时器不能处于激活状态 */
+void add_timer(struct timer_list *timer) {
+  struct timer_base *base = timer_bases + smp_processor_id();
+  unsigned long flags;
+
+  if(timer_pending(timer)) {
+    color_printk(RED, BLACK, "add_timer() ERROR: timer is already pending\n");
+    return;
+  }
+  spin_lock_irqsave(&base->lock, flags);
+  timer->base = base;
+  internal_add_timer(base, timer);
+  spin_unlock_irqrestore(&base->lock, flags);
+}
+
+/**
+ * @brief 删除定时器
+ * 不会等待其他 CPU 上正在执行的处理函数结束
+ *
+ * @return int 定时器处于激活状态时返回 1，否则返回 0
+ */
+int del_timer(struct timer_list *timer) {
+  struct timer_base *base = timer->base;
+  unsigned long flags;
+
+  if(base == NULL)
+    return 0;
+  spin_lock_irqsave(&base->lock, flags);
+  if(timer->base != base) {   /* 加锁之前已经被执行 */
+    spin_unlock_irqrestore(&base->lock, flags);
+    return 0;
+  }
+  list_del(&timer->list);
+  list_init(&timer->list);
+  timer->base = NULL;
+  spin_unlock_irqrestore(&base->lock, flags);
+  return 1;
+}
+
+/* 修改定时器的到期时间，返回值与 del_timer 相同 */
+int mod_timer(struct timer_list *timer, unsigned long expires) {
+  int ret = del_timer(timer);
+
+  timer->expires = expires;
+  add_timer(timer);
+  return ret;
+}
+
+/**
+ * @brief 当前 CPU 下一个定时器到期的时钟节拍，供 tick_nohz_idle_enter 设置唤醒时间
+ * 只精确查找 tv1，定时器在更高层时返回 tv1 转完一圈需要 cascade 的节拍，提前唤醒不影响正确性
+ *
+ * @return unsigned long 没有定时器时返回 timer_jiffies + MAX_TIMER_DELTA
+ */
+unsigned long next_timer_interrupt() {
+  struct timer_base *base = timer_bases + smp_processor_id();
+  unsigned long flags, next = 0;
+  int index, i, level;
+
+  spin_lock_irqsave(&base->lock, flags);
+  index = base->timer_jiffies & TVR_MASK;
+  for(i = 0; i < TVR_SIZE; ++i) {
+    if(!list_is_empty(base->tv1 + ((index + i) & TVR_MASK))) {
+      next = base->timer_jiffies + i;
+      goto out;
+    }
+  }
+  next = base->timer_jiffies + MAX_TIMER_DELTA;
+  for(level = 0; level < 4; ++level) {
+    for(i = 0; i < TVN_SIZE; ++i) {
+      if(!list_is_empty(base->tvn[level] + i)) {
+        next = base->timer_jiffies + (TVR_SIZE - index);
+        goto out;
+      }
+    }
+  }
+out:
+  spin_unlock_irqrestore(&base->lock, flags);
+  return next;
+}
+
+static void process_timeout(unsigned long data) {
+  struct task_struct *tsk = (struct task_struct *)data;
+
+  if(tsk->state != TASK_RUNNING)
+    wakeup_process(tsk);
+}
+
+/**
+ * @brief 当前进程睡眠 timeout 个时钟节拍
+ * 定时器加在当前 CPU 上，设置状态到调用 schedule 之间关闭中断，TIMER_SOFTIRQ 不会提前唤醒进程
+ *
+ * @return long 剩余的节拍数，被定时器唤醒时为 0
+ */
+long schedule_timeout(long timeout) {
+  struct timer_list timer;
+  unsigned long expire = jiffies + timeout, flags;
+  long remain;
+
+  if(timeout <= 0)
+    return 0;
+  init_timer(&timer, process_timeout, (unsigned long)current);
+  timer.expires = expire;
+
+  local_irq_save(flags);
+  current->state = TASK_INTERRUPTIBLE;
+  add_timer(&timer);
+  schedule();
+  local_irq_restore(flags);
+
+  del_timer(&timer);
+  remain = expire - jiffies;
+  return remain < 0 ? 0 : remain;
+}
@@ -0,0 +1,82 @@
+#include "vdso.h"
+#include "lib.h"
+#include "mem.h"
+#include "percpu.h"
+#include "printk.h"
+#include "schedule.h"
+#include "smp.h"
+#include "spinlock.h"
+#include "task.h"
+#include "timer.h"
+
+struct vdso_data vdso_data;
+
+/* 可能有多个 CPU 同时推进 jiffies，写者之间用锁互斥，读者只依赖 seq */
+static spinlock_t vdso_lock;
+
+/* 设置当前 CPU 的 IA32_TSC_AUX，BSP 在 vdso_init 中调用，AP 在 Start_SMP 中调用 */
+void vdso_cpu_init() {
+  if(vdso_data.rdtscp)
+    wrmsr(IA32_TSC_AUX, smp_processor_id());
+}
+
+/**
+ * @brief 初始化 vdso_data，需要在 tsc_calibrate 之后调用
+ * RDTSCP 的支持情况由 CPUID.80000001H:EDX[27] 给出
+ */
+void vdso_init() {
+  unsigned int a, b, c, d;
+
+  spin_init(&vdso_lock);
+  memset(&vdso_data, 0, sizeof(vdso_data));
+  if(tsc_khz)
+    vdso_data.mult = (1000000UL << VDSO_SHIFT) / tsc_khz;
+  vdso_data.tsc_khz = tsc_khz;
+  get_cpuid(0x80000000, 0, &a, &b, &c, &d);
+  if(a >= 0x80000001) {
+    get_cpuid(0x80000001, 0, &a, &b, &c, &d);
+    vdso_data.rdtscp = (d >> 27) & 1;
+  }
+  vdso_cpu_init();
+  vdso_update_time();
+  color_printk(RED, BLACK, "vdso init, mult: %ld, rdtscp: %ld\n", vdso_data.mult, vdso_data.rdtscp);
+}
+
+/* 在 jiffies 推进时调用，更新应用层计算时间的基准 */
+void vdso_update_time() {
+  unsigned long flags, cycles;
+
+  spin_lock_irqsave(&vdso_lock, flags);
+  vdso_data.seq++;
+  __asm__ __volatile__("" ::: "memory");
+  cycles = rdtsc();
+  vdso_data.cycle_last = cycles;
+  vdso_data.ns_last = tsc_to_ktime(cycles);
+  vdso_data.jiffies = jiffies;
+  vdso_data.nr_cpus = smp_num_cpus;
+  __asm__ __volatile__("" ::: "memory");
+  vdso_data.seq++;
+  spin_unlock_irqrestore(&vdso_lock, flags);
+}
+
+/* 每个时钟节拍在所有 CPU 上调用，复制本 CPU 的统计计数 */
+void vdso_update_cpu() {
+  struct vdso_cpu_stat *stat = vdso_data.cpu + smp_processor_id();
+
+  stat->irq_count = this_cpu_read(irq_count);
+  stat->syscall_count = this_cpu_read(syscall_count);
+  stat->switch_count = this_cpu_read(switch_count);
+  stat->nr_running = this_cpu_read(rq)->running_task_count;
+}
+
+/**
+ * @brief 把 vdso_data 只读映射到地址空间 mm 的 VDSO_ADDR 处
+ *
+ * @return int 成功返回 0，失败返回 -1
+ */
+int vdso_map(struct mm_struct *mm) {
+  if(insert_vma(mm, VDSO_ADDR, VDSO_ADDR + sizeof(vdso_data), VM_READ) == NULL)
+    return -1;
+  return map_pages((unsigned long *)mm->pgd, VDSO_ADDR, virt_to_phy(&vdso_data), sizeof(vdso_data),
+                   PAGE_U_S | PAGE_Present);
+}
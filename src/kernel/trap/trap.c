@@ -1,5 +1,7 @@
 #include "trap.h"
+#include "fpu.h"
 #include "gate.h"
+#include "mem.h"
 #include "ptrace.h"
 
 /* 0 #DE. 除法错误 */
@@ -8,7 +10,7 @@ void do_divide_error(unsigned long rsp, unsigned long error_code) {
   p = (unsigned long *)(rsp + 0x98); /* 0x98 是 RIP 相对于 RSP 的栈上偏移 */
   /* 显示错误码值、栈指针值、异常产生的程序地址等日志信息 */
   color_printk(RED, BLACK, "do_divide_error(0), ERROR_CODE: %#018lx, RSP: %#018lx, RIP: %#018lx\n", error_code, rsp, *p);
-  while(1);
+  cpu_halt();
 }
 
 /* 2 NMI 不可屏蔽中断 */
@@ -16,7 +18,7 @@ void do_nmi(unsigned long rsp, unsigned long error_code) {
   unsigned long *p = NULL;
   p = (unsigned long *)(rsp + 0x98); /* 0x98 是 RIP 相对于 RSP 的栈上偏移 */
   color_printk(RED, BLACK, "do_nmi(2), ERROR_CODE: %#018lx, RSP: %#018lx, RIP: %#018lx\n", error_code, rsp, *p);
-  while(1);
+  cpu_halt();
 }
 
 /* 10 #TS. 无效的 TSS 段 */
@@ -44,7 +46,7 @@ void do_invalid_TSS(unsigned long rsp, unsigned long error_code) {
   }
   /* 错误码的 15~3bit 记录的是段选择子 */
   color_printk(RED, BLACK, "Segment Selector Index: %#010x\n", error_code & 0xfff8);
-  while(1);
+  cpu_halt();
 }
 
 /* 14 #PF. 页错误异常 */
@@ -53,6 +55,11 @@ void do_page_fault(unsigned long rsp, unsigned long error_code) {
   unsigned long cr2 = 0;
   /* 获取 CR2 寄存器的值，CR2 寄存器保存了触发异常时的线性地址 */
   __asm__ __volatile__("movq %%cr2, %0" : "=r"(cr2)::"memory");
+
+  /* 应用层地址的缺页和写时复制由进程的虚拟内存区域处理，处理失败才是真正的错误 */
+  if(!do_user_page_fault(cr2, error_code))
+    return;
+
   p = (unsigned long *)(rsp + 0x98);
   color_printk(RED, BLACK, "do_page_fault(14), ERROR_CODE: %#018lx, RSP: %#018lx, RIP: %#018lx\n", error_code, rsp, *p);
 
@@ -82,39 +89,35 @@ void do_page_fault(unsigned long rsp, unsigned long error_code) {
 
   color_printk(RED, BLACK, "\n");
   color_printk(RED, BLACK, "CR2: %#018lx\n", cr2);
-  while(1);
+  cpu_halt();
 }
 
 void do_debug(struct pt_regs *regs, unsigned long error_code) {
   color_printk(RED, BLACK,
                "do_debug(1),ERROR_CODE:%#018lx,RSP:%#018lx,RIP:%#018lx\n",
                error_code, regs->rsp, regs->rip);
-  while (1)
-    ;
+  cpu_halt();
 }
 
 void do_int3(struct pt_regs *regs, unsigned long error_code) {
   color_printk(RED, BLACK,
                "do_int3(3),ERROR_CODE:%#018lx,RSP:%#018lx,RIP:%#018lx\n",
                error_code, regs->rsp, regs->rip);
-  while (1)
-    ;
+  cpu_halt();
 }
 
 void do_overflow(struct pt_regs *regs, unsigned long error_code) {
   color_printk(RED, BLACK,
                "do_overflow(4),ERROR_CODE:%#018lx,RSP:%#018lx,RIP:%#018lx\n",
                error_code, regs->rsp, regs->rip);
-  while (1)
-    ;
+  cpu_halt();
 }
 
 void do_bounds(struct pt_regs *regs, unsigned long error_code) {
   color_printk(RED, BLACK,
                "do_bounds(5),ERROR_CODE:%#018lx,RSP:%#018lx,RIP:%#018lx\n",
                error_code, regs->rsp, regs->rip);
-  while (1)
-    ;
+  cpu_halt();
 }
 
 void do_undefined_opcode(struct pt_regs *regs, unsigned long error_code) {
@@ -122,17 +125,12 @@ void do_undefined_opcode(struct pt_regs *regs, unsigned long error_code) {
       RED, BLACK,
       "do_undefined_opcode(6),ERROR_CODE:%#018lx,RSP:%#018lx,RIP:%#018lx\n",
       error_code, regs->rsp, regs->rip);
-  while (1)
-    ;
+  cpu_halt();
 }
 
+/* 7 #NM 设备不可用，CR0.TS 置位时使用 FPU/SSE/AVX 指令触发，用于延迟恢复进程的 FPU 状态 */
 void do_dev_not_available(struct pt_regs *regs, unsigned long error_code) {
-  color_printk(
-      RED, BLACK,
-      "do_dev_not_available(7),ERROR_CODE:%#018lx,RSP:%#018lx,RIP:%#018lx\n",
-      error_code, regs->rsp, regs->rip);
-  while (1)
-    ;
+  fpu_state_restore();
 }
 
 void do_double_fault(struct pt_regs *regs, unsigned long error_code) {
@@ -140,8 +138,7 @@ void do_double_fault(struct pt_regs *regs, unsigned long error_code) {
       RED, BLACK,
       "do_double_fault(8),ERROR_CODE:%#018lx,RSP:%#018lx,RIP:%#018lx\n",
       error_code, regs->rsp, regs->rip);
-  while (1)
-    ;
+  cpu_halt();
 }
 
 void do_coprocessor_segment_overrun(struct pt_regs *regs,
@@ -150,8 +147,7 @@ void do_coprocessor_segment_overrun(struct pt_regs *regs,
                "do_coprocessor_segment_overrun(9),ERROR_CODE:%#018lx,RSP:%#"
                "018lx,RIP:%#018lx\n",
                error_code, regs->rsp, regs->rip);
-  while (1)
-    ;
+  cpu_halt();
 }
 
 void do_segment_not_present(struct pt_regs * regs,unsigned long error_code)
@@ -174,7 +170,7 @@ void do_segment_not_present(struct pt_regs * regs,unsigned long error_code)
 
 	color_printk(RED,BLACK,"Segment Selector Index:%#010x\n",error_code & 0xfff8);
 
-	while(1);
+	cpu_halt();
 }
 
 void do_stack_segment_fault(struct pt_regs * regs,unsigned long error_code)
@@ -197,7 +193,7 @@ void do_stack_segment_fault(struct pt_regs * regs,unsigned long error_code)
 
 	color_printk(RED,BLACK,"Segment Selector Index:%#010x\n",error_code & 0xfff8);
 
-	while(1);
+	cpu_halt();
 }
 
 void do_general_protection(struct pt_regs * regs,unsigned long error_code)
@@ -220,64 +216,68 @@ void do_general_protection(struct pt_regs * regs,unsigned long error_code)
 
 	color_printk(RED,BLACK,"Segment Selector Index:%#010x\n",error_code & 0xfff8);
 
-	while(1);
+	cpu_halt();
 }
 
 void do_x87_FPU_error(struct pt_regs * regs,unsigned long error_code)
 {
 	color_printk(RED,BLACK,"do_x87_FPU_error(16),ERROR_CODE:%#018lx,RSP:%#018lx,RIP:%#018lx\n",error_code , regs->rsp , regs->rip);
-	while(1);
+	cpu_halt();
 }
 
 void do_alignment_check(struct pt_regs * regs,unsigned long error_code)
 {
 	color_printk(RED,BLACK,"do_alignment_check(17),ERROR_CODE:%#018lx,RSP:%#018lx,RIP:%#018lx\n",error_code , regs->rsp , regs->rip);
-	while(1);
+	cpu_halt();
 }
 
 void do_machine_check(struct pt_regs * regs,unsigned long error_code)
 {
 	color_printk(RED,BLACK,"do_machine_check(18),ERROR_CODE:%#018lx,RSP:%#018lx,RIP:%#018lx\n",error_code , regs->rsp , regs->rip);
-	while(1);
+	cpu_halt();
 }
 
 void do_SIMD_exception(struct pt_regs * regs,unsigned long error_code)
 {
 	color_printk(RED,BLACK,"do_SIMD_exception(19),ERROR_CODE:%#018lx,RSP:%#018lx,RIP:%#018lx\n",error_code , regs->rsp , regs->rip);
-	while(1);
+	cpu_halt();
 }
 
 void do_virtualization_exception(struct pt_regs * regs,unsigned long error_code)
 {
 	color_printk(RED,BLACK,"do_virtualization_exception(20),ERROR_CODE:%#018lx,RSP:%#018lx,RIP:%#018lx\n",error_code , regs->rsp , regs->rip);
-	while(1);
+	cpu_halt();
 }
 
-/* 设置 IDT 的各个表项 */
+/**
+ * 设置 IDT 的各个表项
+ * 异常在进程的内核栈上处理（IST = 0），只有 NMI、#DF 和 #MC 这些可能在栈不可用时发生的异常使用独立的 IST 栈
+ * 异常全部使用中断门，入口处的 swapgs 完成之前不会被中断打断，之后由 error_code 按照被打断程序的 IF 重新开启中断
+ */
 void sys_vector_init() {
-  set_trap_gate(0, 1, divide_error);
-  set_trap_gate(1, 1, debug);
+  set_intr_gate(0, 0, divide_error);
+  set_intr_gate(1, 0, debug);
   set_intr_gate(2, 1, nmi);
-  set_system_gate(3, 1, int3);
-  set_system_gate(4, 1, overflow);
-  set_system_gate(5, 1, bounds);
-  set_trap_gate(6, 1, undefined_opcode);
-  set_trap_gate(7, 1, dev_not_available);
-  set_trap_gate(8, 1, double_fault);
-  set_trap_gate(9, 1, coprocessor_segment_overrun);
-  set_trap_gate(10, 1, invalid_TSS);
-  set_trap_gate(11, 1, segment_not_present);
-  set_trap_gate(12, 1, stack_segment_fault);
-  set_trap_gate(13, 1, general_protection);
-  set_trap_gate(14, 1, page_fault);
+  set_system_intr_gate(3, 0, int3);
+  set_system_intr_gate(4, 0, overflow);
+  set_system_intr_gate(5, 0, bounds);
+  set_intr_gate(6, 0, undefined_opcode);
+  set_intr_gate(7, 0, dev_not_available);
+  set_intr_gate(8, 1, double_fault);
+  set_intr_gate(9, 0, coprocessor_segment_overrun);
+  set_intr_gate(10, 0, invalid_TSS);
+  set_intr_gate(11, 0, segment_not_present);
+  set_intr_gate(12, 0, stack_segment_fault);
+  set_intr_gate(13, 0, general_protection);
+  set_intr_gate(14, 0, page_fault);
 
   // 15 Intel reserved. Do not use.
 
-  set_trap_gate(16, 1, x87_FPU_error);
-  set_trap_gate(17, 1, alignment_check);
-  set_trap_gate(18, 1, machine_check);
-  set_trap_gate(19, 1, SIMD_exception);
-  set_trap_gate(20, 1, virtualization_exception);
+  set_intr_gate(16, 0, x87_FPU_error);
+  set_intr_gate(17, 0, alignment_check);
+  set_intr_gate(18, 1, machine_check);
+  set_intr_gate(19, 0, SIMD_exception);
+  set_intr_gate(20, 0, virtualization_exception);
 
   // set_system_gate(SYSTEM_CALL_VECTOR,7,system_call);
 }
\ No newline at end of file